@@ -0,0 +1,448 @@
+// Benchmarks compress and decompress, sync and async, across every format
+// and subsampling method, several image sizes, with and without
+// preallocated output buffers and at several concurrency levels.
+//
+// Results go to stdout as JSON, progress to stderr. Save the results of a
+// known good build and pass them as a baseline to flag regressions:
+//
+//   node bench > baseline.json
+//   node bench --baseline baseline.json
+//
+// Options:
+//
+//   --quick              A single small image size and fewer runs
+//   --time <ms>          Minimum time spent on each case (default 100)
+//   --filter <regex>     Only run cases whose name matches
+//   --baseline <file>    Compare against earlier results
+//   --threshold <pct>    Slowdown to treat as a regression (default 10)
+
+var fs = require('fs')
+var os = require('os')
+var path = require('path')
+
+var jpg = require('..')
+
+var FORMATS = constantsWithPrefix('FORMAT_')
+var SAMPLINGS = constantsWithPrefix('SAMP_')
+
+function constantsWithPrefix(prefix) {
+  return Object.keys(jpg).filter(function(key) {
+    return key.indexOf(prefix) === 0
+  }).map(function(key) {
+    return {name: key.slice(prefix.length), value: jpg[key]}
+  })
+}
+
+function parseArgs(argv) {
+  var args = {
+    quick: false,
+    time: 100,
+    filter: null,
+    baseline: null,
+    threshold: 10,
+  }
+
+  for (var i = 0; i < argv.length; ++i) {
+    switch (argv[i]) {
+      case '--quick':
+        args.quick = true
+        break
+      case '--time':
+        args.time = Number(argv[++i])
+        break
+      case '--filter':
+        args.filter = new RegExp(argv[++i])
+        break
+      case '--baseline':
+        args.baseline = argv[++i]
+        break
+      case '--threshold':
+        args.threshold = Number(argv[++i])
+        break
+      default:
+        throw new Error('Unknown argument ' + argv[i])
+    }
+  }
+
+  return args
+}
+
+function bytesPerPixel(format) {
+  switch (format) {
+    case jpg.FORMAT_GRAY:
+      return 1
+    case jpg.FORMAT_RGB:
+    case jpg.FORMAT_BGR:
+      return 3
+    default:
+      return 4
+  }
+}
+
+// Smooth gradients with a bit of noise, which compresses about as well as
+// a typical photo.
+function makeRaw(width, height, bpp) {
+  var raw = Buffer.alloc(width * height * bpp)
+  var seed = 1
+  var i = 0
+
+  for (var y = 0; y < height; ++y) {
+    for (var x = 0; x < width; ++x) {
+      seed = (seed * 1103515245 + 12345) & 0x7fffffff
+      for (var c = 0; c < bpp; ++c) {
+        raw[i++] = ((x * (c + 1) + y * (3 - c)) >> 2) + (seed >> 28) & 0xff
+      }
+    }
+  }
+
+  return raw
+}
+
+function percentile(sorted, p) {
+  var index = Math.min(sorted.length - 1, Math.floor(sorted.length * p))
+  return sorted[index]
+}
+
+function round(value) {
+  return Math.round(value * 1000) / 1000
+}
+
+function summarize(testCase, latencies, elapsed, peakRss) {
+  var sorted = latencies.slice().sort(function(a, b) {
+    return a - b
+  })
+  var pixels = testCase.width * testCase.height * latencies.length
+
+  return {
+    name: testCase.name,
+    op: testCase.op,
+    mode: testCase.mode,
+    concurrency: testCase.concurrency,
+    format: testCase.format.name,
+    subsampling: testCase.subsampling.name,
+    width: testCase.width,
+    height: testCase.height,
+    out: testCase.out,
+    iterations: latencies.length,
+    mpps: round(pixels / elapsed / 1e3),
+    latency: {
+      mean: round(latencies.reduce(function(a, b) {
+        return a + b
+      }, 0) / latencies.length),
+      p50: round(percentile(sorted, 0.5)),
+      p90: round(percentile(sorted, 0.9)),
+      p99: round(percentile(sorted, 0.99)),
+      max: round(sorted[sorted.length - 1]),
+    },
+    peakRss: peakRss,
+  }
+}
+
+function now() {
+  var t = process.hrtime()
+  return t[0] * 1e3 + t[1] / 1e6
+}
+
+// Prepares the arguments for a single call, including its own output
+// buffer if the case wants one.
+function makeCall(testCase) {
+  var out = null
+
+  if (testCase.out) {
+    out = Buffer.alloc(testCase.outSize)
+  }
+
+  return out ? [testCase.input, out, testCase.options]
+             : [testCase.input, testCase.options]
+}
+
+function runSync(testCase, time) {
+  var fn = jpg[testCase.op + 'Sync']
+  var args = makeCall(testCase)
+  var latencies = []
+  var peakRss = 0
+  var started = now()
+  var elapsed = 0
+
+  while (elapsed < time || latencies.length < 3) {
+    var before = now()
+    fn.apply(null, args)
+    var after = now()
+    latencies.push(after - before)
+    elapsed = after - started
+    if ((latencies.length & 15) === 1) {
+      peakRss = Math.max(peakRss, process.memoryUsage().rss)
+    }
+  }
+
+  peakRss = Math.max(peakRss, process.memoryUsage().rss)
+  return Promise.resolve(summarize(testCase, latencies, elapsed, peakRss))
+}
+
+// Keeps testCase.concurrency jobs in flight until the time is up.
+function runAsync(testCase, time) {
+  var fn = jpg[testCase.op]
+
+  return new Promise(function(resolve, reject) {
+    var latencies = []
+    var peakRss = 0
+    var started = now()
+    var running = 0
+    var failed = false
+
+    function submit(args) {
+      var before = now()
+      running++
+      fn.apply(null, args.concat(function(err) {
+        running--
+        if (failed) {
+          return
+        }
+        if (err) {
+          failed = true
+          return reject(err instanceof Error ? err : new Error(err))
+        }
+
+        var after = now()
+        latencies.push(after - before)
+        if ((latencies.length & 15) === 1) {
+          peakRss = Math.max(peakRss, process.memoryUsage().rss)
+        }
+
+        if (after - started < time || latencies.length < 3) {
+          return submit(args)
+        }
+        if (running === 0) {
+          peakRss = Math.max(peakRss, process.memoryUsage().rss)
+          resolve(summarize(testCase, latencies, after - started, peakRss))
+        }
+      }))
+    }
+
+    for (var i = 0; i < testCase.concurrency; ++i) {
+      submit(makeCall(testCase))
+    }
+  })
+}
+
+function buildCases(args) {
+  var sizes = args.quick
+    ? [[640, 480]]
+    : [[320, 240], [1920, 1080], [3840, 2160]]
+  var concurrencies = args.quick
+    ? [1, os.cpus().length]
+    : [1, 4, os.cpus().length]
+  var modes = [{mode: 'sync', concurrency: 1}]
+  var cases = []
+  var images = {}
+  var raws = {}
+
+  concurrencies.filter(function(value, index) {
+    return concurrencies.indexOf(value) === index
+  }).forEach(function(concurrency) {
+    modes.push({mode: 'async', concurrency: concurrency})
+  })
+
+  function add(testCase) {
+    testCase.name = [
+      testCase.op,
+      testCase.mode + (testCase.mode === 'async'
+        ? '-c' + testCase.concurrency : ''),
+      testCase.format.name,
+      testCase.subsampling.name,
+      testCase.width + 'x' + testCase.height,
+      testCase.out ? 'out' : 'alloc',
+    ].join('/')
+
+    if (!args.filter || args.filter.test(testCase.name)) {
+      cases.push(testCase)
+    }
+  }
+
+  sizes.forEach(function(size) {
+    var width = size[0]
+    var height = size[1]
+
+    FORMATS.forEach(function(format) {
+      SAMPLINGS.forEach(function(subsampling) {
+        // Grayscale input can only make grayscale output
+        if (format.value === jpg.FORMAT_GRAY &&
+            subsampling.value !== jpg.SAMP_GRAY) {
+          return
+        }
+
+        modes.forEach(function(mode) {
+          [false, true].forEach(function(out) {
+            var bpp = bytesPerPixel(format.value)
+            var rawKey = width + 'x' + height + 'x' + bpp
+            var options = {
+              format: format.value,
+              width: width,
+              height: height,
+              subsampling: subsampling.value,
+            }
+
+            add({
+              op: 'compress',
+              mode: mode.mode,
+              concurrency: mode.concurrency,
+              format: format,
+              subsampling: subsampling,
+              width: width,
+              height: height,
+              out: out,
+              options: options,
+              outSize: jpg.bufferSize(options),
+              get input() {
+                return raws[rawKey] ||
+                  (raws[rawKey] = makeRaw(width, height, bpp))
+              },
+            })
+          })
+        })
+      })
+    })
+
+    SAMPLINGS.forEach(function(subsampling) {
+      var imageKey = width + 'x' + height + 'x' + subsampling.name
+
+      FORMATS.forEach(function(format) {
+        modes.forEach(function(mode) {
+          [false, true].forEach(function(out) {
+            add({
+              op: 'decompress',
+              mode: mode.mode,
+              concurrency: mode.concurrency,
+              format: format,
+              subsampling: subsampling,
+              width: width,
+              height: height,
+              out: out,
+              options: {format: format.value},
+              outSize: width * height * bytesPerPixel(format.value),
+              get input() {
+                if (!images[imageKey]) {
+                  var rawKey = width + 'x' + height + 'x3'
+                  var raw = raws[rawKey] ||
+                    (raws[rawKey] = makeRaw(width, height, 3))
+                  images[imageKey] = jpg.compressSync(raw, {
+                    format: jpg.FORMAT_RGB,
+                    width: width,
+                    height: height,
+                    subsampling: subsampling.value,
+                  })
+                }
+                return images[imageKey]
+              },
+            })
+          })
+        })
+      })
+    })
+  })
+
+  return cases
+}
+
+function compare(results, baseline, threshold) {
+  var previous = {}
+  var regressions = []
+  var improvements = []
+  var compared = 0
+
+  baseline.cases.forEach(function(result) {
+    previous[result.name] = result
+  })
+
+  results.forEach(function(result) {
+    var base = previous[result.name]
+    if (!base || !base.mpps) {
+      return
+    }
+
+    var change = round((result.mpps - base.mpps) / base.mpps * 100)
+    var entry = {
+      name: result.name,
+      baseline: base.mpps,
+      current: result.mpps,
+      change: change,
+    }
+
+    compared++
+    if (change < -threshold) {
+      regressions.push(entry)
+    }
+    else if (change > threshold) {
+      improvements.push(entry)
+    }
+  })
+
+  return {
+    threshold: threshold,
+    compared: compared,
+    regressions: regressions,
+    improvements: improvements,
+  }
+}
+
+function main() {
+  var args = parseArgs(process.argv.slice(2))
+  var baseline = args.baseline
+    ? JSON.parse(fs.readFileSync(args.baseline, 'utf8'))
+    : null
+  var cases = buildCases(args)
+  var results = []
+  var time = args.quick ? Math.min(args.time, 50) : args.time
+  var pkg = require(path.join(__dirname, '..', 'package.json'))
+
+  cases.reduce(function(previous, testCase, index) {
+    return previous.then(function() {
+      var run = testCase.mode === 'sync' ? runSync : runAsync
+      return run(testCase, time).then(function(result) {
+        results.push(result)
+        process.stderr.write('[' + (index + 1) + '/' + cases.length + '] ' +
+          result.name + ' ' + result.mpps + ' MP/s, p50 ' +
+          result.latency.p50 + ' ms\n')
+      })
+    })
+  }, Promise.resolve()).then(function() {
+    var report = {
+      version: pkg.version,
+      node: process.version,
+      platform: process.platform,
+      arch: process.arch,
+      cpus: os.cpus().length,
+      cpu: os.cpus()[0] ? os.cpus()[0].model : null,
+      date: new Date().toISOString(),
+      time: time,
+      peakRss: process.resourceUsage
+        ? process.resourceUsage().maxRSS * 1024
+        : Math.max.apply(null, results.map(function(result) {
+          return result.peakRss
+        })),
+      cases: results,
+    }
+
+    if (baseline) {
+      report.comparison = compare(results, baseline, args.threshold)
+      report.comparison.regressions.forEach(function(entry) {
+        process.stderr.write('REGRESSION ' + entry.name + ': ' +
+          entry.baseline + ' -> ' + entry.current + ' MP/s (' +
+          entry.change + '%)\n')
+      })
+      process.stderr.write(report.comparison.regressions.length +
+        ' regressions in ' + report.comparison.compared +
+        ' compared cases\n')
+      if (report.comparison.regressions.length > 0) {
+        process.exitCode = 1
+      }
+    }
+
+    process.stdout.write(JSON.stringify(report, null, 2) + '\n')
+  }).catch(function(err) {
+    process.stderr.write(err.stack + '\n')
+    process.exitCode = 2
+  })
+}
+
+main()
@@ -3,10 +3,31 @@
     {
       'target_name': '<(module_name)',
       'sources': [
+        'src/arena.cc',
+        'src/batch.cc',
         'src/buffersize.cc',
         'src/compress.cc',
+        'src/compressstream.cc',
+        'src/decoder.cc',
         'src/decompress.cc',
+        'src/decompressstream.cc',
+        'src/encoder.cc',
         'src/exports.cc',
+        'src/file.cc',
+        'src/handles.cc',
+        'src/inspect.cc',
+        'src/libjpeg.cc',
+        'src/parallel.cc',
+        'src/pool.cc',
+        'src/recompress.cc',
+        'src/requantize.cc',
+        'src/restart.cc',
+        'src/scratch.cc',
+        'src/stats.cc',
+        'src/thumbnail.cc',
+        'src/transfer.cc',
+        'src/transform.cc',
+        'src/yuv.cc',
       ],
       'include_dirs': [
         '<!(node -e "require(\'nan\')")'
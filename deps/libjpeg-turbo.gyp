@@ -93,8 +93,22 @@
       ],
       'direct_dependent_settings': {
         'include_dirs': [
+          'include',
           'libjpeg-turbo',
         ],
+        # jconfig.h is empty, so anyone including jpeglib.h needs the same
+        # configuration or the structs won't match the library.
+        'defines': [
+          'BITS_IN_JSAMPLE=8',
+          'C_ARITH_CODING_SUPPORTED=1',
+          'D_ARITH_CODING_SUPPORTED=1',
+          'HAVE_STDDEF_H=1',
+          'HAVE_STDLIB_H=1',
+          'HAVE_UNSIGNED_CHAR=1',
+          'HAVE_UNSIGNED_SHORT=1',
+          'JPEG_LIB_VERSION=62',
+          'MEM_SRCDST_SUPPORTED=1',
+        ],
       },
       'defines': [
         'BUILD="8f1c0a681cd34e8e80ba7b06f356d6080a7172c9"',
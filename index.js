@@ -1,4 +1,6 @@
 var path = require('path')
+var stream = require('stream')
+var util = require('util')
 
 var binary = require('node-pre-gyp')
 
@@ -17,9 +19,275 @@ module.exports.compressSync = function(buffer, optionalOutBuffer, options) {
   return out.data.slice(0, out.size)
 }
 
+// Like compressSync(), but for a targetSize, so the result also tells the
+// quality that was picked, like for compress().
+module.exports.compressToSizeSync = function(buffer, optionalOutBuffer, options) {
+  var opts = Buffer.isBuffer(optionalOutBuffer) ? options : optionalOutBuffer
+  if (!opts || !opts.targetSize) {
+    throw new TypeError('Missing targetSize')
+  }
+  var out = binding.compressSync(buffer, optionalOutBuffer, options)
+  return {data: out.data.slice(0, out.size), size: out.size, quality: out.quality}
+}
+
 // Convenience wrapper for Buffer slicing.
 module.exports.decompressSync = function(buffer, optionalOutBuffer, options) {
   var out = binding.decompressSync(buffer, optionalOutBuffer, options)
+  if (Buffer.isBuffer(out.data)) {
+    out.data = out.data.slice(out.offset, out.offset + out.size)
+  }
+  return out
+}
+
+// Convenience wrapper for Buffer slicing.
+module.exports.decompressFileSync = function(path, optionalOutBuffer, options) {
+  var out = binding.decompressFileSync(path, optionalOutBuffer, options)
   out.data = out.data.slice(0, out.size)
   return out
 }
+
+// Convenience wrapper for Buffer slicing.
+module.exports.compressYUVSync = function(planes, optionalOutBuffer, options) {
+  var out = binding.compressYUVSync(planes, optionalOutBuffer, options)
+  return out.data.slice(0, out.size)
+}
+
+// Convenience wrapper for Buffer slicing.
+module.exports.transformSync = function(buffer, optionalOutBuffer, options) {
+  var out = binding.transformSync(buffer, optionalOutBuffer, options)
+  if (Array.isArray(out)) {
+    return out.map(function(result) {
+      return result.data
+    })
+  }
+  return out.data.slice(0, out.size)
+}
+
+// Convenience wrapper for Buffer slicing.
+module.exports.recompressSync = function(buffer, optionalOutBuffer, options) {
+  var out = binding.recompressSync(buffer, optionalOutBuffer, options)
+  return out.data.slice(0, out.size)
+}
+
+function abortError() {
+  var err = new Error('Aborted')
+  err.name = 'AbortError'
+  err.code = 'ABORT_ERR'
+  return err
+}
+
+// Returns a Promise if no callback is given. If the options (the last
+// argument) have an AbortSignal as the signal property, the job is cancelled
+// when the signal fires and the call fails with an AbortError right away.
+function promisify(fn) {
+  return function() {
+    var args = Array.prototype.slice.call(arguments)
+    var callback = null
+    var promise
+
+    if (typeof args[args.length - 1] === 'function') {
+      callback = args.pop()
+    }
+    else {
+      promise = new Promise(function(resolve, reject) {
+        callback = function(err, result) {
+          if (err) {
+            return reject(err)
+          }
+          resolve(result)
+        }
+      })
+    }
+
+    var options = args[args.length - 1]
+    var signal = options && !Buffer.isBuffer(options) && options.signal
+    var settled = false
+    var token = null
+
+    function onAbort() {
+      if (token) {
+        token.writeInt32LE(1, 0)
+      }
+      done(abortError())
+      // A job that hasn't started yet doesn't need to wait for a thread
+      if (token) {
+        binding.cancelQueued(token)
+      }
+    }
+
+    function done(err, result) {
+      if (settled) {
+        return
+      }
+      settled = true
+      if (signal) {
+        signal.removeEventListener('abort', onAbort)
+      }
+      if (err && !(err instanceof Error)) {
+        err = new Error(err)
+      }
+      callback(err, result)
+    }
+
+    if (signal) {
+      if (signal.aborted) {
+        process.nextTick(done, abortError())
+        return promise
+      }
+      token = Buffer.alloc(4)
+      args[args.length - 1] = Object.assign({}, options, {cancelToken: token})
+      signal.addEventListener('abort', onAbort)
+    }
+
+    args.push(done)
+    fn.apply(null, args)
+    return promise
+  }
+}
+
+module.exports.compress = promisify(binding.compress)
+module.exports.decompress = promisify(binding.decompress)
+module.exports.compressToFile = promisify(binding.compressToFile)
+module.exports.decompressFile = promisify(binding.decompressFile)
+module.exports.compressBatch = promisify(binding.compressBatch)
+module.exports.decompressBatch = promisify(binding.decompressBatch)
+module.exports.thumbnail = promisify(binding.thumbnail)
+module.exports.recompress = promisify(binding.recompress)
+module.exports.transform = promisify(binding.transform)
+module.exports.inspect = promisify(binding.inspect)
+module.exports.compressYUV = promisify(binding.compressYUV)
+module.exports.decompressYUV = promisify(binding.decompressYUV)
+
+// Compresses frames of a fixed size and format with settings validated once.
+// The returned Buffer is only valid until the next call.
+function Encoder(options) {
+  if (!(this instanceof Encoder)) {
+    return new Encoder(options)
+  }
+  this._encoder = new binding.Encoder(options)
+}
+
+Encoder.prototype.encode = function(raw) {
+  var out = this._encoder.encode(raw)
+  return out.data.slice(0, out.size)
+}
+
+module.exports.Encoder = Encoder
+
+// Decompresses frames with settings validated once. The returned data is
+// only valid until the next call.
+function Decoder(options) {
+  if (!(this instanceof Decoder)) {
+    return new Decoder(options)
+  }
+  this._decoder = new binding.Decoder(options)
+}
+
+Decoder.prototype.decode = function(image) {
+  var out = this._decoder.decode(image)
+  out.data = out.data.slice(0, out.size)
+  return out
+}
+
+module.exports.Decoder = Decoder
+
+// Decodes JPG data as it arrives, pushing bands of decoded rows.
+function DecompressStream(options) {
+  if (!(this instanceof DecompressStream)) {
+    return new DecompressStream(options)
+  }
+  stream.Transform.call(this, {readableObjectMode: true})
+  this._decoder = new binding.DecompressStream(options)
+}
+
+util.inherits(DecompressStream, stream.Transform)
+
+DecompressStream.prototype._handleResult = function(result) {
+  if (result.header) {
+    this.header = result.header
+    this.emit('header', result.header)
+  }
+  for (var i = 0; i < result.bands.length; ++i) {
+    var band = result.bands[i]
+    band.width = this.header.width
+    band.format = this.header.format
+    this.push(band)
+  }
+}
+
+DecompressStream.prototype._transform = function(chunk, encoding, callback) {
+  var self = this
+  this._decoder.write(chunk, function(err, result) {
+    if (err) {
+      return callback(err instanceof Error ? err : new Error(err))
+    }
+    self._handleResult(result)
+    callback()
+  })
+}
+
+DecompressStream.prototype._flush = function(callback) {
+  var self = this
+  this._decoder.end(function(err, result) {
+    if (err) {
+      return callback(err instanceof Error ? err : new Error(err))
+    }
+    self._handleResult(result)
+    callback()
+  })
+}
+
+module.exports.DecompressStream = DecompressStream
+module.exports.createDecompressStream = function(options) {
+  return new DecompressStream(options)
+}
+
+// Encodes raw rows as they arrive, pushing chunks of JPG data. Input may be
+// split anywhere; partial rows are held back until the rest arrives.
+function CompressStream(options) {
+  if (!(this instanceof CompressStream)) {
+    return new CompressStream(options)
+  }
+  stream.Transform.call(this)
+  this._encoder = new binding.CompressStream(options)
+  this._remainder = null
+}
+
+util.inherits(CompressStream, stream.Transform)
+
+CompressStream.prototype._handleResult = function(callback, err, result) {
+  if (err) {
+    return callback(err instanceof Error ? err : new Error(err))
+  }
+  for (var i = 0; i < result.chunks.length; ++i) {
+    this.push(result.chunks[i])
+  }
+  callback()
+}
+
+CompressStream.prototype._transform = function(chunk, encoding, callback) {
+  var pitch = this._encoder.pitch
+  if (this._remainder) {
+    chunk = Buffer.concat([this._remainder, chunk])
+  }
+  var length = chunk.length - chunk.length % pitch
+  this._remainder = length < chunk.length ? chunk.slice(length) : null
+  if (length === 0) {
+    return callback()
+  }
+  this._encoder.write(chunk.slice(0, length),
+    this._handleResult.bind(this, callback))
+}
+
+CompressStream.prototype._flush = function(callback) {
+  var done = this._handleResult.bind(this, callback)
+  if (this._remainder) {
+    return this._encoder.end(this._remainder, done)
+  }
+  this._encoder.end(done)
+}
+
+module.exports.CompressStream = CompressStream
+module.exports.createCompressStream = function(options) {
+  return new CompressStream(options)
+}
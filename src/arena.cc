@@ -0,0 +1,269 @@
+#include "exports.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// Slabs come in power of two sizes starting at 4k
+#define NJT_ARENA_MIN_SHIFT 12
+#define NJT_ARENA_CLASSES 36
+
+// Sits right before the data handed out, which keeps the data aligned for
+// SIMD.
+typedef union njt_slab {
+  struct {
+    struct njt_arena* arena;
+    union njt_slab* next;
+    uint32_t sizeClass;
+  } header;
+  double align[4];
+} njt_slab;
+
+// Every outstanding slab holds a reference, so the arena outlives its JS
+// object if Buffers from it are still around.
+struct njt_arena {
+  uv_mutex_t mutex;
+  uint32_t refs;
+  bool alive;
+  size_t maxBytes;
+  size_t cachedBytes;
+  uint32_t outstanding;
+  double hits;
+  double misses;
+  double recycled;
+  double dropped;
+  njt_slab* slabs[NJT_ARENA_CLASSES];
+};
+
+static Nan::Persistent<FunctionTemplate> arenaTemplate;
+
+static size_t classSize(uint32_t sizeClass) {
+  return (size_t) 1 << (sizeClass + NJT_ARENA_MIN_SHIFT);
+}
+
+static void purgeArena(njt_arena* arena) {
+  njt_slab* slab;
+  uint32_t i;
+
+  for (i = 0; i < NJT_ARENA_CLASSES; i++) {
+    while (arena->slabs[i] != NULL) {
+      slab = arena->slabs[i];
+      arena->slabs[i] = slab->header.next;
+      free(slab);
+    }
+  }
+
+  arena->cachedBytes = 0;
+}
+
+static void destroyArena(njt_arena* arena) {
+  purgeArena(arena);
+  uv_mutex_destroy(&arena->mutex);
+  free(arena);
+}
+
+unsigned char* njtArenaAlloc(njt_arena* arena, size_t size) {
+  njt_slab* slab = NULL;
+  uint32_t sizeClass = 0;
+
+  while (classSize(sizeClass) < size) {
+    sizeClass++;
+  }
+
+  if (sizeClass >= NJT_ARENA_CLASSES) {
+    return NULL;
+  }
+
+  uv_mutex_lock(&arena->mutex);
+  if (arena->slabs[sizeClass] != NULL) {
+    slab = arena->slabs[sizeClass];
+    arena->slabs[sizeClass] = slab->header.next;
+    arena->cachedBytes -= classSize(sizeClass);
+    arena->hits++;
+  }
+  else {
+    arena->misses++;
+  }
+  arena->refs++;
+  arena->outstanding++;
+  uv_mutex_unlock(&arena->mutex);
+
+  if (slab == NULL) {
+    slab = (njt_slab*) malloc(sizeof(njt_slab) + classSize(sizeClass));
+    if (slab == NULL) {
+      njtArenaFreeCallback(NULL, arena);
+      return NULL;
+    }
+    slab->header.arena = arena;
+    slab->header.sizeClass = sizeClass;
+  }
+
+  return (unsigned char*) (slab + 1);
+}
+
+// Gives the slab back to the arena rather than to the system, unless the
+// arena is already full or gone. Also used to drop the reference taken for
+// a failed allocation, in which case data is NULL and hint is the arena.
+void njtArenaFreeCallback(char* data, void* hint) {
+  njt_slab* slab = NULL;
+  njt_arena* arena = (njt_arena*) hint;
+  bool destroy;
+
+  if (data != NULL) {
+    slab = ((njt_slab*) data) - 1;
+    arena = slab->header.arena;
+  }
+
+  uv_mutex_lock(&arena->mutex);
+  arena->outstanding--;
+  if (slab != NULL) {
+    if (arena->alive && arena->cachedBytes + classSize(slab->header.sizeClass) <= arena->maxBytes) {
+      slab->header.next = arena->slabs[slab->header.sizeClass];
+      arena->slabs[slab->header.sizeClass] = slab;
+      arena->cachedBytes += classSize(slab->header.sizeClass);
+      arena->recycled++;
+      slab = NULL;
+    }
+    else {
+      arena->dropped++;
+    }
+  }
+  destroy = --arena->refs == 0;
+  uv_mutex_unlock(&arena->mutex);
+
+  free(slab);
+
+  if (destroy) {
+    destroyArena(arena);
+  }
+}
+
+class BufferArena : public ObjectWrap {
+  public:
+    static NAN_METHOD(Construct) {
+      int retval = 0;
+      char errStr[NJT_MSG_LENGTH_MAX];
+
+      Local<Object> options;
+      Local<Value> maxBytesObject;
+      double maxBytes = NJT_DEFAULT_ARENA_MAX_BYTES;
+      njt_arena* arena;
+      BufferArena* obj;
+
+      if (!info.IsConstructCall()) {
+        _throw("Constructor must be called with new");
+      }
+
+      // Options are optional
+      options = info[0].As<Object>();
+      if (options->IsObject()) {
+        maxBytesObject = options->Get(New("maxBytes").ToLocalChecked());
+        if (!maxBytesObject->IsUndefined()) {
+          if (!maxBytesObject->IsNumber() || !(maxBytesObject->NumberValue() >= 0)) {
+            _throw("Invalid maxBytes value");
+          }
+          maxBytes = maxBytesObject->NumberValue();
+        }
+      }
+
+      arena = (njt_arena*) calloc(1, sizeof(njt_arena));
+      if (arena == NULL) {
+        _throw("Unable to allocate arena");
+      }
+
+      uv_mutex_init(&arena->mutex);
+      arena->refs = 1;
+      arena->alive = true;
+      arena->maxBytes = (size_t) maxBytes;
+
+      obj = new BufferArena(arena);
+      obj->Wrap(info.This());
+      info.GetReturnValue().Set(info.This());
+
+      bailout:
+      if (retval != 0) {
+        ThrowError(TypeError(errStr));
+        return;
+      }
+    }
+
+    static NAN_METHOD(Stats) {
+      BufferArena* obj = ObjectWrap::Unwrap<BufferArena>(info.This());
+      njt_arena* arena = obj->arena;
+      Local<Object> stats = New<Object>();
+
+      uv_mutex_lock(&arena->mutex);
+      stats->Set(New("hits").ToLocalChecked(), New(arena->hits));
+      stats->Set(New("misses").ToLocalChecked(), New(arena->misses));
+      stats->Set(New("recycled").ToLocalChecked(), New(arena->recycled));
+      stats->Set(New("dropped").ToLocalChecked(), New(arena->dropped));
+      stats->Set(New("outstanding").ToLocalChecked(), New(arena->outstanding));
+      stats->Set(New("cachedBytes").ToLocalChecked(), New((double) arena->cachedBytes));
+      stats->Set(New("maxBytes").ToLocalChecked(), New((double) arena->maxBytes));
+      uv_mutex_unlock(&arena->mutex);
+
+      info.GetReturnValue().Set(stats);
+    }
+
+    static NAN_METHOD(Purge) {
+      BufferArena* obj = ObjectWrap::Unwrap<BufferArena>(info.This());
+
+      uv_mutex_lock(&obj->arena->mutex);
+      purgeArena(obj->arena);
+      uv_mutex_unlock(&obj->arena->mutex);
+    }
+
+    njt_arena* arena;
+
+  private:
+    explicit BufferArena(njt_arena* arena) :
+      arena(arena) {
+      }
+
+    ~BufferArena() {
+      bool destroy;
+
+      uv_mutex_lock(&this->arena->mutex);
+      this->arena->alive = false;
+      purgeArena(this->arena);
+      destroy = --this->arena->refs == 0;
+      uv_mutex_unlock(&this->arena->mutex);
+
+      if (destroy) {
+        destroyArena(this->arena);
+      }
+    }
+};
+
+// The caller must keep arenaObject alive for as long as it uses the arena.
+int njtParseArena(Local<Object> options, Local<Object>* arenaObject, njt_arena** arena, char* errStr) {
+  int retval = 0;
+  Local<Value> arenaValue;
+
+  *arena = NULL;
+
+  arenaValue = options->Get(New("arena").ToLocalChecked());
+  if (!arenaValue->IsUndefined()) {
+    if (!New(arenaTemplate)->HasInstance(arenaValue)) {
+      _throw("Invalid arena");
+    }
+    *arenaObject = arenaValue.As<Object>();
+    *arena = ObjectWrap::Unwrap<BufferArena>(*arenaObject)->arena;
+  }
+
+  bailout:
+  return retval;
+}
+
+NAN_MODULE_INIT(InitBufferArena) {
+  Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(BufferArena::Construct);
+  tpl->SetClassName(Nan::New("BufferArena").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+  SetPrototypeMethod(tpl, "stats", BufferArena::Stats);
+  SetPrototypeMethod(tpl, "purge", BufferArena::Purge);
+
+  arenaTemplate.Reset(tpl);
+  Nan::Set(target, Nan::New("BufferArena").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+}
@@ -0,0 +1,424 @@
+#include "exports.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+typedef struct {
+  unsigned char* srcData;
+  njt_compress_options options;
+  unsigned long jpegSize;
+  unsigned char* dstData;
+  int retval;
+  char errStr[NJT_MSG_LENGTH_MAX];
+} njt_compress_batch_item;
+
+typedef struct {
+  unsigned char* srcData;
+  uint32_t srcLength;
+  njt_decompress_options options;
+  int width;
+  int height;
+  uint32_t dstLength;
+  unsigned char* dstData;
+  int retval;
+  char errStr[NJT_MSG_LENGTH_MAX];
+} njt_decompress_batch_item;
+
+static void compressBatchItem(uint32_t index, void* data) {
+  njt_compress_batch_item* item = &((njt_compress_batch_item*) data)[index];
+
+  // Already failed while parsing
+  if (item->retval != 0) {
+    return;
+  }
+
+  item->retval = compress(
+      item->srcData,
+      &item->options,
+      &item->jpegSize,
+      &item->dstData,
+      0,
+      item->errStr);
+}
+
+static void decompressBatchItem(uint32_t index, void* data) {
+  njt_decompress_batch_item* item = &((njt_decompress_batch_item*) data)[index];
+
+  // Already failed while parsing
+  if (item->retval != 0) {
+    return;
+  }
+
+  item->retval = decompress(
+      item->srcData,
+      item->srcLength,
+      &item->options,
+      &item->width,
+      &item->height,
+      &item->dstLength,
+      &item->dstData,
+      0,
+      item->errStr);
+}
+
+class CompressBatchWorker : public AsyncWorker {
+  public:
+    CompressBatchWorker(Callback *callback, Local<Array> &srcObjects, njt_compress_batch_item* items, uint32_t count, uint32_t priority) :
+      AsyncWorker(callback),
+      items(items),
+      count(count),
+      priority(priority) {
+        SaveToPersistent("srcObjects", srcObjects);
+      }
+
+    ~CompressBatchWorker() {
+      uint32_t i;
+
+      for (i = 0; i < this->count; i++) {
+        if (this->items[i].dstData != NULL) {
+          tjFree(this->items[i].dstData);
+        }
+      }
+
+      free(this->items);
+    }
+
+    void Execute () {
+      njtParallelFor(this->count, 0, this->priority, compressBatchItem, this->items);
+    }
+
+    void HandleOKCallback () {
+      Local<Array> results = New<Array>(this->count);
+      njt_compress_batch_item* item;
+      uint32_t i;
+
+      for (i = 0; i < this->count; i++) {
+        Local<Object> obj = New<Object>();
+        item = &this->items[i];
+
+        if (item->retval != 0) {
+          obj->Set(New("error").ToLocalChecked(), Error(item->errStr));
+        }
+        else {
+          obj->Set(New("data").ToLocalChecked(), NewBuffer((char*)item->dstData, item->jpegSize, compressBufferFreeCallback, NULL).ToLocalChecked());
+          obj->Set(New("size").ToLocalChecked(), New((uint32_t) item->jpegSize));
+          if (item->options.targetSize > 0) {
+            obj->Set(New("quality").ToLocalChecked(), New(item->options.quality));
+          }
+          item->dstData = NULL;
+        }
+
+        results->Set(i, obj);
+      }
+
+      Local<Value> argv[] = {
+        Null(),
+        results
+      };
+
+      callback->Call(2, argv);
+    }
+
+  private:
+    njt_compress_batch_item* items;
+    uint32_t count;
+    uint32_t priority;
+};
+
+class DecompressBatchWorker : public AsyncWorker {
+  public:
+    DecompressBatchWorker(Callback *callback, Local<Array> &srcObjects, njt_decompress_batch_item* items, uint32_t count, uint32_t priority) :
+      AsyncWorker(callback),
+      items(items),
+      count(count),
+      priority(priority) {
+        SaveToPersistent("srcObjects", srcObjects);
+      }
+
+    ~DecompressBatchWorker() {
+      uint32_t i;
+
+      for (i = 0; i < this->count; i++) {
+        if (this->items[i].dstData != NULL) {
+          free(this->items[i].dstData);
+        }
+      }
+
+      free(this->items);
+    }
+
+    void Execute () {
+      njtParallelFor(this->count, 0, this->priority, decompressBatchItem, this->items);
+    }
+
+    void HandleOKCallback () {
+      Local<Array> results = New<Array>(this->count);
+      njt_decompress_batch_item* item;
+      uint32_t i;
+
+      for (i = 0; i < this->count; i++) {
+        Local<Object> obj = New<Object>();
+        item = &this->items[i];
+
+        if (item->retval != 0) {
+          obj->Set(New("error").ToLocalChecked(), Error(item->errStr));
+        }
+        else {
+          obj->Set(New("data").ToLocalChecked(), NewBuffer((char*)item->dstData, item->dstLength, decompressBufferFreeCallback, NULL).ToLocalChecked());
+          obj->Set(New("width").ToLocalChecked(), New(item->width));
+          obj->Set(New("height").ToLocalChecked(), New(item->height));
+          obj->Set(New("size").ToLocalChecked(), New(item->dstLength));
+          obj->Set(New("format").ToLocalChecked(), New(item->options.format));
+          item->dstData = NULL;
+        }
+
+        results->Set(i, obj);
+      }
+
+      Local<Value> argv[] = {
+        Null(),
+        results
+      };
+
+      callback->Call(2, argv);
+    }
+
+  private:
+    njt_decompress_batch_item* items;
+    uint32_t count;
+    uint32_t priority;
+};
+
+// Validates the arguments shared by both batch methods. Options may either be
+// a single Object used for every item, or an Array with one Object per item.
+static int batchParseArguments(const Nan::FunctionCallbackInfo<Value>& info, Callback** callback, Local<Array>* srcArray, Local<Object>* options, bool* perItem, char* errStr) {
+  int retval = 0;
+
+  if (info.Length() > 0 && info[info.Length() - 1]->IsFunction()) {
+    *callback = new Callback(info[info.Length() - 1].As<Function>());
+  }
+  else {
+    _throw("Missing callback");
+  }
+
+  if (info.Length() < 3) {
+    _throw("Too few arguments");
+  }
+
+  if (!info[0]->IsArray()) {
+    _throw("Invalid source buffers");
+  }
+  *srcArray = info[0].As<Array>();
+
+  *options = info[1].As<Object>();
+  *perItem = info[1]->IsArray();
+
+  if (*perItem) {
+    if ((*options).As<Array>()->Length() != (*srcArray)->Length()) {
+      _throw("Options must have one entry per source buffer");
+    }
+  }
+  else if (!(*options)->IsObject()) {
+    _throw("Options must be an object");
+  }
+
+  bailout:
+  return retval;
+}
+
+static void batchBailout(Callback* callback, char* errStr) {
+  if (NULL == callback) {
+    ThrowError(TypeError(errStr));
+  }
+  else {
+    Local<Value> argv[] = {
+      New(errStr).ToLocalChecked()
+    };
+    callback->Call(1, argv);
+  }
+}
+
+NAN_METHOD(CompressBatch) {
+  int retval = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+
+  Callback *callback = NULL;
+  Local<Array> srcArray;
+  Local<Object> options;
+  bool perItem = false;
+  uint32_t priority = PRIORITY_INTERACTIVE;
+  njt_compress_options shared;
+  njt_compress_batch_item* items = NULL;
+  Local<Array> srcObjects;
+  uint32_t count = 0;
+  uint32_t i;
+
+  if (batchParseArguments(info, &callback, &srcArray, &options, &perItem, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // Shared options must be valid or there's no point in going on
+  if (!perItem) {
+    if (compressParseOptions(options, &shared, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+    priority = shared.priority;
+  }
+
+  if (njtPoolFull()) {
+    _throw("Queue is full");
+  }
+
+  count = srcArray->Length();
+  items = (njt_compress_batch_item*) calloc(count > 0 ? count : 1, sizeof(njt_compress_batch_item));
+  if (items == NULL) {
+    _throw("Unable to allocate batch");
+  }
+
+  // The caller may change the array before we're done, so keep our own
+  // references to the buffers
+  srcObjects = New<Array>(count);
+
+  // With per-item options, the batch goes on the most urgent lane any of
+  // its items asks for
+  if (perItem) {
+    priority = PRIORITY_BULK;
+  }
+
+  // Per-item errors are reported in the results rather than thrown
+  for (i = 0; i < count; i++) {
+    njt_compress_batch_item* item = &items[i];
+    Local<Value> srcObject = srcArray->Get(i);
+
+    if (!Buffer::HasInstance(srcObject)) {
+      snprintf(item->errStr, NJT_MSG_LENGTH_MAX, "%s", "Invalid source buffer");
+      item->retval = -1;
+      continue;
+    }
+    item->srcData = (unsigned char*) Buffer::Data(srcObject);
+
+    srcObjects->Set(i, srcObject);
+
+    if (perItem) {
+      Local<Value> itemOptions = options->Get(i);
+
+      if (!itemOptions->IsObject()) {
+        snprintf(item->errStr, NJT_MSG_LENGTH_MAX, "%s", "Options must be an object");
+        item->retval = -1;
+        continue;
+      }
+      item->retval = compressParseOptions(itemOptions.As<Object>(), &item->options, item->errStr);
+      if (item->retval == 0 && item->options.priority < priority) {
+        priority = item->options.priority;
+      }
+    }
+    else {
+      item->options = shared;
+    }
+  }
+
+  njtQueueWorker(new CompressBatchWorker(callback, srcObjects, items, count, priority), priority, NULL);
+  return;
+
+  bailout:
+  if (retval != 0) {
+    batchBailout(callback, errStr);
+    return;
+  }
+}
+
+NAN_METHOD(DecompressBatch) {
+  int retval = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+
+  Callback *callback = NULL;
+  Local<Array> srcArray;
+  Local<Object> options;
+  bool perItem = false;
+  uint32_t priority = PRIORITY_INTERACTIVE;
+  njt_decompress_options shared;
+  njt_decompress_batch_item* items = NULL;
+  Local<Array> srcObjects;
+  uint32_t count = 0;
+  uint32_t i;
+
+  if (batchParseArguments(info, &callback, &srcArray, &options, &perItem, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // Shared options must be valid or there's no point in going on
+  if (!perItem) {
+    if (decompressParseOptions(options, &shared, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+    priority = shared.priority;
+  }
+
+  if (njtPoolFull()) {
+    _throw("Queue is full");
+  }
+
+  count = srcArray->Length();
+  items = (njt_decompress_batch_item*) calloc(count > 0 ? count : 1, sizeof(njt_decompress_batch_item));
+  if (items == NULL) {
+    _throw("Unable to allocate batch");
+  }
+
+  // The caller may change the array before we're done, so keep our own
+  // references to the buffers
+  srcObjects = New<Array>(count);
+
+  // With per-item options, the batch goes on the most urgent lane any of
+  // its items asks for
+  if (perItem) {
+    priority = PRIORITY_BULK;
+  }
+
+  // Per-item errors are reported in the results rather than thrown
+  for (i = 0; i < count; i++) {
+    njt_decompress_batch_item* item = &items[i];
+    Local<Value> srcObject = srcArray->Get(i);
+
+    if (!Buffer::HasInstance(srcObject)) {
+      snprintf(item->errStr, NJT_MSG_LENGTH_MAX, "%s", "Invalid source buffer");
+      item->retval = -1;
+      continue;
+    }
+    item->srcData = (unsigned char*) Buffer::Data(srcObject);
+    item->srcLength = Buffer::Length(srcObject);
+
+    srcObjects->Set(i, srcObject);
+
+    if (perItem) {
+      Local<Value> itemOptions = options->Get(i);
+
+      if (!itemOptions->IsObject()) {
+        snprintf(item->errStr, NJT_MSG_LENGTH_MAX, "%s", "Options must be an object");
+        item->retval = -1;
+        continue;
+      }
+      item->retval = decompressParseOptions(itemOptions.As<Object>(), &item->options, item->errStr);
+      if (item->retval == 0 && item->options.priority < priority) {
+        priority = item->options.priority;
+      }
+    }
+    else {
+      item->options = shared;
+    }
+  }
+
+  njtQueueWorker(new DecompressBatchWorker(callback, srcObjects, items, count, priority), priority, NULL);
+  return;
+
+  bailout:
+  if (retval != 0) {
+    batchBailout(callback, errStr);
+    return;
+  }
+}
@@ -2,11 +2,11 @@
 using namespace Nan;
 using namespace v8;
 
-static char errStr[NJT_MSG_LENGTH_MAX] = "No error";
 #define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
 
 NAN_METHOD(BufferSize) {
   int retval = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
 
   // Input
   Callback *callback = NULL;
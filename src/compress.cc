@@ -1,26 +1,87 @@
-#include "exports.h"
+#include "libjpeg.h"
 using namespace Nan;
 using namespace v8;
 using namespace node;
 
-static char errStr[NJT_MSG_LENGTH_MAX] = "No error";
 #define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
 
 void compressBufferFreeCallback(char *data, void *hint) {
   tjFree((unsigned char*) data);
 }
 
-int compress(unsigned char* srcData, uint32_t format, uint32_t width, uint32_t stride, uint32_t height, uint32_t jpegSubsamp, int quality, unsigned long* jpegSize, unsigned char** dstData, uint32_t dstBufferLength) {
+// Encodes into *dstData, which is grown as needed unless fixed is set.
+// TurboJPEG 1.4 has no way to ask for progressive, optimized or restart
+// marker output, so those go through libjpeg instead.
+static int encode(unsigned char* srcData, njt_compress_options* options, int bpp, unsigned char** dstData, unsigned long* jpegSize, bool fixed, char* errStr) {
   int retval = 0;
   int err;
-
   tjhandle handle = NULL;
-  int flags = TJFLAG_FASTDCT;
+  int flags = options->accurateDct ? TJFLAG_ACCURATEDCT : TJFLAG_FASTDCT;
+  bool handled = false;
+  uint64_t startedAt = njtStatsNow();
+
+  // Searches for a quality, and handles the other libjpeg options itself
+  if (options->targetSize > 0) {
+    retval = njtCompressTargetSize(srcData, options, dstData, jpegSize, fixed, errStr);
+    goto bailout;
+  }
+
+  if (options->progressive || options->optimize || options->restartInterval > 0 || options->restartRows > 0) {
+    retval = njtCompressScanlines(srcData, options, dstData, jpegSize, fixed, errStr);
+    goto bailout;
+  }
+
+  // Bands need restart markers of their own, so this only works when the
+  // caller hasn't asked for anything else
+  if (options->threads != 1) {
+    err = njtCompressRestartBands(srcData, options, dstData, jpegSize, fixed, &handled, errStr);
+    if (handled || err != 0) {
+      retval = err;
+      goto bailout;
+    }
+  }
+
+  // Reports errors of its own, see NJT_SHARED_ERRORS
+  if (NJT_SHARED_ERRORS) {
+    retval = njtCompressScanlines(srcData, options, dstData, jpegSize, fixed, errStr);
+    goto bailout;
+  }
+
+  if (fixed) {
+    flags |= TJFLAG_NOREALLOC;
+  }
+
+  handle = njtAcquireHandle(NJT_HANDLE_COMPRESS);
+  if (handle == NULL) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  err = tjCompress2(handle, srcData, options->width, options->stride * bpp, options->height, options->format, dstData, jpegSize, options->jpegSubsamp, options->quality, flags);
+
+  if (err != 0) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  bailout:
+  njtReleaseHandle(NJT_HANDLE_COMPRESS, handle);
+  njtStatsStage(NJT_OP_COMPRESS, NJT_STAGE_CODEC, startedAt);
+
+  return retval;
+}
+
+int compress(unsigned char* srcData, njt_compress_options* options, unsigned long* jpegSize, unsigned char** dstData, uint32_t dstBufferLength, char* errStr) {
+  int retval = 0;
+  int err;
+
   int bpp = 0;
   uint32_t dstLength = 0;
+  njt_scratch* scratch = NULL;
+  unsigned char* scratchData = NULL;
+  unsigned long scratchSize = 0;
+  int failure = NJT_ERROR_OTHER;
 
   // Figure out bpp from format (needed to calculate output buffer size)
-  switch (format) {
+  switch (options->format) {
     case FORMAT_GRAY:
       bpp = 1;
       break;
@@ -42,7 +103,7 @@ int compress(unsigned char* srcData, uint32_t format, uint32_t width, uint32_t s
       _throw("Invalid input format");
   }
 
-  switch (jpegSubsamp) {
+  switch (options->jpegSubsamp) {
     case SAMP_444:
     case SAMP_422:
     case SAMP_420:
@@ -53,122 +114,379 @@ int compress(unsigned char* srcData, uint32_t format, uint32_t width, uint32_t s
       _throw("Invalid subsampling method");
   }
 
-  // Set up buffers if required
-  dstLength = tjBufSize(width, height, jpegSubsamp);
+  // TurboJPEG encodes the whole image in one go, so this is as far as we
+  // can honor cancellation
+  if (options->cancelled != NULL && *options->cancelled) {
+    _throw("Aborted");
+  }
+
   if (dstBufferLength > 0) {
+    dstLength = tjBufSize(options->width, options->height, options->jpegSubsamp);
     if (dstLength > dstBufferLength) {
       _throw("Pontentially insufficient output buffer");
     }
-    flags |= TJFLAG_NOREALLOC;
-  }
+    *jpegSize = dstBufferLength;
 
-  handle = tjInitCompress();
-  if (handle == NULL) {
-    _throw(tjGetErrorStr());
+    if (encode(srcData, options, bpp, dstData, jpegSize, true, errStr) != 0) {
+      failure = NJT_ERROR_CODEC;
+      retval = -1;
+      goto bailout;
+    }
   }
+  else if (options->tight) {
+    // Encode into a pooled buffer and copy out exactly what we need
+    scratch = njtAcquireScratch(options->width, options->height, options->jpegSubsamp);
+    if (scratch == NULL) {
+      _throw("Unable to allocate scratch buffer");
+    }
+    scratchData = scratch->data;
+    scratchSize = scratch->size;
 
-  err = tjCompress2(handle, srcData, width, stride * bpp, height, format, dstData, jpegSize, jpegSubsamp, quality, flags);
+    err = encode(srcData, options, bpp, &scratchData, &scratchSize, false, errStr);
 
-  if (err != 0) {
-    _throw(tjGetErrorStr());
+    if (err == 0) {
+      *jpegSize = scratchSize;
+      if (options->arena != NULL) {
+        *dstData = njtArenaAlloc(options->arena, scratchSize);
+      }
+      else {
+        *dstData = tjAlloc(scratchSize);
+      }
+      if (*dstData != NULL) {
+        memcpy(*dstData, scratchData, scratchSize);
+      }
+    }
+
+    njtReleaseScratch(scratch, scratchData, err == 0 ? scratchSize : 0, options->width, options->height);
+
+    if (err != 0) {
+      failure = NJT_ERROR_CODEC;
+      retval = -1;
+      goto bailout;
+    }
+    if (*dstData == NULL) {
+      _throw("Unable to allocate output buffer");
+    }
+  }
+  else {
+    if (encode(srcData, options, bpp, dstData, jpegSize, false, errStr) != 0) {
+      failure = NJT_ERROR_CODEC;
+      retval = -1;
+      goto bailout;
+    }
   }
 
   bailout:
-  if (handle != NULL) {
-    err = 0;
-    err = tjDestroy(handle);
-    // If we already have an error retval wont be 0 so in that case we don't want to overwrite error message
-    // Also cant use _throw here because infinite-loop
-    if (err != 0 && retval == 0) {
-      snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", tjGetErrorStr());
+  // The output buffer is only ours to free if we allocated it
+  if (retval != 0 && dstBufferLength == 0 && *dstData != NULL) {
+    tjFree(*dstData);
+    *dstData = NULL;
+  }
+
+  if (retval == 0) {
+    njtStatsCall(NJT_OP_COMPRESS, ((uint64_t) options->stride * (options->height - 1) + options->width) * bpp, *jpegSize, (uint64_t) options->width * options->height);
+  }
+  else if (options->cancelled != NULL && *options->cancelled) {
+    njtStatsError(NJT_OP_COMPRESS, NJT_ERROR_ABORTED);
+  }
+  else {
+    njtStatsError(NJT_OP_COMPRESS, failure);
+  }
+
+  return retval;
+}
+
+int compressParseOptions(Local<Object> options, njt_compress_options* opts, char* errStr) {
+  int retval = 0;
+
+  Local<Value> formatObject;
+  Local<Value> sampObject;
+  Local<Value> widthObject;
+  Local<Value> heightObject;
+  Local<Value> strideObject;
+  Local<Value> qualityObject;
+  Local<Value> targetSizeObject;
+  Local<Value> tightObject;
+  Local<Value> accurateDctObject;
+  Local<Value> optimizeObject;
+  Local<Value> progressiveObject;
+  Local<Value> restartIntervalObject;
+  Local<Value> restartRowsObject;
+  Local<Value> threadsObject;
+
+  opts->jpegSubsamp = NJT_DEFAULT_SUBSAMPLING;
+  opts->quality = NJT_DEFAULT_QUALITY;
+  opts->targetSize = 0;
+  opts->tight = false;
+  opts->accurateDct = false;
+  opts->optimize = false;
+  opts->progressive = false;
+  opts->restartInterval = 0;
+  opts->restartRows = 0;
+  opts->threads = 1;
+  opts->priority = PRIORITY_INTERACTIVE;
+  opts->cancelled = NULL;
+  opts->arena = NULL;
+
+  if (!options->IsObject()) {
+    _throw("Options must be an object");
+  }
+
+  // Format of input buffer
+  formatObject = options->Get(New("format").ToLocalChecked());
+  if (formatObject->IsUndefined()) {
+    _throw("Missing format");
+  }
+  if (!formatObject->IsUint32()) {
+    _throw("Invalid input format");
+  }
+  opts->format = formatObject->Uint32Value();
+
+  // Subsampling
+  sampObject = options->Get(New("subsampling").ToLocalChecked());
+  if (!sampObject->IsUndefined()) {
+    if (!sampObject->IsUint32()) {
+      _throw("Invalid subsampling method");
+    }
+    opts->jpegSubsamp = sampObject->Uint32Value();
+  }
+
+  // Width
+  widthObject = options->Get(New("width").ToLocalChecked());
+  if (widthObject->IsUndefined()) {
+    _throw("Missing width");
+  }
+  if (!widthObject->IsUint32()) {
+    _throw("Invalid width value");
+  }
+  opts->width = widthObject->Uint32Value();
+
+  // Height
+  heightObject = options->Get(New("height").ToLocalChecked());
+  if (heightObject->IsUndefined()) {
+    _throw("Missing height");
+  }
+  if (!heightObject->IsUint32()) {
+    _throw("Invalid height value");
+  }
+  opts->height = heightObject->Uint32Value();
+
+  // Stride
+  strideObject = options->Get(New("stride").ToLocalChecked());
+  if (!strideObject->IsUndefined()) {
+    if (!strideObject->IsUint32()) {
+      _throw("Invalid stride value");
+    }
+    opts->stride = strideObject->Uint32Value();
+  }
+  else {
+    opts->stride = opts->width;
+  }
+
+  // Quality
+  qualityObject = options->Get(New("quality").ToLocalChecked());
+  if (!qualityObject->IsUndefined()) {
+    if (!qualityObject->IsUint32() || qualityObject->Uint32Value() > 100) {
+      _throw("Invalid quality value");
+    }
+    opts->quality = qualityObject->Uint32Value();
+  }
+
+  // Largest acceptable output size, quality becomes the upper bound
+  targetSizeObject = options->Get(New("targetSize").ToLocalChecked());
+  if (!targetSizeObject->IsUndefined()) {
+    if (!targetSizeObject->IsUint32()) {
+      _throw("Invalid targetSize value");
+    }
+    opts->targetSize = targetSizeObject->Uint32Value();
+  }
+
+  // Tight output
+  tightObject = options->Get(New("tight").ToLocalChecked());
+  if (!tightObject->IsUndefined()) {
+    if (!tightObject->IsBoolean()) {
+      _throw("Invalid tight value");
     }
+    opts->tight = tightObject->IsTrue();
+  }
+
+  // Accurate DCT, slower but better quality than the default fast DCT
+  accurateDctObject = options->Get(New("accurateDct").ToLocalChecked());
+  if (!accurateDctObject->IsUndefined()) {
+    if (!accurateDctObject->IsBoolean()) {
+      _throw("Invalid accurateDct value");
+    }
+    opts->accurateDct = accurateDctObject->IsTrue();
+  }
+
+  // Optimized Huffman tables
+  optimizeObject = options->Get(New("optimize").ToLocalChecked());
+  if (!optimizeObject->IsUndefined()) {
+    if (!optimizeObject->IsBoolean()) {
+      _throw("Invalid optimize value");
+    }
+    opts->optimize = optimizeObject->IsTrue();
+  }
 
-    if (dstBufferLength > 0 && dstData != NULL) {
-      tjFree(*dstData);
+  // Progressive output
+  progressiveObject = options->Get(New("progressive").ToLocalChecked());
+  if (!progressiveObject->IsUndefined()) {
+    if (!progressiveObject->IsBoolean()) {
+      _throw("Invalid progressive value");
     }
+    opts->progressive = progressiveObject->IsTrue();
   }
 
+  // Restart markers every N MCUs
+  restartIntervalObject = options->Get(New("restartInterval").ToLocalChecked());
+  if (!restartIntervalObject->IsUndefined()) {
+    if (!restartIntervalObject->IsUint32() || restartIntervalObject->Uint32Value() > 65535) {
+      _throw("Invalid restartInterval value");
+    }
+    opts->restartInterval = restartIntervalObject->Uint32Value();
+  }
+
+  // Restart markers every N rows of MCUs
+  restartRowsObject = options->Get(New("restartRows").ToLocalChecked());
+  if (!restartRowsObject->IsUndefined()) {
+    if (!restartRowsObject->IsUint32() || restartRowsObject->Uint32Value() > 65535) {
+      _throw("Invalid restartRows value");
+    }
+    opts->restartRows = restartRowsObject->Uint32Value();
+  }
+
+  // Threads for encoding bands in parallel
+  threadsObject = options->Get(New("threads").ToLocalChecked());
+  if (!threadsObject->IsUndefined()) {
+    if (!threadsObject->IsUint32()) {
+      _throw("Invalid threads value");
+    }
+    opts->threads = threadsObject->Uint32Value();
+  }
+
+  // Lane those threads are taken from, see njtParallelFor()
+  if (njtParsePriority(options, &opts->priority, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  bailout:
   return retval;
 }
 
 class CompressWorker : public AsyncWorker {
   public:
-    CompressWorker(Callback *callback, unsigned char* srcData, uint32_t format, uint32_t width, uint32_t stride, uint32_t height, uint32_t jpegSubsamp, int quality, Local<Object> &dstObject, unsigned char* dstData, uint32_t dstBufferLength) :
+    CompressWorker(Callback *callback, Local<Object> &srcObject, unsigned char* srcData, njt_compress_options* options, Local<Object> &dstObject, unsigned char* dstData, uint32_t dstBufferLength, Local<Object> &tokenObject, Local<Object> &arenaObject, bool transfer) :
       AsyncWorker(callback),
       srcData(srcData),
-      format(format),
-      width(width),
-      stride(stride),
-      height(height),
-      jpegSubsamp(jpegSubsamp),
-      quality(quality),
+      options(*options),
       jpegSize(0),
       dstData(dstData),
-      dstBufferLength(dstBufferLength) {
-        if (dstBufferLength > 0) {
-          SaveToPersistent("dstObject", dstObject);
+      dstBufferLength(dstBufferLength),
+      queuedAt(njtStatsNow()) {
+        this->srcTransfer.data = NULL;
+        this->dstTransfer.data = NULL;
+
+        // Either take over the memory or keep the Buffers alive
+        if (transfer) {
+          njtTransferBuffer(srcObject, &this->srcTransfer);
+          if (dstBufferLength > 0) {
+            njtTransferBuffer(dstObject, &this->dstTransfer);
+          }
+        }
+        else {
+          SaveToPersistent("srcObject", srcObject);
+          if (dstBufferLength > 0) {
+            SaveToPersistent("dstObject", dstObject);
+          }
+        }
+        if (options->cancelled != NULL) {
+          SaveToPersistent("tokenObject", tokenObject);
+        }
+        if (options->arena != NULL) {
+          SaveToPersistent("arenaObject", arenaObject);
         }
       }
-    ~CompressWorker() {}
+
+    ~CompressWorker() {
+      njtFreeTransfer(&this->srcTransfer);
+      njtFreeTransfer(&this->dstTransfer);
+    }
 
     void Execute () {
       int err;
 
+      njtStatsStage(NJT_OP_COMPRESS, NJT_STAGE_QUEUE, this->queuedAt);
+
       err = compress(
           this->srcData,
-          this->format,
-          this->width,
-          this->stride,
-          this->height,
-          this->jpegSubsamp,
-          this->quality,
+          &this->options,
           &this->jpegSize,
           &this->dstData,
-          this->dstBufferLength);
+          this->dstBufferLength,
+          this->errStr);
 
       if(err != 0) {
-        SetErrorMessage(errStr);
+        SetErrorMessage(this->errStr);
       }
     }
 
     void HandleOKCallback () {
+      uint64_t startedAt = njtStatsNow();
       Local<Object> obj = New<Object>();
       Local<Object> dstObject;
 
-      if (this->dstBufferLength > 0) {
+      if (this->dstTransfer.data != NULL) {
+        dstObject = njtReturnTransfer(&this->dstTransfer);
+      }
+      else if (this->dstBufferLength > 0) {
         dstObject = GetFromPersistent("dstObject").As<Object>();
       }
       else {
-        dstObject = NewBuffer((char*)this->dstData, this->jpegSize, compressBufferFreeCallback, NULL).ToLocalChecked();
+        dstObject = NewBuffer((char*)this->dstData, this->jpegSize, this->options.arena != NULL ? njtArenaFreeCallback : compressBufferFreeCallback, NULL).ToLocalChecked();
       }
 
       obj->Set(New("data").ToLocalChecked(), dstObject);
       obj->Set(New("size").ToLocalChecked(), New((uint32_t) this->jpegSize));
+      if (this->options.targetSize > 0) {
+        obj->Set(New("quality").ToLocalChecked(), New(this->options.quality));
+      }
+
+      // Hand the source back too
+      if (this->srcTransfer.data != NULL) {
+        obj->Set(New("source").ToLocalChecked(), njtReturnTransfer(&this->srcTransfer));
+      }
 
       v8::Local<v8::Value> argv[] = {
         Nan::Null(),
         obj
       };
 
+      njtStatsStage(NJT_OP_COMPRESS, NJT_STAGE_BUFFER, startedAt);
+      startedAt = njtStatsNow();
+
       callback->Call(2, argv);
+
+      njtStatsStage(NJT_OP_COMPRESS, NJT_STAGE_CALLBACK, startedAt);
+      njtStatsStage(NJT_OP_COMPRESS, NJT_STAGE_TOTAL, this->queuedAt);
     }
 
   private:
     unsigned char* srcData;
-    uint32_t format;
-    uint32_t width;
-    uint32_t stride;
-    uint32_t height;
-    uint32_t jpegSubsamp;
-    int quality;
+    njt_compress_options options;
     unsigned long jpegSize;
     unsigned char* dstData;
     uint32_t dstBufferLength;
+    uint64_t queuedAt;
+    njt_transfer srcTransfer;
+    njt_transfer dstTransfer;
+    char errStr[NJT_MSG_LENGTH_MAX];
 };
 
 void compressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
   int retval = 0;
   int cursor = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
 
   // Input
   Callback *callback = NULL;
@@ -178,21 +496,15 @@ void compressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
   uint32_t dstBufferLength = 0;
   unsigned char* dstData = NULL;
   Local<Object> options;
-  Local<Value> formatObject;
-  uint32_t format = 0;
-  Local<Value> sampObject;
-  uint32_t jpegSubsamp = NJT_DEFAULT_SUBSAMPLING;
-  Local<Value> widthObject;
-  uint32_t width = 0;
-  Local<Value> heightObject;
-  uint32_t height = 0;
-  Local<Value> strideObject;
-  uint32_t stride;
-  Local<Value> qualityObject;
-  int quality = NJT_DEFAULT_QUALITY;
+  njt_compress_options opts;
+  Local<Object> tokenObject;
+  Local<Object> arenaObject;
+  bool transfer = false;
 
   // Output
   unsigned long jpegSize = 0;
+  uint64_t startedAt = njtStatsNow();
+  uint64_t bufferAt;
 
   // Try to find callback here, so if we want to throw something we can use callback's err
   if (async) {
@@ -227,100 +539,72 @@ void compressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
     dstData = (unsigned char*) Buffer::Data(dstObject);
   }
 
-  if (!options->IsObject()) {
-    _throw("Options must be an object");
-  }
-
-  // Format of input buffer
-  formatObject = options->Get(New("format").ToLocalChecked());
-  if (formatObject->IsUndefined()) {
-    _throw("Missing format");
-  }
-  if (!formatObject->IsUint32()) {
-    _throw("Invalid input format");
+  if (compressParseOptions(options, &opts, errStr) != 0) {
+    retval = -1;
+    goto bailout;
   }
-  format = formatObject->Uint32Value();
 
-  // Subsampling
-  sampObject = options->Get(New("subsampling").ToLocalChecked());
-  if (!sampObject->IsUndefined()) {
-    if (!sampObject->IsUint32()) {
-      _throw("Invalid subsampling method");
-    }
-    jpegSubsamp = sampObject->Uint32Value();
+  if (njtParseCancelToken(options, &tokenObject, &opts.cancelled, errStr) != 0) {
+    retval = -1;
+    goto bailout;
   }
 
-  // Width
-  widthObject = options->Get(New("width").ToLocalChecked());
-  if (widthObject->IsUndefined()) {
-    _throw("Missing width");
+  // Arena slabs are only handed out for tight output
+  if (njtParseArena(options, &arenaObject, &opts.arena, errStr) != 0) {
+    retval = -1;
+    goto bailout;
   }
-  if (!widthObject->IsUint32()) {
-    _throw("Invalid width value");
+  if (opts.arena != NULL) {
+    opts.tight = true;
   }
-  width = widthObject->Uint32Value();
 
-  // Height
-  heightObject = options->Get(New("height").ToLocalChecked());
-  if (heightObject->IsUndefined()) {
-    _throw("Missing height");
-  }
-  if (!heightObject->IsUint32()) {
-    _throw("Invalid height value");
-  }
-  height = heightObject->Uint32Value();
-
-  // Stride
-  strideObject = options->Get(New("stride").ToLocalChecked());
-  if (!strideObject->IsUndefined()) {
-    if (!strideObject->IsUint32()) {
-      _throw("Invalid stride value");
+  // Only meaningful for async calls
+  if (async) {
+    if (njtParseTransfer(options, &transfer, errStr) != 0) {
+      retval = -1;
+      goto bailout;
     }
-    stride = strideObject->Uint32Value();
-  }
-  else {
-    stride = width;
-  }
-
-  // Quality
-  qualityObject = options->Get(New("quality").ToLocalChecked());
-  if (!qualityObject->IsUndefined()) {
-    if (!qualityObject->IsUint32() || qualityObject->Uint32Value() > 100) {
-      _throw("Invalid quality value");
+    if (transfer && (!njtCanTransfer(srcObject) || (dstBufferLength > 0 && !njtCanTransfer(dstObject)))) {
+      _throw("Buffer cannot be transferred");
     }
-    quality = qualityObject->Uint32Value();
   }
 
   // Do either async or sync compress
   if (async) {
-    AsyncQueueWorker(new CompressWorker(callback, srcData, format, width, stride, height, jpegSubsamp, quality, dstObject, dstData, dstBufferLength));
+    if (njtPoolFull()) {
+      _throw("Queue is full");
+    }
+    njtQueueWorker(new CompressWorker(callback, srcObject, srcData, &opts, dstObject, dstData, dstBufferLength, tokenObject, arenaObject, transfer), opts.priority, opts.cancelled);
     return;
   }
   else {
     retval = compress(
         srcData,
-        format,
-        width,
-        stride,
-        height,
-        jpegSubsamp,
-        quality,
+        &opts,
         &jpegSize,
         &dstData,
-        dstBufferLength);
+        dstBufferLength,
+        errStr);
 
     if(retval != 0) {
       // Compress will set the errStr
       goto bailout;
     }
+    bufferAt = njtStatsNow();
     Local<Object> obj = New<Object>();
     if (dstBufferLength == 0) {
-      dstObject = NewBuffer((char*)dstData, jpegSize, compressBufferFreeCallback, NULL).ToLocalChecked();
+      dstObject = NewBuffer((char*)dstData, jpegSize, opts.arena != NULL ? njtArenaFreeCallback : compressBufferFreeCallback, NULL).ToLocalChecked();
     }
 
     obj->Set(New("data").ToLocalChecked(), dstObject);
     obj->Set(New("size").ToLocalChecked(), New((uint32_t) jpegSize));
+    if (opts.targetSize > 0) {
+      obj->Set(New("quality").ToLocalChecked(), New(opts.quality));
+    }
     info.GetReturnValue().Set(obj);
+
+    njtStatsStage(NJT_OP_COMPRESS, NJT_STAGE_BUFFER, bufferAt);
+    njtStatsStage(NJT_OP_COMPRESS, NJT_STAGE_TOTAL, startedAt);
     return;
   }
 
@@ -347,4 +631,3 @@ NAN_METHOD(CompressSync) {
 NAN_METHOD(Compress) {
   compressParse(info, true);
 }
-
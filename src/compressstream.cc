@@ -0,0 +1,469 @@
+#include "libjpeg.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// Size of the output chunks. Smaller chunks are emitted whenever a write
+// produces less than this.
+#define NJT_STREAM_CHUNK_SIZE 65536
+
+enum {
+  STREAM_SCANLINES = 0,
+  STREAM_DONE,
+  STREAM_FAILED,
+};
+
+typedef struct njt_chunk {
+  unsigned char* data;
+  uint32_t size;
+  struct njt_chunk* next;
+} njt_chunk;
+
+typedef struct {
+  struct jpeg_compress_struct cinfo;
+  njt_error_mgr jerr;
+  struct jpeg_destination_mgr dest;
+  bool created;
+
+  int state;
+  njt_compress_options options;
+  int bpp;
+
+  // The chunk currently being filled, and finished chunks waiting to be
+  // handed over to JS
+  unsigned char* chunk;
+  njt_chunk* chunks;
+  njt_chunk* lastChunk;
+} njt_compress_stream;
+
+static int allocChunk(njt_compress_stream* stream) {
+  stream->chunk = (unsigned char*) malloc(NJT_STREAM_CHUNK_SIZE);
+  if (stream->chunk == NULL) {
+    return -1;
+  }
+
+  stream->dest.next_output_byte = stream->chunk;
+  stream->dest.free_in_buffer = NJT_STREAM_CHUNK_SIZE;
+
+  return 0;
+}
+
+// Moves the filled part of the current chunk to the list of finished chunks.
+static int pushChunk(njt_compress_stream* stream) {
+  njt_chunk* chunk;
+  uint32_t size = NJT_STREAM_CHUNK_SIZE - stream->dest.free_in_buffer;
+
+  if (stream->chunk == NULL || size == 0) {
+    return 0;
+  }
+
+  chunk = (njt_chunk*) malloc(sizeof(njt_chunk));
+  if (chunk == NULL) {
+    return -1;
+  }
+
+  chunk->data = stream->chunk;
+  chunk->size = size;
+  chunk->next = NULL;
+
+  if (stream->lastChunk != NULL) {
+    stream->lastChunk->next = chunk;
+  }
+  else {
+    stream->chunks = chunk;
+  }
+  stream->lastChunk = chunk;
+
+  stream->chunk = NULL;
+  stream->dest.next_output_byte = NULL;
+  stream->dest.free_in_buffer = 0;
+
+  return 0;
+}
+
+static void initDestination(j_compress_ptr cinfo) {
+  njt_compress_stream* stream = (njt_compress_stream*) cinfo->client_data;
+
+  if (allocChunk(stream) != 0) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  }
+}
+
+static boolean emptyOutputBuffer(j_compress_ptr cinfo) {
+  njt_compress_stream* stream = (njt_compress_stream*) cinfo->client_data;
+
+  // libjpeg doesn't update free_in_buffer before calling us
+  stream->dest.free_in_buffer = 0;
+
+  if (pushChunk(stream) != 0 || allocChunk(stream) != 0) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  }
+
+  return TRUE;
+}
+
+static void termDestination(j_compress_ptr cinfo) {
+  njt_compress_stream* stream = (njt_compress_stream*) cinfo->client_data;
+
+  if (pushChunk(stream) != 0) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  }
+}
+
+static int initStream(njt_compress_stream* stream, char* errStr) {
+  J_COLOR_SPACE colorSpace;
+
+  stream->cinfo.err = njtErrorMgr(&stream->jerr);
+
+  if (njtColorSpace(stream->options.format, &colorSpace, &stream->bpp) != 0) {
+    snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Invalid input format");
+    return -1;
+  }
+
+  if (setjmp(stream->jerr.setjmpBuffer)) {
+    njtFormatError((j_common_ptr) &stream->cinfo, errStr);
+    return -1;
+  }
+
+  jpeg_create_compress(&stream->cinfo);
+  stream->created = true;
+
+  stream->cinfo.client_data = stream;
+  stream->dest.init_destination = initDestination;
+  stream->dest.empty_output_buffer = emptyOutputBuffer;
+  stream->dest.term_destination = termDestination;
+  stream->cinfo.dest = &stream->dest;
+
+  stream->cinfo.image_width = stream->options.width;
+  stream->cinfo.image_height = stream->options.height;
+  stream->cinfo.input_components = stream->bpp;
+  stream->cinfo.in_color_space = colorSpace;
+
+  if (njtSetCompressOptions(&stream->cinfo, &stream->options) != 0) {
+    snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Invalid subsampling method");
+    return -1;
+  }
+
+  // Writes the headers into the first chunk
+  jpeg_start_compress(&stream->cinfo, TRUE);
+
+  return 0;
+}
+
+static void destroyStream(njt_compress_stream* stream) {
+  njt_chunk* chunk;
+
+  if (stream->created) {
+    jpeg_destroy_compress(&stream->cinfo);
+  }
+
+  while (stream->chunks != NULL) {
+    chunk = stream->chunks;
+    stream->chunks = chunk->next;
+    free(chunk->data);
+    free(chunk);
+  }
+
+  free(stream->chunk);
+  free(stream);
+}
+
+// Compresses a strip of rows. Whatever output is ready afterwards is moved
+// to the chunk list, so nothing is held back until the next write.
+static int encodeStrip(njt_compress_stream* stream, unsigned char* srcData, uint32_t rows, bool end, char* errStr) {
+  int retval = 0;
+  JSAMPROW row;
+  uint32_t i;
+  uint32_t pitch = stream->options.stride * stream->bpp;
+
+  if (setjmp(stream->jerr.setjmpBuffer)) {
+    njtFormatError((j_common_ptr) &stream->cinfo, errStr);
+    stream->state = STREAM_FAILED;
+    return -1;
+  }
+
+  for (i = 0; i < rows; i++) {
+    row = srcData + i * pitch;
+    jpeg_write_scanlines(&stream->cinfo, &row, 1);
+  }
+
+  if (end) {
+    if (stream->cinfo.next_scanline < stream->cinfo.image_height) {
+      _throw("Premature end of image data");
+    }
+    jpeg_finish_compress(&stream->cinfo);
+    stream->state = STREAM_DONE;
+  }
+  else {
+    if (pushChunk(stream) != 0 || allocChunk(stream) != 0) {
+      _throw("Unable to allocate output chunk");
+    }
+  }
+
+  bailout:
+  if (retval != 0) {
+    stream->state = STREAM_FAILED;
+  }
+  return retval;
+}
+
+class CompressStream : public ObjectWrap {
+  public:
+    static NAN_METHOD(Construct) {
+      int retval = 0;
+      char errStr[NJT_MSG_LENGTH_MAX];
+
+      CompressStream* obj = NULL;
+      njt_compress_stream* stream = NULL;
+      Local<Object> options;
+
+      if (!info.IsConstructCall()) {
+        _throw("Constructor must be called with new");
+      }
+
+      stream = (njt_compress_stream*) calloc(1, sizeof(njt_compress_stream));
+      if (stream == NULL) {
+        _throw("Unable to allocate encoder");
+      }
+
+      options = info[0].As<Object>();
+      if (compressParseOptions(options, &stream->options, errStr) != 0) {
+        retval = -1;
+        goto bailout;
+      }
+
+      if (stream->options.stride < stream->options.width) {
+        _throw("Stride must be at least as large as width");
+      }
+
+      // Rows are written out as they come in, there's no going back
+      if (stream->options.targetSize > 0) {
+        _throw("targetSize is not supported when streaming");
+      }
+
+      // Both make libjpeg keep the coefficients of the whole image and write
+      // nothing until the end, which is exactly what streaming should avoid
+      if (stream->options.optimize) {
+        _throw("optimize is not supported when streaming");
+      }
+      if (stream->options.progressive) {
+        _throw("progressive is not supported when streaming");
+      }
+
+      if (initStream(stream, errStr) != 0) {
+        retval = -1;
+        goto bailout;
+      }
+
+      // Lets JS split arbitrary chunks into whole rows
+      info.This()->Set(New("pitch").ToLocalChecked(), New(stream->options.stride * stream->bpp));
+      info.This()->Set(New("rowSize").ToLocalChecked(), New(stream->options.width * stream->bpp));
+
+      obj = new CompressStream(stream, stream->options.priority);
+      stream = NULL;
+      obj->Wrap(info.This());
+      info.GetReturnValue().Set(info.This());
+
+      bailout:
+      if (stream != NULL) {
+        destroyStream(stream);
+      }
+
+      if (retval != 0) {
+        ThrowError(TypeError(errStr));
+        return;
+      }
+    }
+
+    static NAN_METHOD(Write) {
+      writeParse(info, false);
+    }
+
+    static NAN_METHOD(End) {
+      writeParse(info, true);
+    }
+
+    // Hands finished chunks over to JS.
+    Local<Object> result() {
+      Local<Object> obj = New<Object>();
+      Local<Array> chunks = New<Array>();
+      njt_chunk* chunk;
+      uint32_t i = 0;
+
+      while (this->stream->chunks != NULL) {
+        chunk = this->stream->chunks;
+        this->stream->chunks = chunk->next;
+        chunks->Set(i++, NewBuffer((char*)chunk->data, chunk->size).ToLocalChecked());
+        free(chunk);
+      }
+      this->stream->lastChunk = NULL;
+
+      obj->Set(New("chunks").ToLocalChecked(), chunks);
+      obj->Set(New("rows").ToLocalChecked(), New((uint32_t) this->stream->cinfo.next_scanline));
+      obj->Set(New("done").ToLocalChecked(), New(this->stream->state == STREAM_DONE));
+
+      return obj;
+    }
+
+    njt_compress_stream* stream;
+    bool busy;
+
+  private:
+    explicit CompressStream(njt_compress_stream* stream, uint32_t priority) :
+      stream(stream),
+      busy(false),
+      priority(priority) {
+      }
+
+    ~CompressStream() {
+      destroyStream(this->stream);
+    }
+
+    static void writeParse(const Nan::FunctionCallbackInfo<Value>& info, bool end);
+
+    uint32_t priority;
+};
+
+class CompressStreamWorker : public AsyncWorker {
+  public:
+    CompressStreamWorker(Callback *callback, Local<Object> &encoderObject, CompressStream* encoder, Local<Object> &srcObject, unsigned char* srcData, uint32_t rows, bool end) :
+      AsyncWorker(callback),
+      encoder(encoder),
+      srcData(srcData),
+      rows(rows),
+      end(end) {
+        SaveToPersistent("encoderObject", encoderObject);
+        if (srcData != NULL) {
+          SaveToPersistent("srcObject", srcObject);
+        }
+      }
+
+    ~CompressStreamWorker() {}
+
+    void Execute () {
+      int err;
+
+      err = encodeStrip(this->encoder->stream, this->srcData, this->rows, this->end, this->errStr);
+
+      if(err != 0) {
+        SetErrorMessage(this->errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      this->encoder->busy = false;
+
+      Local<Value> argv[] = {
+        Null(),
+        this->encoder->result()
+      };
+
+      callback->Call(2, argv);
+    }
+
+    void HandleErrorCallback () {
+      this->encoder->busy = false;
+      AsyncWorker::HandleErrorCallback();
+    }
+
+  private:
+    CompressStream* encoder;
+    unsigned char* srcData;
+    uint32_t rows;
+    bool end;
+    char errStr[NJT_MSG_LENGTH_MAX];
+};
+
+void CompressStream::writeParse(const Nan::FunctionCallbackInfo<Value>& info, bool end) {
+  int retval = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+
+  Callback *callback = NULL;
+  Local<Object> encoderObject = info.This();
+  CompressStream* encoder = ObjectWrap::Unwrap<CompressStream>(encoderObject);
+  njt_compress_stream* stream = encoder->stream;
+  Local<Object> srcObject;
+  unsigned char* srcData = NULL;
+  uint32_t srcLength = 0;
+  uint32_t pitch = stream->options.stride * stream->bpp;
+  uint32_t rowSize = stream->options.width * stream->bpp;
+  uint32_t rows = 0;
+
+  if (info.Length() > 0 && info[info.Length() - 1]->IsFunction()) {
+    callback = new Callback(info[info.Length() - 1].As<Function>());
+  }
+  else {
+    _throw("Missing callback");
+  }
+
+  if (encoder->busy) {
+    _throw("Encoder is busy");
+  }
+
+  if (stream->state == STREAM_FAILED) {
+    _throw("Encoder has failed");
+  }
+
+  if (stream->state == STREAM_DONE) {
+    _throw("Encoder has ended");
+  }
+
+  // Strip of rows, which is optional for end(). The last row doesn't need
+  // the padding.
+  if (!end || info.Length() > 1) {
+    srcObject = info[0].As<Object>();
+    if (!Buffer::HasInstance(srcObject)) {
+      _throw("Invalid source buffer");
+    }
+
+    srcData = (unsigned char*) Buffer::Data(srcObject);
+    srcLength = Buffer::Length(srcObject);
+
+    rows = srcLength / pitch;
+    if (srcLength % pitch >= rowSize) {
+      rows++;
+    }
+    else if (srcLength % pitch != 0) {
+      _throw("Source buffer must contain whole rows");
+    }
+
+    if (rows > stream->options.height - stream->cinfo.next_scanline) {
+      _throw("Too many rows");
+    }
+  }
+
+  if (njtPoolFull()) {
+    _throw("Queue is full");
+  }
+
+  encoder->busy = true;
+  njtQueueWorker(new CompressStreamWorker(callback, encoderObject, encoder, srcObject, srcData, rows, end), encoder->priority, NULL);
+  return;
+
+  bailout:
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+NAN_MODULE_INIT(InitCompressStream) {
+  Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(CompressStream::Construct);
+  tpl->SetClassName(Nan::New("CompressStream").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+  SetPrototypeMethod(tpl, "write", CompressStream::Write);
+  SetPrototypeMethod(tpl, "end", CompressStream::End);
+
+  Nan::Set(target, Nan::New("CompressStream").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+}
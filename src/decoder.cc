@@ -0,0 +1,192 @@
+#include "libjpeg.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// Decompresses frames with one set of options. The handle and the output
+// buffer are kept for the lifetime of the object, and the buffer is only
+// replaced when a frame doesn't fit in it.
+class Decoder : public ObjectWrap {
+  public:
+    static NAN_METHOD(Construct) {
+      int retval = 0;
+      char errStr[NJT_MSG_LENGTH_MAX];
+
+      Decoder* obj = NULL;
+      Local<Object> options;
+      njt_decompress_options opts;
+      J_COLOR_SPACE colorSpace;
+      int bpp = 0;
+      tjhandle handle = NULL;
+
+      if (!info.IsConstructCall()) {
+        _throw("Constructor must be called with new");
+      }
+
+      options = info[0].As<Object>();
+      if (decompressParseOptions(options, &opts, errStr) != 0) {
+        retval = -1;
+        goto bailout;
+      }
+
+      if (njtColorSpace(opts.format, &colorSpace, &bpp) != 0) {
+        _throw("Invalid output format");
+      }
+
+      // These change the shape of the output from frame to frame
+      if (opts.stride > 0 || opts.region) {
+        _throw("Decoder doesn't support stride or region");
+      }
+
+      handle = tjInitDecompress();
+      if (handle == NULL) {
+        _throw(njtGetErrorStr(handle));
+      }
+
+      obj = new Decoder(&opts, bpp, handle);
+      handle = NULL;
+      obj->Wrap(info.This());
+      info.GetReturnValue().Set(info.This());
+
+      bailout:
+      if (handle != NULL) {
+        tjDestroy(handle);
+      }
+
+      if (retval != 0) {
+        ThrowError(TypeError(errStr));
+        return;
+      }
+    }
+
+    // Returns the output buffer along with the size of the image in it. The
+    // buffer is reused by the next call.
+    static NAN_METHOD(Decode) {
+      int retval = 0;
+      char errStr[NJT_MSG_LENGTH_MAX];
+
+      Decoder* obj = ObjectWrap::Unwrap<Decoder>(info.This());
+      Local<Object> srcObject;
+      Local<Object> result;
+      unsigned char* srcData;
+      uint32_t srcLength;
+      int width;
+      int height;
+      uint64_t dstLength;
+      unsigned char* dstData;
+      int err;
+
+      if (info.Length() < 1) {
+        _throw("Too few arguments");
+      }
+
+      srcObject = info[0].As<Object>();
+      if (!Buffer::HasInstance(srcObject)) {
+        _throw("Invalid source buffer");
+      }
+
+      srcData = (unsigned char*) Buffer::Data(srcObject);
+      srcLength = Buffer::Length(srcObject);
+
+      err = tjDecompressHeader(obj->handle, srcData, srcLength, &width, &height);
+
+      if (err != 0) {
+        _throw(njtGetErrorStr(obj->handle));
+      }
+
+      // Frames usually have the same size, so the factor rarely changes
+      if (width != obj->lastWidth || height != obj->lastHeight) {
+        obj->factor.num = 1;
+        obj->factor.denom = 1;
+        if (obj->options.scale > 0 || obj->options.maxWidth > 0 || obj->options.maxHeight > 0) {
+          if (selectScalingFactor(width, height, obj->options.scale, obj->options.maxWidth, obj->options.maxHeight, &obj->factor, errStr) != 0) {
+            retval = -1;
+            goto bailout;
+          }
+        }
+        obj->lastWidth = width;
+        obj->lastHeight = height;
+      }
+
+      width = TJSCALED(width, obj->factor);
+      height = TJSCALED(height, obj->factor);
+      dstLength = (uint64_t) width * height * obj->bpp;
+      if (dstLength > UINT32_MAX) {
+        _throw("Image too large");
+      }
+
+      if (dstLength > obj->dstLength) {
+        dstData = (unsigned char*) malloc(dstLength);
+        if (dstData == NULL) {
+          _throw("Unable to allocate output buffer");
+        }
+
+        // Slices of the old buffer keep it alive for as long as they need it
+        obj->dstObject.Reset(NewBuffer((char*) dstData, dstLength, decompressBufferFreeCallback, NULL).ToLocalChecked());
+        obj->dstData = dstData;
+        obj->dstLength = (uint32_t) dstLength;
+      }
+
+      err = tjDecompress2(obj->handle, srcData, srcLength, obj->dstData, width, width * obj->bpp, height, obj->options.format, obj->flags);
+
+      if (err != 0) {
+        _throw(njtGetErrorStr(obj->handle));
+      }
+
+      result = New<Object>();
+      result->Set(New("data").ToLocalChecked(), New(obj->dstObject));
+      result->Set(New("width").ToLocalChecked(), New(width));
+      result->Set(New("height").ToLocalChecked(), New(height));
+      result->Set(New("size").ToLocalChecked(), New((uint32_t) dstLength));
+      info.GetReturnValue().Set(result);
+
+      bailout:
+      if (retval != 0) {
+        ThrowError(TypeError(errStr));
+        return;
+      }
+    }
+
+  private:
+    explicit Decoder(njt_decompress_options* options, int bpp, tjhandle handle) :
+      options(*options),
+      bpp(bpp),
+      lastWidth(0),
+      lastHeight(0),
+      handle(handle),
+      dstData(NULL),
+      dstLength(0) {
+        this->flags = options->accurateDct ? TJFLAG_ACCURATEDCT : TJFLAG_FASTDCT;
+        if (options->fastUpsample) {
+          this->flags |= TJFLAG_FASTUPSAMPLE;
+        }
+      }
+
+    ~Decoder() {
+      tjDestroy(this->handle);
+      this->dstObject.Reset();
+    }
+
+    njt_decompress_options options;
+    int bpp;
+    int flags;
+    int lastWidth;
+    int lastHeight;
+    tjscalingfactor factor;
+    tjhandle handle;
+    unsigned char* dstData;
+    uint32_t dstLength;
+    Nan::Persistent<Object> dstObject;
+};
+
+NAN_MODULE_INIT(InitDecoder) {
+  Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(Decoder::Construct);
+  tpl->SetClassName(Nan::New("Decoder").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+  SetPrototypeMethod(tpl, "decode", Decoder::Decode);
+
+  Nan::Set(target, Nan::New("Decoder").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+}
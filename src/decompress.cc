@@ -1,19 +1,90 @@
-#include "exports.h"
+#include <math.h>
+
+#include "libjpeg.h"
 using namespace Nan;
 using namespace v8;
 using namespace node;
 
-static char errStr[NJT_MSG_LENGTH_MAX] = "No error";
 #define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
 
-int decompress(unsigned char* srcData, uint32_t srcLength, uint32_t format, int* width, int* height, uint32_t* dstLength, unsigned char** dstData, uint32_t dstBufferLength) {
+// Picks the supported scaling factor closest to the requested scale, or the
+// largest non-upscaling factor if only a maximum size was given. Factors that
+// would exceed the maximum size are skipped altogether.
+int selectScalingFactor(int width, int height, double scale, uint32_t maxWidth, uint32_t maxHeight, tjscalingfactor* factor, char* errStr) {
+  int retval = 0;
+  tjscalingfactor* factors = NULL;
+  int factorCount = 0;
+  int best = -1;
+  int smallest = -1;
+  double value;
+  double bestValue = 0;
+  int i;
+
+  factors = tjGetScalingFactors(&factorCount);
+  if (factors == NULL || factorCount == 0) {
+    _throw(njtGetErrorStr(NULL));
+  }
+
+  for (i = 0; i < factorCount; i++) {
+    value = (double) factors[i].num / factors[i].denom;
+
+    if (smallest < 0 || value < (double) factors[smallest].num / factors[smallest].denom) {
+      smallest = i;
+    }
+
+    if (maxWidth > 0 && (uint32_t) TJSCALED(width, factors[i]) > maxWidth) {
+      continue;
+    }
+    if (maxHeight > 0 && (uint32_t) TJSCALED(height, factors[i]) > maxHeight) {
+      continue;
+    }
+
+    if (scale > 0) {
+      if (best < 0 || fabs(value - scale) < fabs(bestValue - scale)) {
+        best = i;
+        bestValue = value;
+      }
+    }
+    else if (value <= 1 && value > bestValue) {
+      best = i;
+      bestValue = value;
+    }
+  }
+
+  // Nothing fits, so get as close as we can
+  if (best < 0) {
+    best = smallest;
+  }
+
+  *factor = factors[best];
+
+  bailout:
+  return retval;
+}
+
+void decompressBufferFreeCallback(char *data, void *hint) {
+  free(data);
+}
+
+int decompress(unsigned char* srcData, uint32_t srcLength, njt_decompress_options* options, int* width, int* height, uint32_t* dstLength, unsigned char** dstData, uint32_t dstBufferLength, char* errStr) {
   int retval = 0;
   int err;
   tjhandle handle = NULL;
   int bpp;
+  uint32_t pitch;
+  tjscalingfactor factor;
+  bool allocated = false;
+  bool handled = false;
+  int flags = options->accurateDct ? TJFLAG_ACCURATEDCT : TJFLAG_FASTDCT;
+  int failure = NJT_ERROR_OTHER;
+  uint64_t startedAt;
+
+  if (options->fastUpsample) {
+    flags |= TJFLAG_FASTUPSAMPLE;
+  }
 
   // Figure out bpp from format (needed to calculate output buffer size)
-  switch (format) {
+  switch (options->format) {
     case FORMAT_GRAY:
       bpp = 1;
       break;
@@ -35,18 +106,69 @@ int decompress(unsigned char* srcData, uint32_t srcLength, uint32_t format, int*
       _throw("Invalid output format");
   }
 
-  handle = tjInitDecompress();
-  if (handle == NULL) {
-    _throw(tjGetErrorStr());
+  if (options->cancelled != NULL && *options->cancelled) {
+    _throw("Aborted");
   }
 
-  err = tjDecompressHeader(handle, srcData, srcLength, width, height);
+  // Without per-handle errors, libjpeg is driven directly all the way, see
+  // NJT_SHARED_ERRORS
+  if (!NJT_SHARED_ERRORS) {
+    handle = njtAcquireHandle(NJT_HANDLE_DECOMPRESS);
+    if (handle == NULL) {
+      _throw(njtGetErrorStr(handle));
+    }
+  }
+
+  startedAt = njtStatsNow();
+  if (NJT_SHARED_ERRORS) {
+    err = njtDecompressHeader(srcData, srcLength, width, height, errStr);
+  }
+  else {
+    err = tjDecompressHeader(handle, srcData, srcLength, width, height);
+    if (err != 0) {
+      snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", njtGetErrorStr(handle));
+    }
+  }
+  njtStatsStage(NJT_OP_DECOMPRESS, NJT_STAGE_HEADER, startedAt);
 
   if (err != 0) {
-    _throw(tjGetErrorStr());
+    failure = NJT_ERROR_HEADER;
+    retval = -1;
+    goto bailout;
   }
 
-  *dstLength = *width * *height * bpp;
+  factor.num = 1;
+  factor.denom = 1;
+
+  // Let the IDCT do the scaling for us
+  if (options->scale > 0 || options->maxWidth > 0 || options->maxHeight > 0) {
+    if (selectScalingFactor(*width, *height, options->scale, options->maxWidth, options->maxHeight, &factor, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+    *width = TJSCALED(*width, factor);
+    *height = TJSCALED(*height, factor);
+  }
+
+  // Only the region ends up in the output
+  if (options->region) {
+    if (options->regionX >= (uint32_t) *width || options->regionWidth > *width - options->regionX ||
+        options->regionY >= (uint32_t) *height || options->regionHeight > *height - options->regionY) {
+      _throw("Region out of bounds");
+    }
+    *width = options->regionWidth;
+    *height = options->regionHeight;
+  }
+
+  // The last row doesn't need the padding
+  pitch = *width * bpp;
+  if (options->stride > 0) {
+    if (options->stride < (uint32_t) *width) {
+      _throw("Stride must be at least as large as width");
+    }
+    pitch = options->stride * bpp;
+  }
+  *dstLength = pitch * (*height - 1) + *width * bpp;
 
   if (dstBufferLength > 0) {
     if (dstBufferLength < *dstLength) {
@@ -54,107 +176,380 @@ int decompress(unsigned char* srcData, uint32_t srcLength, uint32_t format, int*
     }
   }
   else {
-    *dstData = (unsigned char*)malloc(*dstLength);
+    if (options->arena != NULL) {
+      *dstData = njtArenaAlloc(options->arena, *dstLength);
+    }
+    else {
+      *dstData = (unsigned char*)malloc(*dstLength);
+    }
+    if (*dstData == NULL) {
+      _throw("Unable to allocate output buffer");
+    }
+    allocated = true;
   }
 
-  err = tjDecompress2(handle, srcData, srcLength, *dstData, *width, 0, *height, format, TJFLAG_FASTDCT);
+  startedAt = njtStatsNow();
+  failure = NJT_ERROR_CODEC;
 
-  if(err != 0) {
-    _throw(tjGetErrorStr());
+  if (options->region) {
+    if (njtDecompressRegion(srcData, srcLength, options, factor, *dstData, pitch, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+    handled = true;
+  }
+  // Spread restart intervals over several threads if possible
+  else if (options->threads != 1) {
+    if (njtDecompressRestartBands(srcData, srcLength, options->threads, options->priority, factor, options->format, flags, options->cancelled, *dstData, pitch, &handled, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
   }
 
+  // Lets us bail out between MCU rows
+  if (!handled && (options->cancelled != NULL || NJT_SHARED_ERRORS)) {
+    if (njtDecompressScanlines(srcData, srcLength, factor, options->format, flags, options->cancelled, *dstData, pitch, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+    handled = true;
+  }
+
+  if (!handled) {
+    err = tjDecompress2(handle, srcData, srcLength, *dstData, *width, pitch, *height, options->format, flags);
+
+    if(err != 0) {
+      _throw(njtGetErrorStr(handle));
+    }
+  }
+
+  njtStatsStage(NJT_OP_DECOMPRESS, NJT_STAGE_CODEC, startedAt);
+
 
   bailout:
-  if (handle != NULL) {
-    err = 0;
-    err = tjDestroy(handle);
-    // If we already have an error retval wont be 0 so in that case we don't want to overwrite error message
-    // Also cant use _throw here because infinite-loop
-    if (err != 0 && retval == 0) {
-      snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", tjGetErrorStr());
+  njtReleaseHandle(NJT_HANDLE_DECOMPRESS, handle);
+
+  if (retval == 0) {
+    njtStatsCall(NJT_OP_DECOMPRESS, srcLength, *dstLength, (uint64_t) *width * *height);
+  }
+  else if (options->cancelled != NULL && *options->cancelled) {
+    njtStatsError(NJT_OP_DECOMPRESS, NJT_ERROR_ABORTED);
+  }
+  else {
+    njtStatsError(NJT_OP_DECOMPRESS, failure);
+  }
+
+  if (retval != 0) {
+    if (options->cancelled != NULL && *options->cancelled) {
+      snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Aborted");
+    }
+    if (allocated) {
+      if (options->arena != NULL) {
+        njtArenaFreeCallback((char*) *dstData, NULL);
+      }
+      else {
+        free(*dstData);
+      }
+      *dstData = NULL;
+    }
+  }
+
+  return retval;
+}
+
+int decompressParseOptions(Local<Object> options, njt_decompress_options* opts, char* errStr) {
+  int retval = 0;
+
+  Local<Value> formatObject;
+  Local<Value> strideObject;
+  Local<Value> scaleObject;
+  Local<Value> maxWidthObject;
+  Local<Value> maxHeightObject;
+  Local<Value> accurateDctObject;
+  Local<Value> fastUpsampleObject;
+  Local<Value> threadsObject;
+  Local<Value> regionObject;
+  Local<Object> region;
+  Local<Value> regionX;
+  Local<Value> regionY;
+  Local<Value> regionWidth;
+  Local<Value> regionHeight;
+
+  opts->format = NJT_DEFAULT_FORMAT;
+  opts->stride = 0;
+  opts->scale = 0;
+  opts->maxWidth = 0;
+  opts->maxHeight = 0;
+  opts->accurateDct = false;
+  opts->fastUpsample = false;
+  opts->threads = 1;
+  opts->priority = PRIORITY_INTERACTIVE;
+  opts->region = false;
+  opts->regionX = 0;
+  opts->regionY = 0;
+  opts->regionWidth = 0;
+  opts->regionHeight = 0;
+  opts->cancelled = NULL;
+  opts->arena = NULL;
+
+  // Options are optional
+  if (!options->IsObject()) {
+    return 0;
+  }
+
+  // Format of output buffer
+  formatObject = options->Get(New("format").ToLocalChecked());
+  if (!formatObject->IsUndefined()) {
+    if (!formatObject->IsUint32()) {
+      _throw("Invalid format");
+    }
+    opts->format = formatObject->Uint32Value();
+  }
+
+  // Row stride of output buffer in pixels
+  strideObject = options->Get(New("stride").ToLocalChecked());
+  if (!strideObject->IsUndefined()) {
+    if (!strideObject->IsUint32() || strideObject->Uint32Value() == 0) {
+      _throw("Invalid stride value");
+    }
+    opts->stride = strideObject->Uint32Value();
+  }
+
+  // Scale
+  scaleObject = options->Get(New("scale").ToLocalChecked());
+  if (!scaleObject->IsUndefined()) {
+    if (!scaleObject->IsNumber() || !(scaleObject->NumberValue() > 0)) {
+      _throw("Invalid scale value");
+    }
+    opts->scale = scaleObject->NumberValue();
+  }
+
+  // Maximum width
+  maxWidthObject = options->Get(New("maxWidth").ToLocalChecked());
+  if (!maxWidthObject->IsUndefined()) {
+    if (!maxWidthObject->IsUint32() || maxWidthObject->Uint32Value() == 0) {
+      _throw("Invalid maxWidth value");
+    }
+    opts->maxWidth = maxWidthObject->Uint32Value();
+  }
+
+  // Maximum height
+  maxHeightObject = options->Get(New("maxHeight").ToLocalChecked());
+  if (!maxHeightObject->IsUndefined()) {
+    if (!maxHeightObject->IsUint32() || maxHeightObject->Uint32Value() == 0) {
+      _throw("Invalid maxHeight value");
+    }
+    opts->maxHeight = maxHeightObject->Uint32Value();
+  }
+
+  // Accurate DCT, slower but better quality than the default fast DCT
+  accurateDctObject = options->Get(New("accurateDct").ToLocalChecked());
+  if (!accurateDctObject->IsUndefined()) {
+    if (!accurateDctObject->IsBoolean()) {
+      _throw("Invalid accurateDct value");
     }
+    opts->accurateDct = accurateDctObject->IsTrue();
   }
 
+  // Nearest neighbor chroma upsampling, faster but blockier
+  fastUpsampleObject = options->Get(New("fastUpsample").ToLocalChecked());
+  if (!fastUpsampleObject->IsUndefined()) {
+    if (!fastUpsampleObject->IsBoolean()) {
+      _throw("Invalid fastUpsample value");
+    }
+    opts->fastUpsample = fastUpsampleObject->IsTrue();
+  }
+
+  // Threads for decoding restart intervals in parallel
+  threadsObject = options->Get(New("threads").ToLocalChecked());
+  if (!threadsObject->IsUndefined()) {
+    if (!threadsObject->IsUint32()) {
+      _throw("Invalid threads value");
+    }
+    opts->threads = threadsObject->Uint32Value();
+  }
+
+  // Lane those threads are taken from, see njtParallelFor()
+  if (njtParsePriority(options, &opts->priority, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // Region of the (scaled) image to decode
+  regionObject = options->Get(New("region").ToLocalChecked());
+  if (!regionObject->IsUndefined()) {
+    if (!regionObject->IsObject()) {
+      _throw("Invalid region value");
+    }
+    region = regionObject.As<Object>();
+    regionX = region->Get(New("x").ToLocalChecked());
+    regionY = region->Get(New("y").ToLocalChecked());
+    regionWidth = region->Get(New("width").ToLocalChecked());
+    regionHeight = region->Get(New("height").ToLocalChecked());
+    if (!regionX->IsUint32() || !regionY->IsUint32() || !regionWidth->IsUint32() || !regionHeight->IsUint32()) {
+      _throw("Invalid region value");
+    }
+    if (regionWidth->Uint32Value() == 0 || regionHeight->Uint32Value() == 0) {
+      _throw("Invalid region value");
+    }
+    opts->region = true;
+    opts->regionX = regionX->Uint32Value();
+    opts->regionY = regionY->Uint32Value();
+    opts->regionWidth = regionWidth->Uint32Value();
+    opts->regionHeight = regionHeight->Uint32Value();
+  }
+
+  bailout:
   return retval;
 }
 
+static bool isOutputTarget(Local<Object> object) {
+  return object->IsArrayBufferView() || object->IsArrayBuffer() || object->IsSharedArrayBuffer();
+}
+
+static void outputTargetData(Local<Object> object, unsigned char** data, uint32_t* length) {
+  if (object->IsArrayBufferView()) {
+    *data = (unsigned char*) Buffer::Data(object);
+    *length = Buffer::Length(object);
+  }
+  else if (object->IsSharedArrayBuffer()) {
+    SharedArrayBuffer::Contents contents = object.As<SharedArrayBuffer>()->GetContents();
+    *data = (unsigned char*) contents.Data();
+    *length = contents.ByteLength();
+  }
+  else {
+    ArrayBuffer::Contents contents = object.As<ArrayBuffer>()->GetContents();
+    *data = (unsigned char*) contents.Data();
+    *length = contents.ByteLength();
+  }
+}
+
 class DecompressWorker : public AsyncWorker {
   public:
-    DecompressWorker(Callback *callback, unsigned char* srcData, uint32_t srcLength, uint32_t format, Local<Object> &dstObject, unsigned char* dstData, uint32_t dstBufferLength) :
+    DecompressWorker(Callback *callback, Local<Object> &srcObject, unsigned char* srcData, uint32_t srcLength, njt_decompress_options* options, Local<Object> &dstObject, unsigned char* dstData, uint32_t dstBufferLength, Local<Object> &tokenObject, Local<Object> &arenaObject, uint32_t offset, bool transfer) :
       AsyncWorker(callback),
       srcData(srcData),
       srcLength(srcLength),
-      format(format),
+      options(*options),
       dstData(dstData),
       dstBufferLength(dstBufferLength),
+      offset(offset),
       width(0),
       height(0),
-      dstLength(0) {
-        if (dstBufferLength > 0) {
-          SaveToPersistent("dstObject", dstObject);
+      dstLength(0),
+      queuedAt(njtStatsNow()) {
+        this->srcTransfer.data = NULL;
+        this->dstTransfer.data = NULL;
+
+        // Either take over the memory or keep the Buffers alive
+        if (transfer) {
+          njtTransferBuffer(srcObject, &this->srcTransfer);
+          if (dstBufferLength > 0) {
+            njtTransferBuffer(dstObject, &this->dstTransfer);
+          }
+        }
+        else {
+          SaveToPersistent("srcObject", srcObject);
+          if (dstBufferLength > 0) {
+            SaveToPersistent("dstObject", dstObject);
+          }
+        }
+        if (options->cancelled != NULL) {
+          SaveToPersistent("tokenObject", tokenObject);
+        }
+        if (options->arena != NULL) {
+          SaveToPersistent("arenaObject", arenaObject);
         }
       }
 
-    ~DecompressWorker() {}
+    ~DecompressWorker() {
+      njtFreeTransfer(&this->srcTransfer);
+      njtFreeTransfer(&this->dstTransfer);
+    }
 
     void Execute () {
       int err;
 
+      njtStatsStage(NJT_OP_DECOMPRESS, NJT_STAGE_QUEUE, this->queuedAt);
+
       err = decompress(
           this->srcData,
           this->srcLength,
-          this->format,
+          &this->options,
           &this->width,
           &this->height,
           &this->dstLength,
           &this->dstData,
-          this->dstBufferLength);
+          this->dstBufferLength,
+          this->errStr);
 
       if(err != 0) {
-        SetErrorMessage(errStr);
+        SetErrorMessage(this->errStr);
       }
     }
 
     void HandleOKCallback () {
+      uint64_t startedAt = njtStatsNow();
       Local<Object> obj = New<Object>();
       Local<Object> dstObject;
 
-      if (this->dstBufferLength > 0) {
+      if (this->dstTransfer.data != NULL) {
+        dstObject = njtReturnTransfer(&this->dstTransfer);
+      }
+      else if (this->dstBufferLength > 0) {
         dstObject = GetFromPersistent("dstObject").As<Object>();
       }
       else {
-        dstObject = NewBuffer((char*)this->dstData, this->dstLength).ToLocalChecked();
+        dstObject = NewBuffer((char*)this->dstData, this->dstLength, this->options.arena != NULL ? njtArenaFreeCallback : decompressBufferFreeCallback, NULL).ToLocalChecked();
       }
 
       obj->Set(New("data").ToLocalChecked(), dstObject);
       obj->Set(New("width").ToLocalChecked(), New(this->width));
       obj->Set(New("height").ToLocalChecked(), New(this->height));
       obj->Set(New("size").ToLocalChecked(), New(this->dstLength));
-      obj->Set(New("format").ToLocalChecked(), New(this->format));
+      obj->Set(New("format").ToLocalChecked(), New(this->options.format));
+      obj->Set(New("offset").ToLocalChecked(), New(this->offset));
+
+      // Hand the source back too
+      if (this->srcTransfer.data != NULL) {
+        obj->Set(New("source").ToLocalChecked(), njtReturnTransfer(&this->srcTransfer));
+      }
 
       Local<Value> argv[] = {
         Null(),
         obj
       };
 
+      njtStatsStage(NJT_OP_DECOMPRESS, NJT_STAGE_BUFFER, startedAt);
+      startedAt = njtStatsNow();
+
       callback->Call(2, argv);
+
+      njtStatsStage(NJT_OP_DECOMPRESS, NJT_STAGE_CALLBACK, startedAt);
+      njtStatsStage(NJT_OP_DECOMPRESS, NJT_STAGE_TOTAL, this->queuedAt);
     }
 
   private:
     unsigned char* srcData;
     uint32_t srcLength;
-    uint32_t format;
+    njt_decompress_options options;
 
     unsigned char* dstData;
     uint32_t dstBufferLength;
+    uint32_t offset;
     int width;
     int height;
     uint32_t dstLength;
+    uint64_t queuedAt;
+    njt_transfer srcTransfer;
+    njt_transfer dstTransfer;
+    char errStr[NJT_MSG_LENGTH_MAX];
 };
 
 void decompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
   int retval = 0;
   int cursor = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
 
   // Input
   Callback *callback = NULL;
@@ -162,8 +557,12 @@ void decompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
   unsigned char* srcData = NULL;
   uint32_t srcLength = 0;
   Local<Object> options;
-  Local<Value> formatObject;
-  uint32_t format = NJT_DEFAULT_FORMAT;
+  njt_decompress_options opts;
+  Local<Object> tokenObject;
+  Local<Object> arenaObject;
+  Local<Value> offsetObject;
+  uint32_t offset = 0;
+  bool transfer = false;
 
   // Output
   Local<Object> dstObject;
@@ -172,6 +571,8 @@ void decompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
   int width;
   int height;
   uint32_t dstLength;
+  uint64_t startedAt = njtStatsNow();
+  uint64_t bufferAt;
 
   // Try to find callback here, so if we want to throw something we can use callback's err
   if (async) {
@@ -200,60 +601,102 @@ void decompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
   options = info[cursor++].As<Object>();
 
   // Check if options we just got is actually the destination buffer
-  // If it is, pull new object from info and set that as options
-  if (Buffer::HasInstance(options) && info.Length() > cursor) {
+  // If it is, pull new object from info and set that as options. Any
+  // TypedArray or (Shared)ArrayBuffer will do, e.g. to decode straight into
+  // memory shared with a worker.
+  if (isOutputTarget(options) && info.Length() > cursor) {
     dstObject = options;
     options = info[cursor++].As<Object>();
-    dstBufferLength = Buffer::Length(dstObject);
-    dstData = (unsigned char*) Buffer::Data(dstObject);
+    outputTargetData(dstObject, &dstData, &dstBufferLength);
+
+    // Byte offset into the destination
+    if (options->IsObject()) {
+      offsetObject = options->Get(New("offset").ToLocalChecked());
+      if (!offsetObject->IsUndefined()) {
+        if (!offsetObject->IsUint32() || offsetObject->Uint32Value() > dstBufferLength) {
+          _throw("Invalid offset value");
+        }
+        offset = offsetObject->Uint32Value();
+        dstData += offset;
+        dstBufferLength -= offset;
+      }
+    }
+
+    if (dstBufferLength == 0) {
+      _throw("Insufficient output buffer");
+    }
+  }
+
+  if (decompressParseOptions(options, &opts, errStr) != 0) {
+    retval = -1;
+    goto bailout;
   }
 
-  // Options are optional
   if (options->IsObject()) {
-    // Format of output buffer
-    formatObject = options->Get(New("format").ToLocalChecked());
-    if (!formatObject->IsUndefined()) {
-      if (!formatObject->IsUint32()) {
-        _throw("Invalid format");
+    if (njtParseCancelToken(options, &tokenObject, &opts.cancelled, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+    if (njtParseArena(options, &arenaObject, &opts.arena, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+
+    // Only meaningful for async calls
+    if (async) {
+      if (njtParseTransfer(options, &transfer, errStr) != 0) {
+        retval = -1;
+        goto bailout;
+      }
+      if (transfer && (!njtCanTransfer(srcObject) || (dstBufferLength > 0 && !njtCanTransfer(dstObject)))) {
+        _throw("Buffer cannot be transferred");
       }
-      format = formatObject->Uint32Value();
     }
   }
 
   // Do either async or sync decompress
   if (async) {
-    AsyncQueueWorker(new DecompressWorker(callback, srcData, srcLength, format, dstObject, dstData, dstBufferLength));
+    if (njtPoolFull()) {
+      _throw("Queue is full");
+    }
+    njtQueueWorker(new DecompressWorker(callback, srcObject, srcData, srcLength, &opts, dstObject, dstData, dstBufferLength, tokenObject, arenaObject, offset, transfer), opts.priority, opts.cancelled);
     return;
   }
   else {
     retval = decompress(
         srcData,
         srcLength,
-        format,
+        &opts,
         &width,
         &height,
         &dstLength,
         &dstData,
-        dstBufferLength);
+        dstBufferLength,
+        errStr);
 
 
     if(retval != 0) {
       // decompress will set the errStr
       goto bailout;
     }
+    bufferAt = njtStatsNow();
     Local<Object> obj = New<Object>();
 
     if (dstBufferLength == 0) {
-      dstObject = NewBuffer((char*)dstData, dstLength).ToLocalChecked();
+      dstObject = NewBuffer((char*)dstData, dstLength, opts.arena != NULL ? njtArenaFreeCallback : decompressBufferFreeCallback, NULL).ToLocalChecked();
     }
 
     obj->Set(New("data").ToLocalChecked(), dstObject);
     obj->Set(New("width").ToLocalChecked(), New(width));
     obj->Set(New("height").ToLocalChecked(), New(height));
     obj->Set(New("size").ToLocalChecked(), New(dstLength));
-    obj->Set(New("format").ToLocalChecked(), New(format));
+    obj->Set(New("format").ToLocalChecked(), New(opts.format));
+    obj->Set(New("offset").ToLocalChecked(), New(offset));
 
     info.GetReturnValue().Set(obj);
+
+    njtStatsStage(NJT_OP_DECOMPRESS, NJT_STAGE_BUFFER, bufferAt);
+    njtStatsStage(NJT_OP_DECOMPRESS, NJT_STAGE_TOTAL, startedAt);
     return;
   }
 
@@ -0,0 +1,552 @@
+#include "libjpeg.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+enum {
+  STREAM_HEADER = 0,
+  STREAM_START,
+  STREAM_SCANLINES,
+  STREAM_FINISH,
+  STREAM_DONE,
+  STREAM_FAILED,
+};
+
+typedef struct njt_band {
+  unsigned char* data;
+  uint32_t y;
+  uint32_t rows;
+  struct njt_band* next;
+} njt_band;
+
+typedef struct {
+  struct jpeg_decompress_struct cinfo;
+  njt_error_mgr jerr;
+  struct jpeg_source_mgr src;
+  bool created;
+
+  // Compressed data that libjpeg hasn't consumed yet
+  unsigned char* buffer;
+  size_t bufferSize;
+  size_t skipBytes;
+  bool eof;
+
+  int state;
+  J_COLOR_SPACE colorSpace;
+  int bpp;
+  uint32_t bandHeight;
+  uint32_t rowSize;
+  JSAMPROW* rows;
+
+  // The band currently being filled, and finished bands waiting to be
+  // handed over to JS
+  unsigned char* band;
+  uint32_t bandY;
+  uint32_t bandRows;
+  njt_band* bands;
+  njt_band* lastBand;
+} njt_decompress_stream;
+
+static void initSource(j_decompress_ptr cinfo) {
+}
+
+// Returning FALSE suspends the decoder until more data arrives.
+static boolean fillInputBuffer(j_decompress_ptr cinfo) {
+  njt_decompress_stream* stream = (njt_decompress_stream*) cinfo->client_data;
+
+  if (stream->eof) {
+    ERREXIT(cinfo, JERR_INPUT_EOF);
+  }
+
+  return FALSE;
+}
+
+// Skips may extend past the data we have, in which case the rest is
+// dropped from the following chunks.
+static void skipInputData(j_decompress_ptr cinfo, long numBytes) {
+  njt_decompress_stream* stream = (njt_decompress_stream*) cinfo->client_data;
+  struct jpeg_source_mgr* src = cinfo->src;
+
+  if (numBytes <= 0) {
+    return;
+  }
+
+  if ((size_t) numBytes > src->bytes_in_buffer) {
+    stream->skipBytes += numBytes - src->bytes_in_buffer;
+    src->next_input_byte += src->bytes_in_buffer;
+    src->bytes_in_buffer = 0;
+  }
+  else {
+    src->next_input_byte += numBytes;
+    src->bytes_in_buffer -= numBytes;
+  }
+}
+
+static void termSource(j_decompress_ptr cinfo) {
+}
+
+static int initStream(njt_decompress_stream* stream, char* errStr) {
+  stream->cinfo.err = njtErrorMgr(&stream->jerr);
+
+  if (setjmp(stream->jerr.setjmpBuffer)) {
+    njtFormatError((j_common_ptr) &stream->cinfo, errStr);
+    return -1;
+  }
+
+  jpeg_create_decompress(&stream->cinfo);
+  stream->created = true;
+
+  stream->cinfo.client_data = stream;
+  stream->src.init_source = initSource;
+  stream->src.fill_input_buffer = fillInputBuffer;
+  stream->src.skip_input_data = skipInputData;
+  stream->src.resync_to_restart = jpeg_resync_to_restart;
+  stream->src.term_source = termSource;
+  stream->src.next_input_byte = NULL;
+  stream->src.bytes_in_buffer = 0;
+  stream->cinfo.src = &stream->src;
+
+  return 0;
+}
+
+static void destroyStream(njt_decompress_stream* stream) {
+  njt_band* band;
+
+  if (stream->created) {
+    jpeg_destroy_decompress(&stream->cinfo);
+  }
+
+  while (stream->bands != NULL) {
+    band = stream->bands;
+    stream->bands = band->next;
+    free(band->data);
+    free(band);
+  }
+
+  free(stream->buffer);
+  free(stream->rows);
+  free(stream->band);
+  free(stream);
+}
+
+// Appends a chunk after whatever libjpeg hasn't consumed yet. Consumed data
+// is dropped, so the buffer only grows if a single unit (e.g. a marker or an
+// MCU) spans several chunks.
+static int appendData(njt_decompress_stream* stream, unsigned char* data, size_t length, char* errStr) {
+  int retval = 0;
+  size_t skip;
+  size_t remaining = stream->src.bytes_in_buffer;
+  size_t size;
+  unsigned char* buffer;
+
+  skip = stream->skipBytes < length ? stream->skipBytes : length;
+  stream->skipBytes -= skip;
+  data += skip;
+  length -= skip;
+
+  if (remaining > 0 && stream->src.next_input_byte != stream->buffer) {
+    memmove(stream->buffer, stream->src.next_input_byte, remaining);
+  }
+
+  if (remaining + length > stream->bufferSize) {
+    size = stream->bufferSize * 2;
+    if (size < remaining + length) {
+      size = remaining + length;
+    }
+    buffer = (unsigned char*) realloc(stream->buffer, size);
+    if (buffer == NULL) {
+      _throw("Unable to allocate input buffer");
+    }
+    stream->buffer = buffer;
+    stream->bufferSize = size;
+  }
+
+  memcpy(stream->buffer + remaining, data, length);
+  stream->src.next_input_byte = stream->buffer;
+  stream->src.bytes_in_buffer = remaining + length;
+
+  bailout:
+  return retval;
+}
+
+static int pushBand(njt_decompress_stream* stream, char* errStr) {
+  int retval = 0;
+  njt_band* band;
+
+  band = (njt_band*) malloc(sizeof(njt_band));
+  if (band == NULL) {
+    _throw("Unable to allocate band");
+  }
+
+  band->data = stream->band;
+  band->y = stream->bandY;
+  band->rows = stream->bandRows;
+  band->next = NULL;
+
+  if (stream->lastBand != NULL) {
+    stream->lastBand->next = band;
+  }
+  else {
+    stream->bands = band;
+  }
+  stream->lastBand = band;
+  stream->band = NULL;
+
+  bailout:
+  return retval;
+}
+
+// Decodes as far as the available data allows. Returns 0 when suspended or
+// done, in which case stream->state tells which.
+static int decodeStream(njt_decompress_stream* stream, char* errStr) {
+  int retval = 0;
+  JDIMENSION rows;
+  uint32_t i;
+
+  if (setjmp(stream->jerr.setjmpBuffer)) {
+    njtFormatError((j_common_ptr) &stream->cinfo, errStr);
+    stream->state = STREAM_FAILED;
+    return -1;
+  }
+
+  if (stream->state == STREAM_HEADER) {
+    if (jpeg_read_header(&stream->cinfo, TRUE) == JPEG_SUSPENDED) {
+      return 0;
+    }
+    stream->cinfo.out_color_space = stream->colorSpace;
+    stream->cinfo.dct_method = JDCT_IFAST;
+    stream->state = STREAM_START;
+  }
+
+  // Note that for multi-scan (e.g. progressive) images this only returns
+  // once the whole image has been read.
+  if (stream->state == STREAM_START) {
+    if (!jpeg_start_decompress(&stream->cinfo)) {
+      return 0;
+    }
+    if (stream->bandHeight == 0) {
+      stream->bandHeight = stream->cinfo.max_v_samp_factor * DCTSIZE;
+    }
+    stream->rowSize = stream->cinfo.output_width * stream->bpp;
+    stream->rows = (JSAMPROW*) malloc(stream->bandHeight * sizeof(JSAMPROW));
+    if (stream->rows == NULL) {
+      _throw("Unable to allocate band");
+    }
+    stream->state = STREAM_SCANLINES;
+  }
+
+  if (stream->state == STREAM_SCANLINES) {
+    while (stream->cinfo.output_scanline < stream->cinfo.output_height) {
+      if (stream->band == NULL) {
+        stream->band = (unsigned char*) malloc(stream->bandHeight * stream->rowSize);
+        if (stream->band == NULL) {
+          _throw("Unable to allocate band");
+        }
+        stream->bandY = stream->cinfo.output_scanline;
+        stream->bandRows = 0;
+      }
+
+      for (i = 0; i < stream->bandHeight - stream->bandRows; i++) {
+        stream->rows[i] = stream->band + (stream->bandRows + i) * stream->rowSize;
+      }
+
+      rows = jpeg_read_scanlines(&stream->cinfo, stream->rows, stream->bandHeight - stream->bandRows);
+      if (rows == 0) {
+        return 0;
+      }
+      stream->bandRows += rows;
+
+      if (stream->bandRows == stream->bandHeight || stream->cinfo.output_scanline == stream->cinfo.output_height) {
+        if (pushBand(stream, errStr) != 0) {
+          retval = -1;
+          goto bailout;
+        }
+      }
+    }
+    stream->state = STREAM_FINISH;
+  }
+
+  if (stream->state == STREAM_FINISH) {
+    if (!jpeg_finish_decompress(&stream->cinfo)) {
+      return 0;
+    }
+    stream->state = STREAM_DONE;
+  }
+
+  bailout:
+  if (retval != 0) {
+    stream->state = STREAM_FAILED;
+  }
+  return retval;
+}
+
+class DecompressStream : public ObjectWrap {
+  public:
+    static NAN_METHOD(Construct) {
+      int retval = 0;
+      char errStr[NJT_MSG_LENGTH_MAX];
+
+      DecompressStream* obj = NULL;
+      njt_decompress_stream* stream = NULL;
+      Local<Object> options;
+      Local<Value> formatObject;
+      uint32_t format = NJT_DEFAULT_FORMAT;
+      Local<Value> bandHeightObject;
+      uint32_t priority = PRIORITY_INTERACTIVE;
+
+      if (!info.IsConstructCall()) {
+        _throw("Constructor must be called with new");
+      }
+
+      stream = (njt_decompress_stream*) calloc(1, sizeof(njt_decompress_stream));
+      if (stream == NULL) {
+        _throw("Unable to allocate decoder");
+      }
+
+      // Options are optional
+      options = info[0].As<Object>();
+      if (options->IsObject()) {
+        // Format of output bands
+        formatObject = options->Get(New("format").ToLocalChecked());
+        if (!formatObject->IsUndefined()) {
+          if (!formatObject->IsUint32()) {
+            _throw("Invalid format");
+          }
+          format = formatObject->Uint32Value();
+        }
+
+        // Rows per band
+        bandHeightObject = options->Get(New("bandHeight").ToLocalChecked());
+        if (!bandHeightObject->IsUndefined()) {
+          if (!bandHeightObject->IsUint32() || bandHeightObject->Uint32Value() == 0) {
+            _throw("Invalid bandHeight value");
+          }
+          stream->bandHeight = bandHeightObject->Uint32Value();
+        }
+
+        if (njtParsePriority(options, &priority, errStr) != 0) {
+          retval = -1;
+          goto bailout;
+        }
+      }
+
+      if (njtColorSpace(format, &stream->colorSpace, &stream->bpp) != 0) {
+        _throw("Invalid output format");
+      }
+
+      if (initStream(stream, errStr) != 0) {
+        retval = -1;
+        goto bailout;
+      }
+
+      obj = new DecompressStream(stream, format, priority);
+      stream = NULL;
+      obj->Wrap(info.This());
+      info.GetReturnValue().Set(info.This());
+
+      bailout:
+      if (stream != NULL) {
+        destroyStream(stream);
+      }
+
+      if (retval != 0) {
+        ThrowError(TypeError(errStr));
+        return;
+      }
+    }
+
+    static NAN_METHOD(Write) {
+      writeParse(info, false);
+    }
+
+    static NAN_METHOD(End) {
+      writeParse(info, true);
+    }
+
+    // Hands finished bands over to JS.
+    Local<Object> result() {
+      Local<Object> obj = New<Object>();
+      Local<Array> bands = New<Array>();
+      njt_band* band;
+      uint32_t i = 0;
+
+      if (!this->headerReported && this->stream->state > STREAM_START && this->stream->state != STREAM_FAILED) {
+        Local<Object> header = New<Object>();
+        header->Set(New("width").ToLocalChecked(), New((uint32_t) this->stream->cinfo.output_width));
+        header->Set(New("height").ToLocalChecked(), New((uint32_t) this->stream->cinfo.output_height));
+        header->Set(New("format").ToLocalChecked(), New(this->format));
+        header->Set(New("bpp").ToLocalChecked(), New(this->stream->bpp));
+        header->Set(New("progressive").ToLocalChecked(), New((bool) this->stream->cinfo.progressive_mode));
+        header->Set(New("bandHeight").ToLocalChecked(), New(this->stream->bandHeight));
+        obj->Set(New("header").ToLocalChecked(), header);
+        this->headerReported = true;
+      }
+
+      while (this->stream->bands != NULL) {
+        Local<Object> bandObject = New<Object>();
+        band = this->stream->bands;
+        this->stream->bands = band->next;
+
+        bandObject->Set(New("data").ToLocalChecked(), NewBuffer((char*)band->data, band->rows * this->stream->rowSize, decompressBufferFreeCallback, NULL).ToLocalChecked());
+        bandObject->Set(New("y").ToLocalChecked(), New(band->y));
+        bandObject->Set(New("height").ToLocalChecked(), New(band->rows));
+        bands->Set(i++, bandObject);
+        free(band);
+      }
+      this->stream->lastBand = NULL;
+
+      obj->Set(New("bands").ToLocalChecked(), bands);
+      obj->Set(New("done").ToLocalChecked(), New(this->stream->state == STREAM_DONE));
+
+      return obj;
+    }
+
+    njt_decompress_stream* stream;
+    bool busy;
+
+  private:
+    explicit DecompressStream(njt_decompress_stream* stream, uint32_t format, uint32_t priority) :
+      stream(stream),
+      busy(false),
+      format(format),
+      priority(priority),
+      headerReported(false) {
+      }
+
+    ~DecompressStream() {
+      destroyStream(this->stream);
+    }
+
+    static void writeParse(const Nan::FunctionCallbackInfo<Value>& info, bool end);
+
+    uint32_t format;
+    uint32_t priority;
+    bool headerReported;
+};
+
+class DecompressStreamWorker : public AsyncWorker {
+  public:
+    DecompressStreamWorker(Callback *callback, Local<Object> &decoderObject, DecompressStream* decoder) :
+      AsyncWorker(callback),
+      decoder(decoder) {
+        SaveToPersistent("decoderObject", decoderObject);
+      }
+
+    ~DecompressStreamWorker() {}
+
+    void Execute () {
+      int err;
+
+      err = decodeStream(this->decoder->stream, this->errStr);
+
+      if (err == 0 && this->decoder->stream->eof && this->decoder->stream->state != STREAM_DONE) {
+        snprintf(this->errStr, NJT_MSG_LENGTH_MAX, "%s", "Premature end of JPEG data");
+        err = -1;
+      }
+
+      if(err != 0) {
+        SetErrorMessage(this->errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      this->decoder->busy = false;
+
+      Local<Value> argv[] = {
+        Null(),
+        this->decoder->result()
+      };
+
+      callback->Call(2, argv);
+    }
+
+    void HandleErrorCallback () {
+      this->decoder->busy = false;
+      AsyncWorker::HandleErrorCallback();
+    }
+
+  private:
+    DecompressStream* decoder;
+    char errStr[NJT_MSG_LENGTH_MAX];
+};
+
+void DecompressStream::writeParse(const Nan::FunctionCallbackInfo<Value>& info, bool end) {
+  int retval = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+
+  Callback *callback = NULL;
+  Local<Object> decoderObject = info.This();
+  DecompressStream* decoder = ObjectWrap::Unwrap<DecompressStream>(decoderObject);
+  Local<Object> chunkObject;
+
+  if (info.Length() > 0 && info[info.Length() - 1]->IsFunction()) {
+    callback = new Callback(info[info.Length() - 1].As<Function>());
+  }
+  else {
+    _throw("Missing callback");
+  }
+
+  if (decoder->busy) {
+    _throw("Decoder is busy");
+  }
+
+  if (decoder->stream->state == STREAM_FAILED) {
+    _throw("Decoder has failed");
+  }
+
+  if (decoder->stream->eof) {
+    _throw("Decoder has ended");
+  }
+
+  // Chunk, which is optional for end()
+  if (!end || info.Length() > 1) {
+    chunkObject = info[0].As<Object>();
+    if (!Buffer::HasInstance(chunkObject)) {
+      _throw("Invalid source buffer");
+    }
+
+    if (appendData(decoder->stream, (unsigned char*) Buffer::Data(chunkObject), Buffer::Length(chunkObject), errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+  }
+
+  if (end) {
+    decoder->stream->eof = true;
+  }
+
+  if (njtPoolFull()) {
+    _throw("Queue is full");
+  }
+
+  decoder->busy = true;
+  njtQueueWorker(new DecompressStreamWorker(callback, decoderObject, decoder), decoder->priority, NULL);
+  return;
+
+  bailout:
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+NAN_MODULE_INIT(InitDecompressStream) {
+  Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(DecompressStream::Construct);
+  tpl->SetClassName(Nan::New("DecompressStream").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+  SetPrototypeMethod(tpl, "write", DecompressStream::Write);
+  SetPrototypeMethod(tpl, "end", DecompressStream::End);
+
+  Nan::Set(target, Nan::New("DecompressStream").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+}
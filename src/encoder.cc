@@ -0,0 +1,188 @@
+#include <limits.h>
+
+#include "libjpeg.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// Compresses frames of one fixed geometry. Everything that compressSync()
+// works out per call is done once here, and the handle and worst case output
+// buffer are kept for the lifetime of the object.
+class Encoder : public ObjectWrap {
+  public:
+    static NAN_METHOD(Construct) {
+      int retval = 0;
+      char errStr[NJT_MSG_LENGTH_MAX];
+
+      Encoder* obj = NULL;
+      Local<Object> options;
+      njt_compress_options opts;
+      J_COLOR_SPACE colorSpace;
+      int bpp = 0;
+      uint64_t srcLength;
+      unsigned long dstLength;
+      unsigned char* dstData = NULL;
+      tjhandle handle = NULL;
+
+      if (!info.IsConstructCall()) {
+        _throw("Constructor must be called with new");
+      }
+
+      options = info[0].As<Object>();
+      if (compressParseOptions(options, &opts, errStr) != 0) {
+        retval = -1;
+        goto bailout;
+      }
+
+      if (njtColorSpace(opts.format, &colorSpace, &bpp) != 0) {
+        _throw("Invalid input format");
+      }
+
+      switch (opts.jpegSubsamp) {
+        case SAMP_444:
+        case SAMP_422:
+        case SAMP_420:
+        case SAMP_GRAY:
+        case SAMP_440:
+          break;
+        default:
+          _throw("Invalid subsampling method");
+      }
+
+      if (opts.width == 0 || opts.height == 0) {
+        _throw("Invalid image size");
+      }
+
+      if (opts.stride < opts.width) {
+        _throw("Stride must be at least as large as width");
+      }
+
+      // Every frame must fit in a single Buffer
+      srcLength = ((uint64_t) opts.stride * (opts.height - 1) + opts.width) * bpp;
+      if (srcLength > UINT32_MAX) {
+        _throw("Image too large");
+      }
+
+      // Anything that needs libjpeg would defeat the purpose
+      if (opts.progressive || opts.optimize || opts.restartInterval > 0 || opts.restartRows > 0 || opts.targetSize > 0) {
+        _throw("Encoder only supports baseline output");
+      }
+
+      handle = tjInitCompress();
+      if (handle == NULL) {
+        _throw(njtGetErrorStr(handle));
+      }
+
+      dstLength = tjBufSize(opts.width, opts.height, opts.jpegSubsamp);
+      if (dstLength == (unsigned long) -1 || dstLength > INT_MAX) {
+        _throw("Image too large");
+      }
+      dstData = tjAlloc(dstLength);
+      if (dstData == NULL) {
+        _throw("Unable to allocate output buffer");
+      }
+
+      obj = new Encoder(&opts, bpp, (uint32_t) srcLength, handle, dstData, dstLength);
+      handle = NULL;
+      dstData = NULL;
+      obj->Wrap(info.This());
+      info.GetReturnValue().Set(info.This());
+
+      bailout:
+      if (handle != NULL) {
+        tjDestroy(handle);
+      }
+      if (dstData != NULL) {
+        tjFree(dstData);
+      }
+
+      if (retval != 0) {
+        ThrowError(TypeError(errStr));
+        return;
+      }
+    }
+
+    // Returns the output buffer and the size of the image in it. The buffer
+    // is reused by the next call.
+    static NAN_METHOD(Encode) {
+      int retval = 0;
+      char errStr[NJT_MSG_LENGTH_MAX];
+
+      Encoder* obj = ObjectWrap::Unwrap<Encoder>(info.This());
+      Local<Object> srcObject;
+      Local<Object> result;
+      unsigned long jpegSize = obj->dstLength;
+      int err;
+
+      if (info.Length() < 1) {
+        _throw("Too few arguments");
+      }
+
+      srcObject = info[0].As<Object>();
+      if (!Buffer::HasInstance(srcObject)) {
+        _throw("Invalid raw buffer");
+      }
+
+      if (Buffer::Length(srcObject) < obj->srcLength) {
+        _throw("Insufficient raw buffer");
+      }
+
+      err = tjCompress2(obj->handle, (unsigned char*) Buffer::Data(srcObject), obj->options.width, obj->options.stride * obj->bpp, obj->options.height, obj->options.format, &obj->dstData, &jpegSize, obj->options.jpegSubsamp, obj->options.quality, obj->flags);
+
+      if (err != 0) {
+        _throw(njtGetErrorStr(obj->handle));
+      }
+
+      result = New<Object>();
+      result->Set(New("data").ToLocalChecked(), New(obj->dstObject));
+      result->Set(New("size").ToLocalChecked(), New((uint32_t) jpegSize));
+      info.GetReturnValue().Set(result);
+
+      bailout:
+      if (retval != 0) {
+        ThrowError(TypeError(errStr));
+        return;
+      }
+    }
+
+  private:
+    explicit Encoder(njt_compress_options* options, int bpp, uint32_t srcLength, tjhandle handle, unsigned char* dstData, unsigned long dstLength) :
+      options(*options),
+      bpp(bpp),
+      srcLength(srcLength),
+      handle(handle),
+      dstData(dstData),
+      dstLength(dstLength) {
+        this->flags = TJFLAG_NOREALLOC | (options->accurateDct ? TJFLAG_ACCURATEDCT : TJFLAG_FASTDCT);
+
+        // The Buffer owns the memory, so slices of it stay valid even if
+        // they outlive us
+        this->dstObject.Reset(NewBuffer((char*) dstData, dstLength, compressBufferFreeCallback, NULL).ToLocalChecked());
+      }
+
+    ~Encoder() {
+      tjDestroy(this->handle);
+      this->dstObject.Reset();
+    }
+
+    njt_compress_options options;
+    int bpp;
+    int flags;
+    uint32_t srcLength;
+    tjhandle handle;
+    unsigned char* dstData;
+    unsigned long dstLength;
+    Nan::Persistent<Object> dstObject;
+};
+
+NAN_MODULE_INIT(InitEncoder) {
+  Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(Encoder::Construct);
+  tpl->SetClassName(Nan::New("Encoder").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+  SetPrototypeMethod(tpl, "encode", Encoder::Encode);
+
+  Nan::Set(target, Nan::New("Encoder").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+}
@@ -11,6 +11,60 @@ NAN_MODULE_INIT(InitAll) {
     Nan::GetFunction(Nan::New<v8::FunctionTemplate>(DecompressSync)).ToLocalChecked());
   Nan::Set(target, Nan::New("decompress").ToLocalChecked(),
     Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Decompress)).ToLocalChecked());
+  Nan::Set(target, Nan::New("compressToFileSync").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(CompressToFileSync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("compressToFile").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(CompressToFile)).ToLocalChecked());
+  Nan::Set(target, Nan::New("decompressFileSync").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(DecompressFileSync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("decompressFile").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(DecompressFile)).ToLocalChecked());
+  Nan::Set(target, Nan::New("inspectSync").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(InspectSync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("inspect").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Inspect)).ToLocalChecked());
+  Nan::Set(target, Nan::New("compressYUVSync").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(CompressYUVSync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("compressYUV").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(CompressYUV)).ToLocalChecked());
+  Nan::Set(target, Nan::New("decompressYUVSync").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(DecompressYUVSync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("decompressYUV").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(DecompressYUV)).ToLocalChecked());
+  Nan::Set(target, Nan::New("transformSync").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(TransformSync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("transform").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Transform)).ToLocalChecked());
+  Nan::Set(target, Nan::New("recompressSync").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(RecompressSync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("recompress").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Recompress)).ToLocalChecked());
+  Nan::Set(target, Nan::New("thumbnailSync").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(ThumbnailSync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("thumbnail").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Thumbnail)).ToLocalChecked());
+  Nan::Set(target, Nan::New("compressBatch").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(CompressBatch)).ToLocalChecked());
+  Nan::Set(target, Nan::New("decompressBatch").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(DecompressBatch)).ToLocalChecked());
+  Nan::Set(target, Nan::New("handleCacheStats").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HandleCacheStats)).ToLocalChecked());
+  Nan::Set(target, Nan::New("purgeHandleCache").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(PurgeHandleCache)).ToLocalChecked());
+  Nan::Set(target, Nan::New("setHandleCacheLimit").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(SetHandleCacheLimit)).ToLocalChecked());
+  Nan::Set(target, Nan::New("configurePool").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(ConfigurePool)).ToLocalChecked());
+  Nan::Set(target, Nan::New("cancelQueued").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(CancelQueued)).ToLocalChecked());
+  Nan::Set(target, Nan::New("poolStats").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(PoolStats)).ToLocalChecked());
+  Nan::Set(target, Nan::New("scratchStats").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(ScratchStats)).ToLocalChecked());
+  Nan::Set(target, Nan::New("stats").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Stats)).ToLocalChecked());
+  Nan::Set(target, Nan::New("enableStats").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(EnableStats)).ToLocalChecked());
   Nan::Set(target, Nan::New("FORMAT_RGB").ToLocalChecked(), Nan::New(FORMAT_RGB));
   Nan::Set(target, Nan::New("FORMAT_BGR").ToLocalChecked(), Nan::New(FORMAT_BGR));
   Nan::Set(target, Nan::New("FORMAT_RGBX").ToLocalChecked(), Nan::New(FORMAT_RGBX));
@@ -27,6 +81,27 @@ NAN_MODULE_INIT(InitAll) {
   Nan::Set(target, Nan::New("SAMP_420").ToLocalChecked(), Nan::New(SAMP_420));
   Nan::Set(target, Nan::New("SAMP_GRAY").ToLocalChecked(), Nan::New(SAMP_GRAY));
   Nan::Set(target, Nan::New("SAMP_440").ToLocalChecked(), Nan::New(SAMP_440));
+  Nan::Set(target, Nan::New("COLORSPACE_RGB").ToLocalChecked(), Nan::New(COLORSPACE_RGB));
+  Nan::Set(target, Nan::New("COLORSPACE_YCbCr").ToLocalChecked(), Nan::New(COLORSPACE_YCbCr));
+  Nan::Set(target, Nan::New("COLORSPACE_GRAY").ToLocalChecked(), Nan::New(COLORSPACE_GRAY));
+  Nan::Set(target, Nan::New("COLORSPACE_CMYK").ToLocalChecked(), Nan::New(COLORSPACE_CMYK));
+  Nan::Set(target, Nan::New("COLORSPACE_YCCK").ToLocalChecked(), Nan::New(COLORSPACE_YCCK));
+  Nan::Set(target, Nan::New("TRANSFORM_NONE").ToLocalChecked(), Nan::New(TRANSFORM_NONE));
+  Nan::Set(target, Nan::New("TRANSFORM_HFLIP").ToLocalChecked(), Nan::New(TRANSFORM_HFLIP));
+  Nan::Set(target, Nan::New("TRANSFORM_VFLIP").ToLocalChecked(), Nan::New(TRANSFORM_VFLIP));
+  Nan::Set(target, Nan::New("TRANSFORM_TRANSPOSE").ToLocalChecked(), Nan::New(TRANSFORM_TRANSPOSE));
+  Nan::Set(target, Nan::New("TRANSFORM_TRANSVERSE").ToLocalChecked(), Nan::New(TRANSFORM_TRANSVERSE));
+  Nan::Set(target, Nan::New("TRANSFORM_ROT90").ToLocalChecked(), Nan::New(TRANSFORM_ROT90));
+  Nan::Set(target, Nan::New("TRANSFORM_ROT180").ToLocalChecked(), Nan::New(TRANSFORM_ROT180));
+  Nan::Set(target, Nan::New("TRANSFORM_ROT270").ToLocalChecked(), Nan::New(TRANSFORM_ROT270));
+  Nan::Set(target, Nan::New("PRIORITY_INTERACTIVE").ToLocalChecked(), Nan::New(PRIORITY_INTERACTIVE));
+  Nan::Set(target, Nan::New("PRIORITY_BULK").ToLocalChecked(), Nan::New(PRIORITY_BULK));
+
+  InitBufferArena(target);
+  InitCompressStream(target);
+  InitDecompressStream(target);
+  InitEncoder(target);
+  InitDecoder(target);
 }
 
 // There is no semi-colon after NODE_MODULE as it's not a function (see node.h).
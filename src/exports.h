@@ -11,8 +11,46 @@
 #define TJFLAG_FASTDCT 0
 #endif
 
+// libjpeg-turbo 2.0 keeps the last error message in the handle. Older
+// versions (including the bundled 1.4) only have the process-wide
+// tjGetErrorStr(), which any other failing call may overwrite before we get
+// to read it. There, compress() and decompress() drive libjpeg directly,
+// which reports errors per call. Other TurboJPEG calls copy the shared
+// message right away, see handles.cc.
+#ifdef TJFLAG_STOPONWARNING
+#define njtGetErrorStr(handle) tjGetErrorStr2(handle)
+#define NJT_SHARED_ERRORS 0
+#else
+#define njtGetErrorStr(handle) njtCopyErrorStr()
+#define NJT_SHARED_ERRORS 1
+const char* njtCopyErrorStr();
+#endif
+
 #define NJT_MSG_LENGTH_MAX 200
 
+// Maximum number of idle tjhandles kept around across all threads.
+#define NJT_DEFAULT_HANDLE_CACHE_LIMIT 64
+
+// Maximum number of jobs waiting in the native pool, across all lanes.
+#define NJT_DEFAULT_POOL_QUEUE_SIZE 1024
+#define NJT_PRIORITY_LANES 2
+
+// Maximum number of idle scratch buffers kept for tight compression, and
+// the extra space reserved for headers.
+#define NJT_SCRATCH_POOL_LIMIT 16
+#define NJT_SCRATCH_SLACK 4096
+
+// Largest decoded or resized image a thread keeps around for its next
+// thumbnail.
+#define NJT_THUMBNAIL_SCRATCH_LIMIT (16 * 1024 * 1024)
+
+// Number of latency histogram buckets. Each covers twice the time of the
+// previous one, starting from a microsecond.
+#define NJT_STATS_BUCKETS 28
+
+// Maximum number of bytes a BufferArena keeps around for reuse.
+#define NJT_DEFAULT_ARENA_MAX_BYTES (64 * 1024 * 1024)
+
 static int NJT_DEFAULT_QUALITY = 80;
 static int NJT_DEFAULT_SUBSAMPLING = TJSAMP_420;
 static int NJT_DEFAULT_FORMAT = TJPF_RGBA;
@@ -39,10 +77,203 @@ enum {
   SAMP_440  = TJSAMP_440,
 };
 
+// Recycles output buffers, see arena.cc
+typedef struct njt_arena njt_arena;
+
+typedef struct {
+  uint32_t format;
+  uint32_t width;
+  uint32_t stride;
+  uint32_t height;
+  uint32_t jpegSubsamp;
+  // Set to the quality actually used when targetSize is given
+  int quality;
+  uint32_t targetSize;
+  bool tight;
+  bool accurateDct;
+  bool optimize;
+  bool progressive;
+  uint32_t restartInterval;
+  uint32_t restartRows;
+  uint32_t threads;
+  uint32_t priority;
+  volatile int32_t* cancelled;
+  njt_arena* arena;
+} njt_compress_options;
+
+typedef struct {
+  uint32_t format;
+  uint32_t stride;
+  double scale;
+  uint32_t maxWidth;
+  uint32_t maxHeight;
+  bool accurateDct;
+  bool fastUpsample;
+  uint32_t threads;
+  uint32_t priority;
+  bool region;
+  uint32_t regionX;
+  uint32_t regionY;
+  uint32_t regionWidth;
+  uint32_t regionHeight;
+  volatile int32_t* cancelled;
+  njt_arena* arena;
+} njt_decompress_options;
+
+enum {
+  COLORSPACE_RGB   = TJCS_RGB,
+  COLORSPACE_YCbCr = TJCS_YCbCr,
+  COLORSPACE_GRAY  = TJCS_GRAY,
+  COLORSPACE_CMYK  = TJCS_CMYK,
+  COLORSPACE_YCCK  = TJCS_YCCK,
+};
+
+enum {
+  TRANSFORM_NONE       = TJXOP_NONE,
+  TRANSFORM_HFLIP      = TJXOP_HFLIP,
+  TRANSFORM_VFLIP      = TJXOP_VFLIP,
+  TRANSFORM_TRANSPOSE  = TJXOP_TRANSPOSE,
+  TRANSFORM_TRANSVERSE = TJXOP_TRANSVERSE,
+  TRANSFORM_ROT90      = TJXOP_ROT90,
+  TRANSFORM_ROT180     = TJXOP_ROT180,
+  TRANSFORM_ROT270     = TJXOP_ROT270,
+};
+
+enum {
+  PRIORITY_INTERACTIVE = 0,
+  PRIORITY_BULK        = 1,
+};
+
+enum {
+  NJT_HANDLE_COMPRESS = 0,
+  NJT_HANDLE_DECOMPRESS,
+  NJT_HANDLE_TRANSFORM,
+  NJT_HANDLE_KINDS
+};
+
+// Per-thread tjhandle cache, see handles.cc
+tjhandle njtAcquireHandle(int kind);
+void njtReleaseHandle(int kind, tjhandle handle);
+void njtPurgeHandleCache();
+void njtReleaseThreadHandles();
+
+// Fork-join helper for spreading work over several threads, see parallel.cc
+uint32_t njtCpuCount();
+void njtParallelFor(uint32_t count, uint32_t threads, uint32_t priority, void (*fn)(uint32_t index, void* data), void* data);
+
+// Optional native thread pool, see pool.cc
+int njtParsePriority(v8::Local<v8::Object> options, uint32_t* priority, char* errStr);
+int njtParseCancelToken(v8::Local<v8::Object> options, v8::Local<v8::Object>* tokenObject, volatile int32_t** cancelled, char* errStr);
+bool njtPoolFull();
+void njtQueueWorker(Nan::AsyncWorker* worker, uint32_t priority, volatile int32_t* cancelled);
+
+// Parallel coding of restart intervals, see restart.cc
+int njtDecompressRestartBands(unsigned char* srcData, uint32_t srcLength, uint32_t threads, uint32_t priority, tjscalingfactor factor, int format, int flags, volatile int32_t* cancelled, unsigned char* dstData, uint32_t pitch, bool* handled, char* errStr);
+void njtRestartSubimage(unsigned char* srcData, uint32_t srcLength, uint32_t y, unsigned char** subData, unsigned long* subLength, uint32_t* subY);
+int njtCompressRestartBands(unsigned char* srcData, njt_compress_options* options, unsigned char** dstData, unsigned long* jpegSize, bool fixed, bool* handled, char* errStr);
+
+// Opt-in instrumentation, see stats.cc
+enum {
+  NJT_OP_COMPRESS = 0,
+  NJT_OP_DECOMPRESS,
+  NJT_OPS
+};
+
+enum {
+  NJT_STAGE_QUEUE = 0,
+  NJT_STAGE_HEADER,
+  NJT_STAGE_CODEC,
+  NJT_STAGE_BUFFER,
+  NJT_STAGE_CALLBACK,
+  NJT_STAGE_TOTAL,
+  NJT_STAGES
+};
+
+enum {
+  NJT_ERROR_ABORTED = 0,
+  NJT_ERROR_HEADER,
+  NJT_ERROR_CODEC,
+  NJT_ERROR_OTHER,
+  NJT_ERRORS
+};
+
+uint64_t njtStatsNow();
+void njtStatsStage(int op, int stage, uint64_t startedAt);
+void njtStatsCall(int op, uint64_t bytesIn, uint64_t bytesOut, uint64_t pixels);
+void njtStatsError(int op, int kind);
+
+// Buffer arena, see arena.cc
+int njtParseArena(v8::Local<v8::Object> options, v8::Local<v8::Object>* arenaObject, njt_arena** arena, char* errStr);
+unsigned char* njtArenaAlloc(njt_arena* arena, size_t size);
+void njtArenaFreeCallback(char* data, void* hint);
+
+// Pooled scratch buffers for tight compression, see scratch.cc
+typedef struct njt_scratch {
+  unsigned char* data;
+  unsigned long size;
+  struct njt_scratch* next;
+} njt_scratch;
+
+njt_scratch* njtAcquireScratch(uint32_t width, uint32_t height, uint32_t jpegSubsamp);
+void njtReleaseScratch(njt_scratch* scratch, unsigned char* data, unsigned long jpegSize, uint32_t width, uint32_t height);
+
+// Memory taken over from JS for the duration of a job, see transfer.cc
+typedef struct {
+  unsigned char* data;
+  size_t length;
+} njt_transfer;
+
+int njtParseTransfer(v8::Local<v8::Object> options, bool* transfer, char* errStr);
+bool njtCanTransfer(v8::Local<v8::Object> object);
+void njtTransferBuffer(v8::Local<v8::Object> object, njt_transfer* transfer);
+v8::Local<v8::Object> njtReturnTransfer(njt_transfer* transfer);
+void njtFreeTransfer(njt_transfer* transfer);
+
+// Shared with other entry points, see compress.cc and decompress.cc
+void compressBufferFreeCallback(char *data, void *hint);
+int compress(unsigned char* srcData, njt_compress_options* options, unsigned long* jpegSize, unsigned char** dstData, uint32_t dstBufferLength, char* errStr);
+int compressParseOptions(v8::Local<v8::Object> options, njt_compress_options* opts, char* errStr);
+void decompressBufferFreeCallback(char *data, void *hint);
+int decompress(unsigned char* srcData, uint32_t srcLength, njt_decompress_options* options, int* width, int* height, uint32_t* dstLength, unsigned char** dstData, uint32_t dstBufferLength, char* errStr);
+int selectScalingFactor(int width, int height, double scale, uint32_t maxWidth, uint32_t maxHeight, tjscalingfactor* factor, char* errStr);
+int decompressParseOptions(v8::Local<v8::Object> options, njt_decompress_options* opts, char* errStr);
+
 NAN_METHOD(BufferSize);
 NAN_METHOD(CompressSync);
 NAN_METHOD(Compress);
 NAN_METHOD(DecompressSync);
 NAN_METHOD(Decompress);
+NAN_METHOD(CompressToFileSync);
+NAN_METHOD(CompressToFile);
+NAN_METHOD(DecompressFileSync);
+NAN_METHOD(DecompressFile);
+NAN_METHOD(InspectSync);
+NAN_METHOD(Inspect);
+NAN_METHOD(CompressYUVSync);
+NAN_METHOD(CompressYUV);
+NAN_METHOD(DecompressYUVSync);
+NAN_METHOD(DecompressYUV);
+NAN_METHOD(TransformSync);
+NAN_METHOD(Transform);
+NAN_METHOD(RecompressSync);
+NAN_METHOD(Recompress);
+NAN_METHOD(ThumbnailSync);
+NAN_METHOD(Thumbnail);
+NAN_METHOD(CompressBatch);
+NAN_METHOD(DecompressBatch);
+NAN_METHOD(HandleCacheStats);
+NAN_METHOD(PurgeHandleCache);
+NAN_METHOD(SetHandleCacheLimit);
+NAN_METHOD(ConfigurePool);
+NAN_METHOD(CancelQueued);
+NAN_METHOD(PoolStats);
+NAN_METHOD(ScratchStats);
+NAN_METHOD(Stats);
+NAN_METHOD(EnableStats);
+NAN_MODULE_INIT(InitBufferArena);
+NAN_MODULE_INIT(InitCompressStream);
+NAN_MODULE_INIT(InitDecompressStream);
+NAN_MODULE_INIT(InitEncoder);
+NAN_MODULE_INIT(InitDecoder);
 
 #endif
@@ -0,0 +1,854 @@
+#include <errno.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "exports.h"
+#include "libjpeg.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// A read-only view of a whole file. Only the pages libjpeg actually touches
+// are read in, straight from the page cache, and none of it ever passes
+// through the JS heap.
+typedef struct {
+  unsigned char* data;
+  uint32_t length;
+} njt_mapping;
+
+// Adds the reason for the last failed system call to message.
+static void fileError(const char* message, char* errStr) {
+#ifdef _WIN32
+  snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s (error %lu)", message, (unsigned long) GetLastError());
+#else
+  snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s: %s", message, uv_strerror(-errno));
+#endif
+}
+
+#ifdef _WIN32
+// Paths come in as UTF-8, which the ANSI APIs don't understand.
+static wchar_t* widePath(const char* path) {
+  wchar_t* wide;
+  int length;
+
+  length = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+  if (length == 0) {
+    return NULL;
+  }
+
+  wide = (wchar_t*) malloc(length * sizeof(wchar_t));
+  if (wide != NULL) {
+    MultiByteToWideChar(CP_UTF8, 0, path, -1, wide, length);
+  }
+
+  return wide;
+}
+#endif
+
+static int mapFile(const char* path, njt_mapping* mapping, char* errStr) {
+  int retval = 0;
+#ifdef _WIN32
+  wchar_t* wide = NULL;
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE view = NULL;
+  LARGE_INTEGER size;
+#else
+  int fd = -1;
+  struct stat st;
+  void* data;
+#endif
+
+  mapping->data = NULL;
+  mapping->length = 0;
+
+#ifdef _WIN32
+  wide = widePath(path);
+  if (wide == NULL) {
+    _throw("Invalid path");
+  }
+
+  file = CreateFileW(wide, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    fileError("Unable to open file", errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  if (!GetFileSizeEx(file, &size)) {
+    fileError("Unable to read file", errStr);
+    retval = -1;
+    goto bailout;
+  }
+  if (size.QuadPart == 0) {
+    _throw("Empty file");
+  }
+  if (size.QuadPart > UINT32_MAX) {
+    _throw("File too large");
+  }
+
+  view = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (view == NULL) {
+    fileError("Unable to map file", errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  // The view stays valid after both handles are closed
+  mapping->data = (unsigned char*) MapViewOfFile(view, FILE_MAP_READ, 0, 0, 0);
+  if (mapping->data == NULL) {
+    fileError("Unable to map file", errStr);
+    retval = -1;
+    goto bailout;
+  }
+  mapping->length = (uint32_t) size.QuadPart;
+
+  bailout:
+  if (view != NULL) {
+    CloseHandle(view);
+  }
+  if (file != INVALID_HANDLE_VALUE) {
+    CloseHandle(file);
+  }
+  free(wide);
+#else
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fileError("Unable to open file", errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  if (fstat(fd, &st) != 0) {
+    fileError("Unable to read file", errStr);
+    retval = -1;
+    goto bailout;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    _throw("Not a regular file");
+  }
+  if (st.st_size == 0) {
+    _throw("Empty file");
+  }
+  if ((uint64_t) st.st_size > UINT32_MAX) {
+    _throw("File too large");
+  }
+
+  // The mapping stays valid after the descriptor is closed
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    fileError("Unable to map file", errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  // libjpeg reads front to back, so have the kernel read ahead
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  mapping->data = (unsigned char*) data;
+  mapping->length = (uint32_t) st.st_size;
+
+  bailout:
+  if (fd >= 0) {
+    close(fd);
+  }
+#endif
+
+  return retval;
+}
+
+static void unmapFile(njt_mapping* mapping) {
+  if (mapping->data == NULL) {
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(mapping->data);
+#else
+  munmap(mapping->data, mapping->length);
+#endif
+  mapping->data = NULL;
+}
+
+static FILE* createFile(const char* path) {
+#ifdef _WIN32
+  wchar_t* wide = widePath(path);
+  FILE* file = NULL;
+
+  if (wide != NULL) {
+    file = _wfopen(wide, L"wb");
+    free(wide);
+  }
+
+  return file;
+#else
+  return fopen(path, "wb");
+#endif
+}
+
+static void removeFile(const char* path) {
+#ifdef _WIN32
+  wchar_t* wide = widePath(path);
+
+  if (wide != NULL) {
+    _wremove(wide);
+    free(wide);
+  }
+#else
+  remove(path);
+#endif
+}
+
+// Devices and pipes (e.g. /dev/stdout) can't be replaced by another file,
+// so those are written to directly.
+static bool isSpecialFile(const char* path) {
+#ifdef _WIN32
+  wchar_t* wide = widePath(path);
+  HANDLE file = INVALID_HANDLE_VALUE;
+  bool special = false;
+
+  if (wide != NULL) {
+    file = CreateFileW(wide, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    free(wide);
+  }
+  if (file != INVALID_HANDLE_VALUE) {
+    special = GetFileType(file) != FILE_TYPE_DISK;
+    CloseHandle(file);
+  }
+
+  return special;
+#else
+  struct stat st;
+
+  return stat(path, &st) == 0 && !S_ISREG(st.st_mode);
+#endif
+}
+
+// The file that will actually be replaced. A symbolic link is followed, so
+// that the link itself stays in place.
+static char* targetPath(const char* path) {
+#ifndef _WIN32
+  char* resolved = realpath(path, NULL);
+
+  if (resolved != NULL) {
+    return resolved;
+  }
+#endif
+  return strdup(path);
+}
+
+// Creates a new file next to path, to be moved over it once it's complete.
+// An existing file keeps its permissions. Returns the name of the new file
+// in tempPath, which the caller must free.
+static FILE* createTempFile(const char* path, char** tempPath) {
+  size_t length = strlen(path) + 32;
+  char* temp;
+  FILE* file = NULL;
+  int attempt;
+  int fd;
+#ifdef _WIN32
+  wchar_t* wide;
+  HANDLE handle;
+#else
+  struct stat st;
+  bool existing;
+#endif
+
+  *tempPath = NULL;
+
+  temp = (char*) malloc(length);
+  if (temp == NULL) {
+    return NULL;
+  }
+
+#ifndef _WIN32
+  existing = stat(path, &st) == 0;
+#endif
+
+  // Another thread or process may pick the same name, so only ever create
+  // a new file and try again with another name if it exists.
+  for (attempt = 0; attempt < 16 && file == NULL; attempt++) {
+    snprintf(temp, length, "%s.%llx.tmp", path, (unsigned long long) uv_hrtime() + attempt);
+
+#ifdef _WIN32
+    wide = widePath(temp);
+    if (wide == NULL) {
+      break;
+    }
+    handle = CreateFileW(wide, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    free(wide);
+    if (handle == INVALID_HANDLE_VALUE) {
+      if (GetLastError() == ERROR_FILE_EXISTS) {
+        continue;
+      }
+      break;
+    }
+
+    fd = _open_osfhandle((intptr_t) handle, _O_WRONLY | _O_BINARY);
+    if (fd == -1) {
+      CloseHandle(handle);
+      removeFile(temp);
+      break;
+    }
+    file = _fdopen(fd, "wb");
+    if (file == NULL) {
+      _close(fd);
+      removeFile(temp);
+      break;
+    }
+#else
+    fd = open(temp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd == -1) {
+      if (errno == EEXIST) {
+        continue;
+      }
+      break;
+    }
+
+    if (existing) {
+      fchmod(fd, st.st_mode & 07777);
+    }
+    file = fdopen(fd, "wb");
+    if (file == NULL) {
+      close(fd);
+      removeFile(temp);
+      break;
+    }
+#endif
+  }
+
+  if (file == NULL) {
+    free(temp);
+    return NULL;
+  }
+
+  *tempPath = temp;
+  return file;
+}
+
+// Moves the complete file at from over to, in one go.
+static int replaceFile(const char* from, const char* to) {
+#ifdef _WIN32
+  wchar_t* wideFrom = widePath(from);
+  wchar_t* wideTo = widePath(to);
+  int retval = -1;
+
+  if (wideFrom != NULL && wideTo != NULL && MoveFileExW(wideFrom, wideTo, MOVEFILE_REPLACE_EXISTING)) {
+    retval = 0;
+  }
+  free(wideFrom);
+  free(wideTo);
+
+  return retval;
+#else
+  return rename(from, to);
+#endif
+}
+
+// Copies a path argument for use off the main thread. Returns NULL if it
+// isn't a non-empty string, or has a NUL in it.
+static char* pathArgument(Local<Value> value) {
+  if (!value->IsString() || value.As<String>()->Length() == 0) {
+    return NULL;
+  }
+
+  Utf8String path(value);
+  if (strlen(*path) != (size_t) path.length()) {
+    return NULL;
+  }
+
+  return strdup(*path);
+}
+
+int decompressFile(const char* path, njt_decompress_options* options, int* width, int* height, uint32_t* dstLength, unsigned char** dstData, uint32_t dstBufferLength, char* errStr) {
+  int retval = 0;
+  njt_mapping mapping;
+
+  if (options->cancelled != NULL && *options->cancelled) {
+    _throw("Aborted");
+  }
+
+  if (mapFile(path, &mapping, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  retval = decompress(mapping.data, mapping.length, options, width, height, dstLength, dstData, dstBufferLength, errStr);
+
+  unmapFile(&mapping);
+
+  bailout:
+  return retval;
+}
+
+// Streams the JPG into a file at path, replacing whatever was there. The
+// JPG is written to a new file in the same directory first, which is only
+// moved over path once it's complete, so that an existing file is never
+// lost when anything fails.
+int compressFile(unsigned char* srcData, njt_compress_options* options, const char* path, unsigned long* jpegSize, char* errStr) {
+  int retval = 0;
+  FILE* file = NULL;
+  char* target = NULL;
+  char* tempPath = NULL;
+  long size;
+
+  if (options->cancelled != NULL && *options->cancelled) {
+    _throw("Aborted");
+  }
+
+  if (isSpecialFile(path)) {
+    file = createFile(path);
+  }
+  else {
+    target = targetPath(path);
+    if (target == NULL) {
+      _throw("Out of memory");
+    }
+    file = createTempFile(target, &tempPath);
+  }
+  if (file == NULL) {
+    fileError("Unable to create file", errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  if (njtCompressFile(srcData, options, file, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  size = ftell(file);
+  if (size < 0) {
+    fileError("Unable to write file", errStr);
+    retval = -1;
+    goto bailout;
+  }
+  *jpegSize = (unsigned long) size;
+
+  // Buffered data may still fail to make it to the disk
+  if (fclose(file) != 0) {
+    file = NULL;
+    fileError("Unable to write file", errStr);
+    retval = -1;
+    goto bailout;
+  }
+  file = NULL;
+
+  if (tempPath != NULL && replaceFile(tempPath, target) != 0) {
+    fileError("Unable to replace file", errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  bailout:
+  if (file != NULL) {
+    fclose(file);
+  }
+  if (tempPath != NULL) {
+    if (retval != 0) {
+      removeFile(tempPath);
+    }
+    free(tempPath);
+  }
+  free(target);
+
+  return retval;
+}
+
+class DecompressFileWorker : public AsyncWorker {
+  public:
+    DecompressFileWorker(Callback *callback, char* path, njt_decompress_options* options, Local<Object> &dstObject, unsigned char* dstData, uint32_t dstBufferLength, Local<Object> &tokenObject, Local<Object> &arenaObject) :
+      AsyncWorker(callback),
+      path(path),
+      options(*options),
+      dstData(dstData),
+      dstBufferLength(dstBufferLength),
+      width(0),
+      height(0),
+      dstLength(0) {
+        if (dstBufferLength > 0) {
+          SaveToPersistent("dstObject", dstObject);
+        }
+        if (options->cancelled != NULL) {
+          SaveToPersistent("tokenObject", tokenObject);
+        }
+        if (options->arena != NULL) {
+          SaveToPersistent("arenaObject", arenaObject);
+        }
+      }
+
+    ~DecompressFileWorker() {
+      free(this->path);
+    }
+
+    void Execute () {
+      int err;
+
+      err = decompressFile(
+          this->path,
+          &this->options,
+          &this->width,
+          &this->height,
+          &this->dstLength,
+          &this->dstData,
+          this->dstBufferLength,
+          this->errStr);
+
+      if(err != 0) {
+        SetErrorMessage(this->errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      Local<Object> obj = New<Object>();
+      Local<Object> dstObject;
+
+      if (this->dstBufferLength > 0) {
+        dstObject = GetFromPersistent("dstObject").As<Object>();
+      }
+      else {
+        dstObject = NewBuffer((char*)this->dstData, this->dstLength, this->options.arena != NULL ? njtArenaFreeCallback : decompressBufferFreeCallback, NULL).ToLocalChecked();
+      }
+
+      obj->Set(New("data").ToLocalChecked(), dstObject);
+      obj->Set(New("width").ToLocalChecked(), New(this->width));
+      obj->Set(New("height").ToLocalChecked(), New(this->height));
+      obj->Set(New("size").ToLocalChecked(), New(this->dstLength));
+      obj->Set(New("format").ToLocalChecked(), New(this->options.format));
+
+      Local<Value> argv[] = {
+        Null(),
+        obj
+      };
+
+      callback->Call(2, argv);
+    }
+
+  private:
+    char* path;
+    njt_decompress_options options;
+
+    unsigned char* dstData;
+    uint32_t dstBufferLength;
+    int width;
+    int height;
+    uint32_t dstLength;
+    char errStr[NJT_MSG_LENGTH_MAX];
+};
+
+void decompressFileParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+  int retval = 0;
+  int cursor = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+
+  // Input
+  Callback *callback = NULL;
+  char* path = NULL;
+  Local<Object> options;
+  njt_decompress_options opts;
+  Local<Object> tokenObject;
+  Local<Object> arenaObject;
+
+  // Output
+  Local<Object> dstObject;
+  uint32_t dstBufferLength = 0;
+  unsigned char* dstData = NULL;
+  int width;
+  int height;
+  uint32_t dstLength;
+
+  // Try to find callback here, so if we want to throw something we can use callback's err
+  if (async) {
+    if (info[info.Length() - 1]->IsFunction()) {
+      callback = new Callback(info[info.Length() - 1].As<Function>());
+    }
+    else {
+      _throw("Missing callback");
+    }
+  }
+
+  if ((async && info.Length() < 2) || (!async && info.Length() < 1)) {
+    _throw("Too few arguments");
+  }
+
+  // Input file
+  path = pathArgument(info[cursor++]);
+  if (path == NULL) {
+    _throw("Invalid path");
+  }
+
+  // Options
+  options = info[cursor++].As<Object>();
+
+  // Check if options we just got is actually the destination buffer
+  // If it is, pull new object from info and set that as options
+  if (Buffer::HasInstance(options) && info.Length() > cursor) {
+    dstObject = options;
+    options = info[cursor++].As<Object>();
+    dstBufferLength = Buffer::Length(dstObject);
+    dstData = (unsigned char*) Buffer::Data(dstObject);
+
+    if (dstBufferLength == 0) {
+      _throw("Insufficient output buffer");
+    }
+  }
+
+  if (decompressParseOptions(options, &opts, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  if (options->IsObject()) {
+    if (njtParseCancelToken(options, &tokenObject, &opts.cancelled, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+    if (njtParseArena(options, &arenaObject, &opts.arena, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+  }
+
+  // Do either async or sync decompress, opening the file is part of the job
+  if (async) {
+    if (njtPoolFull()) {
+      _throw("Queue is full");
+    }
+    njtQueueWorker(new DecompressFileWorker(callback, path, &opts, dstObject, dstData, dstBufferLength, tokenObject, arenaObject), opts.priority, opts.cancelled);
+    return;
+  }
+  else {
+    retval = decompressFile(
+        path,
+        &opts,
+        &width,
+        &height,
+        &dstLength,
+        &dstData,
+        dstBufferLength,
+        errStr);
+
+    if(retval != 0) {
+      // decompressFile will set the errStr
+      goto bailout;
+    }
+
+    Local<Object> obj = New<Object>();
+
+    if (dstBufferLength == 0) {
+      dstObject = NewBuffer((char*)dstData, dstLength, opts.arena != NULL ? njtArenaFreeCallback : decompressBufferFreeCallback, NULL).ToLocalChecked();
+    }
+
+    obj->Set(New("data").ToLocalChecked(), dstObject);
+    obj->Set(New("width").ToLocalChecked(), New(width));
+    obj->Set(New("height").ToLocalChecked(), New(height));
+    obj->Set(New("size").ToLocalChecked(), New(dstLength));
+    obj->Set(New("format").ToLocalChecked(), New(opts.format));
+
+    info.GetReturnValue().Set(obj);
+  }
+
+  // If we have error throw error or call callback with error
+  bailout:
+  free(path);
+
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+class CompressFileWorker : public AsyncWorker {
+  public:
+    CompressFileWorker(Callback *callback, Local<Object> &srcObject, unsigned char* srcData, char* path, njt_compress_options* options, Local<Object> &tokenObject) :
+      AsyncWorker(callback),
+      srcData(srcData),
+      path(path),
+      options(*options),
+      jpegSize(0) {
+        SaveToPersistent("srcObject", srcObject);
+        if (options->cancelled != NULL) {
+          SaveToPersistent("tokenObject", tokenObject);
+        }
+      }
+
+    ~CompressFileWorker() {
+      free(this->path);
+    }
+
+    void Execute () {
+      int err;
+
+      err = compressFile(
+          this->srcData,
+          &this->options,
+          this->path,
+          &this->jpegSize,
+          this->errStr);
+
+      if(err != 0) {
+        SetErrorMessage(this->errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      Local<Object> obj = New<Object>();
+
+      obj->Set(New("size").ToLocalChecked(), New((uint32_t) this->jpegSize));
+
+      Local<Value> argv[] = {
+        Null(),
+        obj
+      };
+
+      callback->Call(2, argv);
+    }
+
+  private:
+    unsigned char* srcData;
+    char* path;
+    njt_compress_options options;
+
+    unsigned long jpegSize;
+    char errStr[NJT_MSG_LENGTH_MAX];
+};
+
+void compressFileParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+  int retval = 0;
+  int cursor = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+
+  // Input
+  Callback *callback = NULL;
+  Local<Object> srcObject;
+  unsigned char* srcData = NULL;
+  char* path = NULL;
+  Local<Object> options;
+  njt_compress_options opts;
+  Local<Object> tokenObject;
+
+  // Output
+  unsigned long jpegSize = 0;
+
+  // Try to find callback here, so if we want to throw something we can use callback's err
+  if (async) {
+    if (info[info.Length() - 1]->IsFunction()) {
+      callback = new Callback(info[info.Length() - 1].As<Function>());
+    }
+    else {
+      _throw("Missing callback");
+    }
+  }
+
+  if ((async && info.Length() < 4) || (!async && info.Length() < 3)) {
+    _throw("Too few arguments");
+  }
+
+  // Input buffer
+  srcObject = info[cursor++].As<Object>();
+  if (!Buffer::HasInstance(srcObject)) {
+    _throw("Invalid source buffer");
+  }
+  srcData = (unsigned char*) Buffer::Data(srcObject);
+
+  // Output file
+  path = pathArgument(info[cursor++]);
+  if (path == NULL) {
+    _throw("Invalid path");
+  }
+
+  // Options
+  options = info[cursor++].As<Object>();
+
+  if (compressParseOptions(options, &opts, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // The search needs the whole image in memory anyway
+  if (opts.targetSize > 0) {
+    _throw("targetSize is not supported when writing to a file");
+  }
+
+  if (njtParseCancelToken(options, &tokenObject, &opts.cancelled, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // Do either async or sync compress, creating the file is part of the job
+  if (async) {
+    if (njtPoolFull()) {
+      _throw("Queue is full");
+    }
+    njtQueueWorker(new CompressFileWorker(callback, srcObject, srcData, path, &opts, tokenObject), opts.priority, opts.cancelled);
+    return;
+  }
+  else {
+    retval = compressFile(
+        srcData,
+        &opts,
+        path,
+        &jpegSize,
+        errStr);
+
+    if(retval != 0) {
+      // compressFile will set the errStr
+      goto bailout;
+    }
+
+    Local<Object> obj = New<Object>();
+    obj->Set(New("size").ToLocalChecked(), New((uint32_t) jpegSize));
+    info.GetReturnValue().Set(obj);
+  }
+
+  // If we have error throw error or call callback with error
+  bailout:
+  free(path);
+
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+NAN_METHOD(DecompressFileSync) {
+  decompressFileParse(info, false);
+}
+
+NAN_METHOD(DecompressFile) {
+  decompressFileParse(info, true);
+}
+
+NAN_METHOD(CompressToFileSync) {
+  compressFileParse(info, false);
+}
+
+NAN_METHOD(CompressToFile) {
+  compressFileParse(info, true);
+}
@@ -0,0 +1,239 @@
+#include "exports.h"
+using namespace Nan;
+using namespace v8;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// Every thread that releases a handle gets a slot holding at most one idle
+// handle per direction. Slots are also linked together so that the cache can
+// be purged from the main thread.
+typedef struct njt_handle_slot {
+  tjhandle handles[NJT_HANDLE_KINDS];
+  struct njt_handle_slot* next;
+} njt_handle_slot;
+
+static uv_once_t cacheOnce = UV_ONCE_INIT;
+static uv_key_t cacheKey;
+static uv_mutex_t cacheMutex;
+static njt_handle_slot* cacheSlots = NULL;
+static uint32_t cacheLimit = NJT_DEFAULT_HANDLE_CACHE_LIMIT;
+static uint32_t cacheSize = 0;
+static double cacheCreated = 0;
+static double cacheReused = 0;
+static double cacheDestroyed = 0;
+
+static void initHandleCache() {
+  uv_key_create(&cacheKey);
+  uv_mutex_init(&cacheMutex);
+}
+
+static tjhandle initHandle(int kind) {
+  switch (kind) {
+    case NJT_HANDLE_COMPRESS:
+      return tjInitCompress();
+    case NJT_HANDLE_DECOMPRESS:
+      return tjInitDecompress();
+    case NJT_HANDLE_TRANSFORM:
+      return tjInitTransform();
+    default:
+      return NULL;
+  }
+}
+
+tjhandle njtAcquireHandle(int kind) {
+  njt_handle_slot* slot;
+  tjhandle handle = NULL;
+
+  uv_once(&cacheOnce, initHandleCache);
+  slot = (njt_handle_slot*) uv_key_get(&cacheKey);
+
+  uv_mutex_lock(&cacheMutex);
+  if (slot != NULL && slot->handles[kind] != NULL) {
+    handle = slot->handles[kind];
+    slot->handles[kind] = NULL;
+    cacheSize--;
+    cacheReused++;
+  }
+  uv_mutex_unlock(&cacheMutex);
+
+  if (handle != NULL) {
+    return handle;
+  }
+
+  handle = initHandle(kind);
+
+  if (handle != NULL) {
+    uv_mutex_lock(&cacheMutex);
+    cacheCreated++;
+    uv_mutex_unlock(&cacheMutex);
+  }
+
+  return handle;
+}
+
+void njtReleaseHandle(int kind, tjhandle handle) {
+  njt_handle_slot* slot;
+
+  if (handle == NULL) {
+    return;
+  }
+
+  uv_once(&cacheOnce, initHandleCache);
+  slot = (njt_handle_slot*) uv_key_get(&cacheKey);
+
+  uv_mutex_lock(&cacheMutex);
+  if (slot == NULL && cacheSize < cacheLimit) {
+    slot = (njt_handle_slot*) calloc(1, sizeof(njt_handle_slot));
+    if (slot != NULL) {
+      slot->next = cacheSlots;
+      cacheSlots = slot;
+      uv_key_set(&cacheKey, slot);
+    }
+  }
+  if (slot != NULL && slot->handles[kind] == NULL && cacheSize < cacheLimit) {
+    slot->handles[kind] = handle;
+    handle = NULL;
+    cacheSize++;
+  }
+  else {
+    cacheDestroyed++;
+  }
+  uv_mutex_unlock(&cacheMutex);
+
+  // Either the cache is full or this thread already has an idle handle
+  if (handle != NULL) {
+    tjDestroy(handle);
+  }
+}
+
+void njtPurgeHandleCache() {
+  njt_handle_slot* slot;
+  int kind;
+
+  uv_once(&cacheOnce, initHandleCache);
+
+  // Handles sitting in a slot are idle by definition, so it's safe to
+  // destroy them even though they belong to some other thread.
+  uv_mutex_lock(&cacheMutex);
+  for (slot = cacheSlots; slot != NULL; slot = slot->next) {
+    for (kind = 0; kind < NJT_HANDLE_KINDS; kind++) {
+      if (slot->handles[kind] != NULL) {
+        tjDestroy(slot->handles[kind]);
+        slot->handles[kind] = NULL;
+        cacheSize--;
+        cacheDestroyed++;
+      }
+    }
+  }
+  uv_mutex_unlock(&cacheMutex);
+}
+
+// Threads that are about to exit must give their handles back, or they'd
+// leak along with the slot.
+void njtReleaseThreadHandles() {
+  njt_handle_slot* slot;
+  njt_handle_slot** prev;
+  int kind;
+
+  uv_once(&cacheOnce, initHandleCache);
+  slot = (njt_handle_slot*) uv_key_get(&cacheKey);
+
+  if (slot == NULL) {
+    return;
+  }
+
+  uv_mutex_lock(&cacheMutex);
+  for (prev = &cacheSlots; *prev != NULL; prev = &(*prev)->next) {
+    if (*prev == slot) {
+      *prev = slot->next;
+      break;
+    }
+  }
+  for (kind = 0; kind < NJT_HANDLE_KINDS; kind++) {
+    if (slot->handles[kind] != NULL) {
+      tjDestroy(slot->handles[kind]);
+      cacheSize--;
+      cacheDestroyed++;
+    }
+  }
+  uv_mutex_unlock(&cacheMutex);
+
+  uv_key_set(&cacheKey, NULL);
+  free(slot);
+}
+
+#ifndef TJFLAG_STOPONWARNING
+static uv_once_t errorOnce = UV_ONCE_INIT;
+static uv_mutex_t errorMutex;
+static thread_local char errorCopy[NJT_MSG_LENGTH_MAX];
+
+static void initErrorStr() {
+  uv_mutex_init(&errorMutex);
+}
+
+// Before 2.0 every handle shares one error buffer. Copying it as soon as
+// our call has failed, one thread at a time, means two of our failing calls
+// never see a half-written message. A call failing on another thread inside
+// that short window can still replace it, which is why compress() and
+// decompress() don't rely on this, see NJT_SHARED_ERRORS.
+const char* njtCopyErrorStr() {
+  uv_once(&errorOnce, initErrorStr);
+
+  uv_mutex_lock(&errorMutex);
+  snprintf(errorCopy, NJT_MSG_LENGTH_MAX, "%s", tjGetErrorStr());
+  uv_mutex_unlock(&errorMutex);
+
+  return errorCopy;
+}
+#endif
+
+NAN_METHOD(HandleCacheStats) {
+  Local<Object> obj = New<Object>();
+
+  uv_once(&cacheOnce, initHandleCache);
+
+  uv_mutex_lock(&cacheMutex);
+  obj->Set(New("created").ToLocalChecked(), New(cacheCreated));
+  obj->Set(New("reused").ToLocalChecked(), New(cacheReused));
+  obj->Set(New("destroyed").ToLocalChecked(), New(cacheDestroyed));
+  obj->Set(New("cached").ToLocalChecked(), New(cacheSize));
+  obj->Set(New("limit").ToLocalChecked(), New(cacheLimit));
+  uv_mutex_unlock(&cacheMutex);
+
+  info.GetReturnValue().Set(obj);
+}
+
+NAN_METHOD(PurgeHandleCache) {
+  njtPurgeHandleCache();
+}
+
+NAN_METHOD(SetHandleCacheLimit) {
+  int retval = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+  bool purge = false;
+
+  if (info.Length() < 1) {
+    _throw("Too few arguments");
+  }
+
+  if (!info[0]->IsUint32()) {
+    _throw("Invalid handle cache limit");
+  }
+
+  uv_once(&cacheOnce, initHandleCache);
+
+  uv_mutex_lock(&cacheMutex);
+  cacheLimit = info[0]->Uint32Value();
+  purge = cacheSize > cacheLimit;
+  uv_mutex_unlock(&cacheMutex);
+
+  if (purge) {
+    njtPurgeHandleCache();
+  }
+
+  bailout:
+  if (retval != 0) {
+    ThrowError(TypeError(errStr));
+    return;
+  }
+}
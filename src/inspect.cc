@@ -0,0 +1,333 @@
+#include "exports.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// Walks the markers up to the first scan, which is all libjpeg needs to read
+// the header. This tells us whether the (possibly partial) data is enough,
+// and whether the frame is progressive, which TurboJPEG doesn't expose.
+static int scanMarkers(unsigned char* data, uint32_t length, bool* progressive, char* errStr) {
+  int retval = 0;
+  uint32_t pos = 2;
+  unsigned char marker;
+  bool frame = false;
+
+  if (length < 2 || data[0] != 0xFF || data[1] != 0xD8) {
+    _throw("Not a JPEG image");
+  }
+
+  for (;;) {
+    if (pos >= length) {
+      _throw("Incomplete header");
+    }
+    if (data[pos] != 0xFF) {
+      _throw("Corrupt header");
+    }
+
+    // Any number of fill bytes may precede the marker
+    while (pos < length && data[pos] == 0xFF) {
+      pos++;
+    }
+    if (pos >= length) {
+      _throw("Incomplete header");
+    }
+    marker = data[pos++];
+
+    // Standalone markers have no length
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+      continue;
+    }
+
+    if (marker == 0xD9) {
+      _throw("No image in JPEG");
+    }
+
+    // SOFn, except DHT, JPG and DAC which share the range
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      *progressive = marker == 0xC2 || marker == 0xC6 || marker == 0xCA || marker == 0xCE;
+      frame = true;
+    }
+
+    // Start of scan, the header is complete
+    if (marker == 0xDA) {
+      if (!frame) {
+        _throw("Corrupt header");
+      }
+      break;
+    }
+
+    if (pos + 2 > length) {
+      _throw("Incomplete header");
+    }
+    pos += (data[pos] << 8) | data[pos + 1];
+  }
+
+  bailout:
+  return retval;
+}
+
+int inspect(unsigned char* srcData, uint32_t srcLength, njt_decompress_options* options, int* width, int* height, int* jpegSubsamp, int* jpegColorspace, bool* progressive, uint32_t* dstLength, char* errStr) {
+  int retval = 0;
+  int err;
+  tjhandle handle = NULL;
+  int bpp;
+  tjscalingfactor factor;
+  int scaledWidth;
+  int scaledHeight;
+
+  // Figure out bpp from format (needed to calculate output buffer size)
+  switch (options->format) {
+    case FORMAT_GRAY:
+      bpp = 1;
+      break;
+    case FORMAT_RGB:
+    case FORMAT_BGR:
+      bpp = 3;
+      break;
+    case FORMAT_RGBX:
+    case FORMAT_BGRX:
+    case FORMAT_XRGB:
+    case FORMAT_XBGR:
+    case FORMAT_RGBA:
+    case FORMAT_BGRA:
+    case FORMAT_ABGR:
+    case FORMAT_ARGB:
+      bpp = 4;
+      break;
+    default:
+      _throw("Invalid output format");
+  }
+
+  if (scanMarkers(srcData, srcLength, progressive, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  handle = njtAcquireHandle(NJT_HANDLE_DECOMPRESS);
+  if (handle == NULL) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  err = tjDecompressHeader3(handle, srcData, srcLength, width, height, jpegSubsamp, jpegColorspace);
+
+  if (err != 0) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  // Report the size decompress() would need with the same options
+  scaledWidth = *width;
+  scaledHeight = *height;
+  if (options->scale > 0 || options->maxWidth > 0 || options->maxHeight > 0) {
+    if (selectScalingFactor(*width, *height, options->scale, options->maxWidth, options->maxHeight, &factor, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+    scaledWidth = TJSCALED(*width, factor);
+    scaledHeight = TJSCALED(*height, factor);
+  }
+
+  *dstLength = scaledWidth * scaledHeight * bpp;
+
+  bailout:
+  njtReleaseHandle(NJT_HANDLE_DECOMPRESS, handle);
+
+  return retval;
+}
+
+static Local<Object> inspectResult(int width, int height, int jpegSubsamp, int jpegColorspace, bool progressive, uint32_t dstLength, uint32_t format) {
+  Local<Object> obj = New<Object>();
+
+  obj->Set(New("width").ToLocalChecked(), New(width));
+  obj->Set(New("height").ToLocalChecked(), New(height));
+  obj->Set(New("subsampling").ToLocalChecked(), New(jpegSubsamp));
+  obj->Set(New("colorspace").ToLocalChecked(), New(jpegColorspace));
+  obj->Set(New("progressive").ToLocalChecked(), New(progressive));
+  obj->Set(New("size").ToLocalChecked(), New(dstLength));
+  obj->Set(New("format").ToLocalChecked(), New(format));
+
+  return obj;
+}
+
+class InspectWorker : public AsyncWorker {
+  public:
+    InspectWorker(Callback *callback, Local<Object> &srcObject, unsigned char* srcData, uint32_t srcLength, njt_decompress_options* options, Local<Object> &tokenObject) :
+      AsyncWorker(callback),
+      srcData(srcData),
+      srcLength(srcLength),
+      options(*options),
+      width(0),
+      height(0),
+      jpegSubsamp(0),
+      jpegColorspace(0),
+      progressive(false),
+      dstLength(0) {
+        SaveToPersistent("srcObject", srcObject);
+        if (options->cancelled != NULL) {
+          SaveToPersistent("tokenObject", tokenObject);
+        }
+      }
+
+    ~InspectWorker() {}
+
+    void Execute () {
+      int err;
+
+      // Cancelled while it was still waiting to run
+      if (this->options.cancelled != NULL && *this->options.cancelled) {
+        SetErrorMessage("Aborted");
+        return;
+      }
+
+      err = inspect(
+          this->srcData,
+          this->srcLength,
+          &this->options,
+          &this->width,
+          &this->height,
+          &this->jpegSubsamp,
+          &this->jpegColorspace,
+          &this->progressive,
+          &this->dstLength,
+          this->errStr);
+
+      if(err != 0) {
+        SetErrorMessage(this->errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      Local<Value> argv[] = {
+        Null(),
+        inspectResult(this->width, this->height, this->jpegSubsamp, this->jpegColorspace, this->progressive, this->dstLength, this->options.format)
+      };
+
+      callback->Call(2, argv);
+    }
+
+  private:
+    unsigned char* srcData;
+    uint32_t srcLength;
+    njt_decompress_options options;
+    int width;
+    int height;
+    int jpegSubsamp;
+    int jpegColorspace;
+    bool progressive;
+    uint32_t dstLength;
+    char errStr[NJT_MSG_LENGTH_MAX];
+};
+
+void inspectParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+  int retval = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+
+  // Input
+  Callback *callback = NULL;
+  Local<Object> srcObject;
+  unsigned char* srcData = NULL;
+  uint32_t srcLength = 0;
+  Local<Object> options;
+  njt_decompress_options opts;
+  Local<Object> tokenObject;
+
+  // Output
+  int width;
+  int height;
+  int jpegSubsamp;
+  int jpegColorspace;
+  bool progressive = false;
+  uint32_t dstLength;
+
+  // Try to find callback here, so if we want to throw something we can use callback's err
+  if (async) {
+    if (info[info.Length() - 1]->IsFunction()) {
+      callback = new Callback(info[info.Length() - 1].As<Function>());
+    }
+    else {
+      _throw("Missing callback");
+    }
+  }
+
+  if ((async && info.Length() < 2) || (!async && info.Length() < 1)) {
+    _throw("Too few arguments");
+  }
+
+  // Input buffer, which may only contain the beginning of the image
+  srcObject = info[0].As<Object>();
+  if (!Buffer::HasInstance(srcObject)) {
+    _throw("Invalid source buffer");
+  }
+
+  srcData = (unsigned char*) Buffer::Data(srcObject);
+  srcLength = Buffer::Length(srcObject);
+
+  // Options are optional
+  options = info[1].As<Object>();
+
+  if (decompressParseOptions(options, &opts, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  if (options->IsObject()) {
+    if (njtParseCancelToken(options, &tokenObject, &opts.cancelled, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+  }
+
+  // Do either async or sync inspect
+  if (async) {
+    if (njtPoolFull()) {
+      _throw("Queue is full");
+    }
+    njtQueueWorker(new InspectWorker(callback, srcObject, srcData, srcLength, &opts, tokenObject), opts.priority, opts.cancelled);
+    return;
+  }
+  else {
+    retval = inspect(
+        srcData,
+        srcLength,
+        &opts,
+        &width,
+        &height,
+        &jpegSubsamp,
+        &jpegColorspace,
+        &progressive,
+        &dstLength,
+        errStr);
+
+    if(retval != 0) {
+      // inspect will set the errStr
+      goto bailout;
+    }
+
+    info.GetReturnValue().Set(inspectResult(width, height, jpegSubsamp, jpegColorspace, progressive, dstLength, opts.format));
+    return;
+  }
+
+  // If we have error throw error or call callback with error
+  bailout:
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+NAN_METHOD(InspectSync) {
+  inspectParse(info, false);
+}
+
+NAN_METHOD(Inspect) {
+  inspectParse(info, true);
+}
@@ -0,0 +1,517 @@
+#include <string.h>
+
+#include "libjpeg.h"
+
+static void errorExit(j_common_ptr cinfo) {
+  njt_error_mgr* err = (njt_error_mgr*) cinfo->err;
+  longjmp(err->setjmpBuffer, 1);
+}
+
+// Warnings would go to stderr by default
+static void outputMessage(j_common_ptr cinfo) {
+}
+
+struct jpeg_error_mgr* njtErrorMgr(njt_error_mgr* err) {
+  jpeg_std_error(&err->pub);
+  err->pub.error_exit = errorExit;
+  err->pub.output_message = outputMessage;
+  return &err->pub;
+}
+
+void njtFormatError(j_common_ptr cinfo, char* errStr) {
+  char buffer[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, buffer);
+  snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", buffer);
+}
+
+// There's no message for this, the caller is expected to check the flag and
+// report the error itself.
+static void progressMonitor(j_common_ptr cinfo) {
+  njt_progress_mgr* progress = (njt_progress_mgr*) cinfo->progress;
+
+  if (*progress->cancelled) {
+    ERREXIT(cinfo, JMSG_NOMESSAGE);
+  }
+}
+
+void njtInitProgress(njt_progress_mgr* progress, volatile int32_t* cancelled) {
+  memset(progress, 0, sizeof(njt_progress_mgr));
+  progress->pub.progress_monitor = progressMonitor;
+  progress->cancelled = cancelled;
+}
+
+// Applies our compression options on top of the libjpeg defaults, the same
+// way TurboJPEG would. The input colorspace must already be set.
+int njtSetCompressOptions(j_compress_ptr cinfo, njt_compress_options* options) {
+  jpeg_set_defaults(cinfo);
+  jpeg_set_quality(cinfo, options->quality, TRUE);
+  // Like TurboJPEG, which never uses the fast DCT at the highest qualities
+  cinfo->dct_method = options->accurateDct || options->quality >= 96 ? JDCT_ISLOW : JDCT_IFAST;
+
+  if (njtSetSubsampling(cinfo, options->jpegSubsamp) != 0) {
+    return -1;
+  }
+
+  cinfo->optimize_coding = options->optimize ? TRUE : FALSE;
+
+  if (options->restartRows > 0) {
+    cinfo->restart_in_rows = options->restartRows;
+  }
+  else {
+    cinfo->restart_interval = options->restartInterval;
+  }
+
+  if (options->progressive) {
+    jpeg_simple_progression(cinfo);
+  }
+
+  return 0;
+}
+
+static void initFixedDestination(j_compress_ptr cinfo) {
+}
+
+static boolean emptyFixedDestination(j_compress_ptr cinfo) {
+  ERREXIT(cinfo, JERR_BUFFER_SIZE);
+  return TRUE;
+}
+
+static void termFixedDestination(j_compress_ptr cinfo) {
+}
+
+// A destination that fails instead of growing past size bytes. How much
+// was written is size - dest->free_in_buffer.
+void njtFixedDest(j_compress_ptr cinfo, struct jpeg_destination_mgr* dest, unsigned char* data, unsigned long size) {
+  dest->init_destination = initFixedDestination;
+  dest->empty_output_buffer = emptyFixedDestination;
+  dest->term_destination = termFixedDestination;
+  dest->next_output_byte = data;
+  dest->free_in_buffer = size;
+  cinfo->dest = dest;
+}
+
+static void initGrowingDestination(j_compress_ptr cinfo) {
+}
+
+static boolean emptyGrowingDestination(j_compress_ptr cinfo) {
+  njt_growing_dest* dest = (njt_growing_dest*) cinfo->dest;
+  unsigned long size = dest->size * 2;
+  unsigned char* data;
+
+  // The caller's own buffer is left alone, as jpeg_mem_dest() would
+  if (dest->owned) {
+    data = (unsigned char*) realloc(*dest->data, size);
+  }
+  else {
+    data = (unsigned char*) malloc(size);
+    if (data != NULL) {
+      memcpy(data, *dest->data, dest->size);
+    }
+  }
+  if (data == NULL) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+  }
+
+  *dest->data = data;
+  dest->owned = true;
+  dest->pub.next_output_byte = data + dest->size;
+  dest->pub.free_in_buffer = size - dest->size;
+  dest->size = size;
+
+  return TRUE;
+}
+
+static void termGrowingDestination(j_compress_ptr cinfo) {
+}
+
+// Like jpeg_mem_dest(), but *data always points to the current buffer, so
+// that the caller can free it after an error instead of being left with a
+// pointer to memory libjpeg has already freed. *data must hold size bytes;
+// if it's NULL or size is 0, a new buffer is allocated to start with. Once
+// the output outgrows the caller's buffer, *data is replaced with a
+// malloc()ed one that the caller must free. How much was written is
+// dest->size - dest->pub.free_in_buffer.
+void njtGrowingDest(j_compress_ptr cinfo, njt_growing_dest* dest, unsigned char** data, unsigned long size) {
+  dest->owned = false;
+  if (*data == NULL || size == 0) {
+    // libjpeg stores a byte before it checks for space
+    if (size == 0) {
+      size = NJT_SCRATCH_SLACK;
+    }
+    *data = (unsigned char*) malloc(size);
+    if (*data == NULL) {
+      ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+    }
+    dest->owned = true;
+  }
+
+  dest->pub.init_destination = initGrowingDestination;
+  dest->pub.empty_output_buffer = emptyGrowingDestination;
+  dest->pub.term_destination = termGrowingDestination;
+  dest->pub.next_output_byte = *data;
+  dest->pub.free_in_buffer = size;
+  dest->data = data;
+  dest->size = size;
+  cinfo->dest = &dest->pub;
+}
+
+// Writes to file if given, otherwise to memory as njtCompressScanlines()
+// describes.
+static int compressScanlines(unsigned char* srcData, njt_compress_options* options, FILE* file, unsigned char** dstData, unsigned long* jpegSize, bool fixed, char* errStr) {
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_destination_mgr dest;
+  njt_growing_dest growing;
+  njt_error_mgr jerr;
+  njt_progress_mgr progress;
+  J_COLOR_SPACE colorSpace;
+  int bpp;
+  JSAMPROW row;
+
+  if (njtColorSpace(options->format, &colorSpace, &bpp) != 0) {
+    snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Invalid input format");
+    return -1;
+  }
+
+  cinfo.err = njtErrorMgr(&jerr);
+
+  if (setjmp(jerr.setjmpBuffer)) {
+    njtFormatError((j_common_ptr) &cinfo, errStr);
+    if (options->cancelled != NULL && *options->cancelled) {
+      snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Aborted");
+    }
+    jpeg_destroy_compress(&cinfo);
+    return -1;
+  }
+
+  jpeg_create_compress(&cinfo);
+
+  if (file != NULL) {
+    jpeg_stdio_dest(&cinfo, file);
+  }
+  else if (fixed) {
+    njtFixedDest(&cinfo, &dest, *dstData, *jpegSize);
+  }
+  else {
+    njtGrowingDest(&cinfo, &growing, dstData, *dstData != NULL ? *jpegSize : NJT_SCRATCH_SLACK);
+  }
+
+  // Unlike tjCompress2(), this gets called for every row
+  if (options->cancelled != NULL) {
+    njtInitProgress(&progress, options->cancelled);
+    cinfo.progress = &progress.pub;
+  }
+
+  cinfo.image_width = options->width;
+  cinfo.image_height = options->height;
+  cinfo.input_components = bpp;
+  cinfo.in_color_space = colorSpace;
+
+  if (njtSetCompressOptions(&cinfo, options) != 0) {
+    snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Invalid subsampling method");
+    jpeg_destroy_compress(&cinfo);
+    return -1;
+  }
+
+  jpeg_start_compress(&cinfo, TRUE);
+
+  while (cinfo.next_scanline < cinfo.image_height) {
+    row = srcData + cinfo.next_scanline * options->stride * bpp;
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+
+  jpeg_finish_compress(&cinfo);
+
+  if (file == NULL && fixed) {
+    *jpegSize = *jpegSize - dest.free_in_buffer;
+  }
+  else if (file == NULL) {
+    *jpegSize = growing.size - growing.pub.free_in_buffer;
+  }
+
+  jpeg_destroy_compress(&cinfo);
+
+  return 0;
+}
+
+// Like tjCompress2(), but through the scanline API. If fixed is set,
+// *dstData must hold *jpegSize bytes and is never reallocated, otherwise
+// the buffer is grown as needed, see njtGrowingDest(). Whatever is left in
+// *dstData then, even after an error, is for the caller to free if it's not
+// the buffer it passed in.
+int njtCompressScanlines(unsigned char* srcData, njt_compress_options* options, unsigned char** dstData, unsigned long* jpegSize, bool fixed, char* errStr) {
+  return compressScanlines(srcData, options, NULL, dstData, jpegSize, fixed, errStr);
+}
+
+// Same, but streams the output to an open file through libjpeg's stdio
+// destination, 4 kB at a time, so the image never has to fit in memory.
+int njtCompressFile(unsigned char* srcData, njt_compress_options* options, FILE* file, char* errStr) {
+  return compressScanlines(srcData, options, file, NULL, NULL, false, errStr);
+}
+
+// Decodes options->region of the (scaled) image into dstData. The caller
+// must make sure that the region lies within the image. TurboJPEG 1.4
+// can't crop, and libjpeg only gained jpeg_crop_scanline() and
+// jpeg_skip_scanlines() later, so this reads scanlines up to the bottom of
+// the region and copies the columns we need. Restart markers let us skip
+// the rows above the region entirely, see njtRestartSubimage().
+int njtDecompressRegion(unsigned char* srcData, uint32_t srcLength, njt_decompress_options* options, tjscalingfactor factor, unsigned char* dstData, uint32_t pitch, char* errStr) {
+  struct jpeg_decompress_struct dinfo;
+  njt_error_mgr jerr;
+  njt_progress_mgr progress;
+  J_COLOR_SPACE colorSpace;
+  int bpp;
+  JSAMPARRAY buffer;
+  unsigned char* subData = NULL;
+  unsigned long subLength = 0;
+  uint32_t subY = 0;
+  uint32_t skip;
+  uint32_t last;
+  uint32_t y;
+
+  if (njtColorSpace(options->format, &colorSpace, &bpp) != 0) {
+    snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Invalid output format");
+    return -1;
+  }
+
+  njtRestartSubimage(srcData, srcLength, options->regionY * factor.denom / factor.num, &subData, &subLength, &subY);
+
+  // Row of the output the subimage starts at
+  skip = options->regionY - subY * factor.num / factor.denom;
+  last = skip + options->regionHeight;
+
+  dinfo.err = njtErrorMgr(&jerr);
+
+  if (setjmp(jerr.setjmpBuffer)) {
+    njtFormatError((j_common_ptr) &dinfo, errStr);
+    if (options->cancelled != NULL && *options->cancelled) {
+      snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Aborted");
+    }
+    jpeg_destroy_decompress(&dinfo);
+    free(subData);
+    return -1;
+  }
+
+  jpeg_create_decompress(&dinfo);
+
+  if (subData != NULL) {
+    jpeg_mem_src(&dinfo, subData, subLength);
+  }
+  else {
+    jpeg_mem_src(&dinfo, srcData, srcLength);
+  }
+
+  if (options->cancelled != NULL) {
+    njtInitProgress(&progress, options->cancelled);
+    dinfo.progress = &progress.pub;
+  }
+
+  jpeg_read_header(&dinfo, TRUE);
+
+  dinfo.out_color_space = colorSpace;
+  dinfo.scale_num = factor.num;
+  dinfo.scale_denom = factor.denom;
+  dinfo.dct_method = options->accurateDct ? JDCT_ISLOW : JDCT_IFAST;
+  dinfo.do_fancy_upsampling = options->fastUpsample ? FALSE : TRUE;
+
+  jpeg_start_decompress(&dinfo);
+
+  buffer = (*dinfo.mem->alloc_sarray)((j_common_ptr) &dinfo, JPOOL_IMAGE, dinfo.output_width * bpp, 1);
+
+  while (dinfo.output_scanline < last) {
+    y = dinfo.output_scanline;
+    jpeg_read_scanlines(&dinfo, buffer, 1);
+
+    if (y >= skip) {
+      memcpy(dstData + (y - skip) * pitch, buffer[0] + options->regionX * bpp, options->regionWidth * bpp);
+    }
+  }
+
+  // Nothing below the region is of any interest
+  jpeg_abort_decompress(&dinfo);
+  jpeg_destroy_decompress(&dinfo);
+  free(subData);
+
+  return 0;
+}
+
+// Like tjDecompressHeader(), but with an error message of its own.
+int njtDecompressHeader(unsigned char* srcData, uint32_t srcLength, int* width, int* height, char* errStr) {
+  struct jpeg_decompress_struct dinfo;
+  njt_error_mgr jerr;
+
+  dinfo.err = njtErrorMgr(&jerr);
+
+  if (setjmp(jerr.setjmpBuffer)) {
+    njtFormatError((j_common_ptr) &dinfo, errStr);
+    jpeg_destroy_decompress(&dinfo);
+    return -1;
+  }
+
+  jpeg_create_decompress(&dinfo);
+  jpeg_mem_src(&dinfo, srcData, srcLength);
+  jpeg_read_header(&dinfo, TRUE);
+
+  *width = dinfo.image_width;
+  *height = dinfo.image_height;
+
+  jpeg_destroy_decompress(&dinfo);
+
+  return 0;
+}
+
+// Like tjDecompress2() with the same flags, but through the scanline API
+// so that it can be cancelled between rows of MCUs, and with an error
+// message of its own. TurboJPEG doesn't let us attach a progress monitor to
+// its own decompressor.
+int njtDecompressScanlines(unsigned char* srcData, uint32_t srcLength, tjscalingfactor factor, int format, int flags, volatile int32_t* cancelled, unsigned char* dstData, uint32_t pitch, char* errStr) {
+  struct jpeg_decompress_struct dinfo;
+  njt_error_mgr jerr;
+  njt_progress_mgr progress;
+  J_COLOR_SPACE colorSpace;
+  int bpp;
+  JSAMPROW row;
+
+  if (njtColorSpace(format, &colorSpace, &bpp) != 0) {
+    snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Invalid output format");
+    return -1;
+  }
+
+  dinfo.err = njtErrorMgr(&jerr);
+
+  if (setjmp(jerr.setjmpBuffer)) {
+    njtFormatError((j_common_ptr) &dinfo, errStr);
+    if (cancelled != NULL && *cancelled) {
+      snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Aborted");
+    }
+    jpeg_destroy_decompress(&dinfo);
+    return -1;
+  }
+
+  jpeg_create_decompress(&dinfo);
+  jpeg_mem_src(&dinfo, srcData, srcLength);
+
+  if (cancelled != NULL) {
+    njtInitProgress(&progress, cancelled);
+    dinfo.progress = &progress.pub;
+  }
+
+  jpeg_read_header(&dinfo, TRUE);
+
+  dinfo.out_color_space = colorSpace;
+  dinfo.scale_num = factor.num;
+  dinfo.scale_denom = factor.denom;
+  dinfo.dct_method = (flags & TJFLAG_ACCURATEDCT) ? JDCT_ISLOW : JDCT_IFAST;
+  dinfo.do_fancy_upsampling = (flags & TJFLAG_FASTUPSAMPLE) ? FALSE : TRUE;
+
+  jpeg_start_decompress(&dinfo);
+
+  while (dinfo.output_scanline < dinfo.output_height) {
+    row = dstData + dinfo.output_scanline * pitch;
+    jpeg_read_scanlines(&dinfo, &row, 1);
+  }
+
+  jpeg_finish_decompress(&dinfo);
+  jpeg_destroy_decompress(&dinfo);
+
+  return 0;
+}
+
+// Maps our pixel formats to libjpeg-turbo's extended colorspaces.
+int njtColorSpace(uint32_t format, J_COLOR_SPACE* colorSpace, int* bpp) {
+  switch (format) {
+    case FORMAT_GRAY:
+      *colorSpace = JCS_GRAYSCALE;
+      *bpp = 1;
+      break;
+    case FORMAT_RGB:
+      *colorSpace = JCS_EXT_RGB;
+      *bpp = 3;
+      break;
+    case FORMAT_BGR:
+      *colorSpace = JCS_EXT_BGR;
+      *bpp = 3;
+      break;
+    case FORMAT_RGBX:
+      *colorSpace = JCS_EXT_RGBX;
+      *bpp = 4;
+      break;
+    case FORMAT_BGRX:
+      *colorSpace = JCS_EXT_BGRX;
+      *bpp = 4;
+      break;
+    case FORMAT_XRGB:
+      *colorSpace = JCS_EXT_XRGB;
+      *bpp = 4;
+      break;
+    case FORMAT_XBGR:
+      *colorSpace = JCS_EXT_XBGR;
+      *bpp = 4;
+      break;
+    case FORMAT_RGBA:
+      *colorSpace = JCS_EXT_RGBA;
+      *bpp = 4;
+      break;
+    case FORMAT_BGRA:
+      *colorSpace = JCS_EXT_BGRA;
+      *bpp = 4;
+      break;
+    case FORMAT_ABGR:
+      *colorSpace = JCS_EXT_ABGR;
+      *bpp = 4;
+      break;
+    case FORMAT_ARGB:
+      *colorSpace = JCS_EXT_ARGB;
+      *bpp = 4;
+      break;
+    default:
+      return -1;
+  }
+
+  return 0;
+}
+
+// Same sampling factors as TurboJPEG uses for its SAMP_* constants. Must be
+// called after the colorspace has been set.
+int njtSetSubsampling(j_compress_ptr cinfo, uint32_t subsamp) {
+  int h;
+  int v;
+
+  switch (subsamp) {
+    case SAMP_444:
+      h = 1;
+      v = 1;
+      break;
+    case SAMP_422:
+      h = 2;
+      v = 1;
+      break;
+    case SAMP_420:
+      h = 2;
+      v = 2;
+      break;
+    case SAMP_440:
+      h = 1;
+      v = 2;
+      break;
+    case SAMP_GRAY:
+      jpeg_set_colorspace(cinfo, JCS_GRAYSCALE);
+      return 0;
+    default:
+      return -1;
+  }
+
+  // Grayscale input can only produce grayscale output
+  if (cinfo->in_color_space == JCS_GRAYSCALE) {
+    jpeg_set_colorspace(cinfo, JCS_GRAYSCALE);
+    return 0;
+  }
+
+  cinfo->comp_info[0].h_samp_factor = h;
+  cinfo->comp_info[0].v_samp_factor = v;
+  cinfo->comp_info[1].h_samp_factor = 1;
+  cinfo->comp_info[1].v_samp_factor = 1;
+  cinfo->comp_info[2].h_samp_factor = 1;
+  cinfo->comp_info[2].v_samp_factor = 1;
+
+  return 0;
+}
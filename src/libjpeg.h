@@ -0,0 +1,52 @@
+#ifndef _NODE_JPEG_TURBO_LIBJPEG
+#define _NODE_JPEG_TURBO_LIBJPEG
+
+// TurboJPEG doesn't cover everything we need (e.g. suspending sources or
+// scanline access), so some features use the underlying libjpeg API directly.
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "exports.h"
+
+// libjpeg reports errors by calling error_exit(), which must not return. We
+// longjmp() back to the caller instead, so any function that uses this must
+// not have anything with a destructor on the stack.
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmpBuffer;
+} njt_error_mgr;
+
+// Polls a cancellation flag whenever libjpeg reports progress, which happens
+// once per MCU row when decoding.
+typedef struct {
+  struct jpeg_progress_mgr pub;
+  volatile int32_t* cancelled;
+} njt_progress_mgr;
+
+// See njtGrowingDest().
+typedef struct {
+  struct jpeg_destination_mgr pub;
+  unsigned char** data;
+  unsigned long size;
+  bool owned;
+} njt_growing_dest;
+
+struct jpeg_error_mgr* njtErrorMgr(njt_error_mgr* err);
+void njtFormatError(j_common_ptr cinfo, char* errStr);
+int njtColorSpace(uint32_t format, J_COLOR_SPACE* colorSpace, int* bpp);
+int njtSetSubsampling(j_compress_ptr cinfo, uint32_t subsamp);
+void njtInitProgress(njt_progress_mgr* progress, volatile int32_t* cancelled);
+int njtSetCompressOptions(j_compress_ptr cinfo, njt_compress_options* options);
+void njtFixedDest(j_compress_ptr cinfo, struct jpeg_destination_mgr* dest, unsigned char* data, unsigned long size);
+void njtGrowingDest(j_compress_ptr cinfo, njt_growing_dest* dest, unsigned char** data, unsigned long size);
+int njtCompressScanlines(unsigned char* srcData, njt_compress_options* options, unsigned char** dstData, unsigned long* jpegSize, bool fixed, char* errStr);
+int njtCompressFile(unsigned char* srcData, njt_compress_options* options, FILE* file, char* errStr);
+int njtCompressTargetSize(unsigned char* srcData, njt_compress_options* options, unsigned char** dstData, unsigned long* jpegSize, bool fixed, char* errStr);
+int njtRecompress(unsigned char* srcData, uint32_t srcLength, njt_compress_options* options, unsigned char** dstData, unsigned long* jpegSize, bool fixed, char* errStr);
+int njtDecompressRegion(unsigned char* srcData, uint32_t srcLength, njt_decompress_options* options, tjscalingfactor factor, unsigned char* dstData, uint32_t pitch, char* errStr);
+int njtDecompressHeader(unsigned char* srcData, uint32_t srcLength, int* width, int* height, char* errStr);
+int njtDecompressScanlines(unsigned char* srcData, uint32_t srcLength, tjscalingfactor factor, int format, int flags, volatile int32_t* cancelled, unsigned char* dstData, uint32_t pitch, char* errStr);
+
+#endif
@@ -0,0 +1,186 @@
+#include "exports.h"
+
+// A fork-join job that helper threads can join in on. It stays on its lane
+// until the thread that started it has run out of items.
+typedef struct njt_parallel_job {
+  uint32_t count;
+  uint32_t next;
+  uint32_t helpers;
+  uint32_t running;
+  uint32_t priority;
+  void (*fn)(uint32_t index, void* data);
+  void* data;
+  uv_cond_t done;
+  struct njt_parallel_job* nextJob;
+} njt_parallel_job;
+
+// Helper threads are started on demand, shared by every caller and never
+// exit, so their handle cache and stats slots stay warm between calls.
+// Everything below is protected by parallelMutex.
+static uv_once_t parallelOnce = UV_ONCE_INIT;
+static uv_mutex_t parallelMutex;
+static uv_cond_t parallelCond;
+static njt_parallel_job* parallelLanes[NJT_PRIORITY_LANES];
+static uint32_t parallelThreads = 0;
+static uint32_t parallelIdle = 0;
+static uint32_t parallelBulk = 0;
+
+static void initParallel() {
+  uv_mutex_init(&parallelMutex);
+  uv_cond_init(&parallelCond);
+  memset(parallelLanes, 0, sizeof(parallelLanes));
+}
+
+// Like the pool's lanes, bulk jobs may never occupy every helper, so that
+// an interactive job can always get some help right away.
+static njt_parallel_job* openJob() {
+  njt_parallel_job* job;
+  uint32_t lane;
+
+  for (lane = 0; lane < NJT_PRIORITY_LANES; lane++) {
+    if (lane == PRIORITY_BULK && parallelBulk + 1 >= parallelThreads && parallelThreads > 1) {
+      break;
+    }
+    for (job = parallelLanes[lane]; job != NULL; job = job->nextJob) {
+      if (job->next < job->count && job->running < job->helpers) {
+        return job;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// Runs items of job until there are none left. Called and returns with
+// parallelMutex held.
+static void runItems(njt_parallel_job* job) {
+  uint32_t index;
+
+  while (job->next < job->count) {
+    index = job->next++;
+    uv_mutex_unlock(&parallelMutex);
+    job->fn(index, job->data);
+    uv_mutex_lock(&parallelMutex);
+  }
+}
+
+static void parallelThread(void* arg) {
+  njt_parallel_job* job;
+
+  uv_mutex_lock(&parallelMutex);
+  for (;;) {
+    while ((job = openJob()) == NULL) {
+      parallelIdle++;
+      uv_cond_wait(&parallelCond, &parallelMutex);
+      parallelIdle--;
+    }
+
+    job->running++;
+    if (job->priority == PRIORITY_BULK) {
+      parallelBulk++;
+    }
+
+    runItems(job);
+
+    if (job->priority == PRIORITY_BULK) {
+      parallelBulk--;
+    }
+    if (--job->running == 0) {
+      uv_cond_signal(&job->done);
+    }
+  }
+}
+
+uint32_t njtCpuCount() {
+  static uint32_t cpuCount = 0;
+  uv_cpu_info_t* cpus;
+  int count;
+
+  if (cpuCount == 0) {
+    if (uv_cpu_info(&cpus, &count) == 0) {
+      uv_free_cpu_info(cpus, count);
+      cpuCount = count;
+    }
+    if (cpuCount == 0) {
+      cpuCount = 1;
+    }
+  }
+
+  return cpuCount;
+}
+
+// Calls fn once for every index in [0, count), spreading the calls over up
+// to the given number of threads (including the calling thread). Returns
+// once every call has finished.
+//
+// The other threads come from a set of at most one helper per core but one,
+// shared by everyone, so that concurrent callers (e.g. several batches on
+// the pool) don't each bring their own. Jobs of the given priority lane are
+// helped first. The calling thread always works on its own job too, which
+// means it never waits for a helper to become available and nested calls
+// can't deadlock.
+void njtParallelFor(uint32_t count, uint32_t threads, uint32_t priority, void (*fn)(uint32_t index, void* data), void* data) {
+  njt_parallel_job job;
+  njt_parallel_job** link;
+  uv_thread_t tid;
+  uint32_t wanted;
+  uint32_t i;
+
+  if (threads == 0) {
+    threads = njtCpuCount();
+  }
+  if (threads > count) {
+    threads = count;
+  }
+
+  if (threads <= 1) {
+    for (i = 0; i < count; i++) {
+      fn(i, data);
+    }
+    return;
+  }
+
+  job.count = count;
+  job.next = 0;
+  job.helpers = threads - 1;
+  job.running = 0;
+  job.priority = priority < NJT_PRIORITY_LANES ? priority : PRIORITY_BULK;
+  job.fn = fn;
+  job.data = data;
+  uv_cond_init(&job.done);
+
+  uv_once(&parallelOnce, initParallel);
+  uv_mutex_lock(&parallelMutex);
+
+  // Order within a lane doesn't matter much, as every job gets help
+  job.nextJob = parallelLanes[job.priority];
+  parallelLanes[job.priority] = &job;
+
+  // Start more helpers if there aren't enough idle ones. If we can't get as
+  // many threads as we'd like, we'll just make do.
+  wanted = job.helpers < njtCpuCount() - 1 ? job.helpers : njtCpuCount() - 1;
+  while (parallelIdle < wanted && parallelThreads < njtCpuCount() - 1) {
+    if (uv_thread_create(&tid, parallelThread, NULL) != 0) {
+      break;
+    }
+    parallelThreads++;
+    wanted--;
+  }
+  uv_cond_broadcast(&parallelCond);
+
+  runItems(&job);
+
+  // No helper can pick the job up anymore, but some may still be busy
+  for (link = &parallelLanes[job.priority]; *link != NULL; link = &(*link)->nextJob) {
+    if (*link == &job) {
+      *link = job.nextJob;
+      break;
+    }
+  }
+  while (job.running > 0) {
+    uv_cond_wait(&job.done, &parallelMutex);
+  }
+
+  uv_mutex_unlock(&parallelMutex);
+  uv_cond_destroy(&job.done);
+}
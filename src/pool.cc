@@ -0,0 +1,463 @@
+#include "exports.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+typedef struct njt_pool_job {
+  AsyncWorker* worker;
+  uint32_t priority;
+  uint64_t queuedAt;
+  volatile int32_t* cancelled;
+  bool dropped;
+  uv_work_t request;
+  struct njt_pool_job* next;
+} njt_pool_job;
+
+typedef struct {
+  njt_pool_job* head;
+  njt_pool_job* tail;
+  uint32_t queued;
+  uint32_t running;
+  double completed;
+  uint64_t waitTime;
+  uint64_t execTime;
+  uint64_t maxWaitTime;
+} njt_pool_lane;
+
+// Everything below is protected by poolMutex, except poolAsync and
+// poolOutstanding, which are only touched on the main thread.
+static uv_mutex_t poolMutex;
+static uv_cond_t poolCond;
+static uv_async_t poolAsync;
+static bool poolStarted = false;
+static uint32_t poolThreads = 0;
+static uint32_t poolQueueSize = NJT_DEFAULT_POOL_QUEUE_SIZE;
+static njt_pool_lane poolLanes[NJT_PRIORITY_LANES];
+static njt_pool_job* poolDone = NULL;
+static uint32_t poolOutstanding = 0;
+
+// Jobs with a cancel token on the libuv thread pool, which uv_cancel() can
+// still take back until they start. Only touched on the main thread.
+static njt_pool_job* uvJobs = NULL;
+
+// Bulk jobs may never occupy every thread, so that there's always room for
+// an interactive job to start right away.
+static bool bulkAllowed() {
+  uint32_t bulkThreads = poolThreads > 1 ? poolThreads - 1 : 1;
+  return poolLanes[PRIORITY_BULK].running < bulkThreads;
+}
+
+static njt_pool_job* nextJob() {
+  njt_pool_lane* lane;
+  njt_pool_job* job;
+
+  lane = &poolLanes[PRIORITY_INTERACTIVE];
+  if (lane->head == NULL) {
+    lane = &poolLanes[PRIORITY_BULK];
+    if (lane->head == NULL || !bulkAllowed()) {
+      return NULL;
+    }
+  }
+
+  job = lane->head;
+  lane->head = job->next;
+  if (lane->head == NULL) {
+    lane->tail = NULL;
+  }
+  job->next = NULL;
+  lane->queued--;
+  lane->running++;
+
+  return job;
+}
+
+static void poolThread(void* arg) {
+  njt_pool_job* job;
+  njt_pool_lane* lane;
+  uint64_t startedAt;
+  uint64_t finishedAt;
+
+  uv_mutex_lock(&poolMutex);
+  for (;;) {
+    while ((job = nextJob()) == NULL) {
+      uv_cond_wait(&poolCond, &poolMutex);
+    }
+    uv_mutex_unlock(&poolMutex);
+
+    startedAt = uv_hrtime();
+    job->worker->Execute();
+    finishedAt = uv_hrtime();
+
+    uv_mutex_lock(&poolMutex);
+    lane = &poolLanes[job->priority];
+    lane->running--;
+    lane->completed++;
+    lane->waitTime += startedAt - job->queuedAt;
+    lane->execTime += finishedAt - startedAt;
+    if (startedAt - job->queuedAt > lane->maxWaitTime) {
+      lane->maxWaitTime = startedAt - job->queuedAt;
+    }
+    job->next = poolDone;
+    poolDone = job;
+
+    // A finished bulk job may allow a waiting bulk job to start
+    if (job->priority == PRIORITY_BULK && poolLanes[PRIORITY_BULK].head != NULL) {
+      uv_cond_signal(&poolCond);
+    }
+
+    uv_async_send(&poolAsync);
+  }
+}
+
+static void poolComplete(uv_async_t* handle) {
+  njt_pool_job* done;
+  njt_pool_job* job;
+
+  uv_mutex_lock(&poolMutex);
+  done = poolDone;
+  poolDone = NULL;
+  uv_mutex_unlock(&poolMutex);
+
+  while (done != NULL) {
+    job = done;
+    done = job->next;
+    // Sees the token right away and fails with "Aborted"
+    if (job->dropped) {
+      job->worker->Execute();
+    }
+    job->worker->WorkComplete();
+    job->worker->Destroy();
+    free(job);
+    poolOutstanding--;
+  }
+
+  // Don't keep the process alive just because the pool exists
+  if (poolOutstanding == 0) {
+    uv_unref((uv_handle_t*) &poolAsync);
+  }
+}
+
+static void uvExecute(uv_work_t* request) {
+  njt_pool_job* job = (njt_pool_job*) request->data;
+
+  job->worker->Execute();
+}
+
+static void uvComplete(uv_work_t* request, int status) {
+  njt_pool_job* job = (njt_pool_job*) request->data;
+  njt_pool_job** link;
+
+  for (link = &uvJobs; *link != NULL; link = &(*link)->next) {
+    if (*link == job) {
+      *link = job->next;
+      break;
+    }
+  }
+
+  // Sees the token right away and fails with "Aborted"
+  if (status == UV_ECANCELED) {
+    job->worker->Execute();
+  }
+  job->worker->WorkComplete();
+  job->worker->Destroy();
+  free(job);
+}
+
+static int startPool(uint32_t threads, char* errStr) {
+  int retval = 0;
+  uv_thread_t tid;
+
+  if (!poolStarted) {
+    uv_mutex_init(&poolMutex);
+    uv_cond_init(&poolCond);
+    uv_async_init(uv_default_loop(), &poolAsync, poolComplete);
+    uv_unref((uv_handle_t*) &poolAsync);
+    memset(poolLanes, 0, sizeof(poolLanes));
+    poolStarted = true;
+  }
+
+  while (poolThreads < threads) {
+    if (uv_thread_create(&tid, poolThread, NULL) != 0) {
+      _throw("Unable to create pool thread");
+    }
+    uv_mutex_lock(&poolMutex);
+    poolThreads++;
+    uv_mutex_unlock(&poolMutex);
+  }
+
+  bailout:
+  return retval;
+}
+
+int njtParsePriority(Local<Object> options, uint32_t* priority, char* errStr) {
+  int retval = 0;
+  Local<Value> priorityObject;
+
+  priorityObject = options->Get(New("priority").ToLocalChecked());
+  if (!priorityObject->IsUndefined()) {
+    if (!priorityObject->IsUint32()) {
+      _throw("Invalid priority");
+    }
+    *priority = priorityObject->Uint32Value();
+  }
+
+  switch (*priority) {
+    case PRIORITY_INTERACTIVE:
+    case PRIORITY_BULK:
+      break;
+    default:
+      _throw("Invalid priority");
+  }
+
+  bailout:
+  return retval;
+}
+
+// The cancel token is a small Buffer shared with JS. Once its first int is
+// set, a running job stops as soon as it can, and one that hasn't started
+// yet fails with "Aborted" as soon as it does. cancelQueued() also takes it
+// off the queue right away. The caller must keep tokenObject alive for the
+// job.
+int njtParseCancelToken(Local<Object> options, Local<Object>* tokenObject, volatile int32_t** cancelled, char* errStr) {
+  int retval = 0;
+  Local<Value> tokenValue;
+
+  *cancelled = NULL;
+
+  tokenValue = options->Get(New("cancelToken").ToLocalChecked());
+  if (!tokenValue->IsUndefined()) {
+    *tokenObject = tokenValue.As<Object>();
+    if (!Buffer::HasInstance(*tokenObject) || Buffer::Length(*tokenObject) < sizeof(int32_t)) {
+      _throw("Invalid cancelToken");
+    }
+    *cancelled = (volatile int32_t*) Buffer::Data(*tokenObject);
+  }
+
+  bailout:
+  return retval;
+}
+
+bool njtPoolFull() {
+  bool full;
+
+  if (!poolStarted) {
+    return false;
+  }
+
+  uv_mutex_lock(&poolMutex);
+  full = poolLanes[PRIORITY_INTERACTIVE].queued + poolLanes[PRIORITY_BULK].queued >= poolQueueSize;
+  uv_mutex_unlock(&poolMutex);
+
+  return full;
+}
+
+// Queues worker to run on the native pool if it has been started, or on the
+// libuv thread pool otherwise. If the worker has a cancel token, cancelled
+// must point at it, so that the job can be dropped from the queue.
+void njtQueueWorker(AsyncWorker* worker, uint32_t priority, volatile int32_t* cancelled) {
+  njt_pool_job* job;
+  njt_pool_lane* lane;
+
+  // Without a pool, share the libuv thread pool like we always did
+  if (!poolStarted && cancelled == NULL) {
+    AsyncQueueWorker(worker);
+    return;
+  }
+
+  job = (njt_pool_job*) malloc(sizeof(njt_pool_job));
+  job->worker = worker;
+  job->priority = priority;
+  job->queuedAt = uv_hrtime();
+  job->cancelled = cancelled;
+  job->dropped = false;
+  job->next = NULL;
+
+  if (!poolStarted) {
+    job->request.data = job;
+    job->next = uvJobs;
+    uvJobs = job;
+    uv_queue_work(uv_default_loop(), &job->request, uvExecute, uvComplete);
+    return;
+  }
+
+  if (poolOutstanding++ == 0) {
+    uv_ref((uv_handle_t*) &poolAsync);
+  }
+
+  uv_mutex_lock(&poolMutex);
+  lane = &poolLanes[priority];
+  if (lane->tail != NULL) {
+    lane->tail->next = job;
+  }
+  else {
+    lane->head = job;
+  }
+  lane->tail = job;
+  lane->queued++;
+  uv_cond_signal(&poolCond);
+  uv_mutex_unlock(&poolMutex);
+}
+
+// Takes the jobs of a cancel token that haven't started yet off the queue.
+// They are completed on the main thread instead, where they fail without
+// doing any work.
+NAN_METHOD(CancelQueued) {
+  volatile int32_t* cancelled;
+  njt_pool_job* job;
+  njt_pool_job* prev;
+  njt_pool_job* next;
+  njt_pool_lane* lane;
+  bool dropped = false;
+  uint32_t i;
+
+  if (info.Length() < 1 || !Buffer::HasInstance(info[0])) {
+    return ThrowError(TypeError("Invalid cancelToken"));
+  }
+  cancelled = (volatile int32_t*) Buffer::Data(info[0]);
+
+  for (job = uvJobs; job != NULL; job = job->next) {
+    if (job->cancelled == cancelled) {
+      uv_cancel((uv_req_t*) &job->request);
+    }
+  }
+
+  if (!poolStarted) {
+    return;
+  }
+
+  uv_mutex_lock(&poolMutex);
+  for (i = 0; i < NJT_PRIORITY_LANES; i++) {
+    lane = &poolLanes[i];
+    prev = NULL;
+    for (job = lane->head; job != NULL; job = next) {
+      next = job->next;
+      if (job->cancelled != cancelled) {
+        prev = job;
+        continue;
+      }
+
+      if (prev != NULL) {
+        prev->next = next;
+      }
+      else {
+        lane->head = next;
+      }
+      if (lane->tail == job) {
+        lane->tail = prev;
+      }
+      lane->queued--;
+
+      job->dropped = true;
+      job->next = poolDone;
+      poolDone = job;
+      dropped = true;
+    }
+  }
+  uv_mutex_unlock(&poolMutex);
+
+  if (dropped) {
+    uv_async_send(&poolAsync);
+  }
+}
+
+NAN_METHOD(ConfigurePool) {
+  int retval = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+
+  Local<Object> options;
+  Local<Value> threadsObject;
+  uint32_t threads = 0;
+  Local<Value> queueSizeObject;
+
+  // Options are optional
+  if (info.Length() > 0 && !info[0]->IsUndefined()) {
+    options = info[0].As<Object>();
+    if (!options->IsObject()) {
+      _throw("Options must be an Object");
+    }
+
+    // Threads
+    threadsObject = options->Get(New("threads").ToLocalChecked());
+    if (!threadsObject->IsUndefined()) {
+      if (!threadsObject->IsUint32() || threadsObject->Uint32Value() == 0) {
+        _throw("Invalid threads value");
+      }
+      threads = threadsObject->Uint32Value();
+    }
+
+    // Queue size
+    queueSizeObject = options->Get(New("queueSize").ToLocalChecked());
+    if (!queueSizeObject->IsUndefined()) {
+      if (!queueSizeObject->IsUint32() || queueSizeObject->Uint32Value() == 0) {
+        _throw("Invalid queueSize value");
+      }
+      if (poolStarted) {
+        uv_mutex_lock(&poolMutex);
+      }
+      poolQueueSize = queueSizeObject->Uint32Value();
+      if (poolStarted) {
+        uv_mutex_unlock(&poolMutex);
+      }
+    }
+  }
+
+  // Default to one thread per core
+  if (threads == 0) {
+    if (poolStarted) {
+      return;
+    }
+    threads = njtCpuCount();
+  }
+
+  if (poolStarted && threads < poolThreads) {
+    _throw("Pool threads cannot be reduced");
+  }
+
+  retval = startPool(threads, errStr);
+
+  bailout:
+  if (retval != 0) {
+    ThrowError(TypeError(errStr));
+    return;
+  }
+}
+
+static Local<Object> laneStats(njt_pool_lane* lane) {
+  Local<Object> obj = New<Object>();
+
+  obj->Set(New("queued").ToLocalChecked(), New(lane->queued));
+  obj->Set(New("running").ToLocalChecked(), New(lane->running));
+  obj->Set(New("completed").ToLocalChecked(), New(lane->completed));
+  obj->Set(New("waitTime").ToLocalChecked(), New(lane->waitTime / 1e6));
+  obj->Set(New("maxWaitTime").ToLocalChecked(), New(lane->maxWaitTime / 1e6));
+  obj->Set(New("execTime").ToLocalChecked(), New(lane->execTime / 1e6));
+
+  return obj;
+}
+
+NAN_METHOD(PoolStats) {
+  Local<Object> obj = New<Object>();
+  njt_pool_lane lanes[NJT_PRIORITY_LANES];
+  uint32_t threads;
+  uint32_t queueSize;
+
+  if (poolStarted) {
+    uv_mutex_lock(&poolMutex);
+  }
+  memcpy(lanes, poolLanes, sizeof(lanes));
+  threads = poolThreads;
+  queueSize = poolQueueSize;
+  if (poolStarted) {
+    uv_mutex_unlock(&poolMutex);
+  }
+
+  obj->Set(New("threads").ToLocalChecked(), New(threads));
+  obj->Set(New("queueSize").ToLocalChecked(), New(queueSize));
+  obj->Set(New("queued").ToLocalChecked(), New(lanes[PRIORITY_INTERACTIVE].queued + lanes[PRIORITY_BULK].queued));
+  obj->Set(New("interactive").ToLocalChecked(), laneStats(&lanes[PRIORITY_INTERACTIVE]));
+  obj->Set(New("bulk").ToLocalChecked(), laneStats(&lanes[PRIORITY_BULK]));
+
+  info.GetReturnValue().Set(obj);
+}
@@ -0,0 +1,299 @@
+#include "exports.h"
+#include "libjpeg.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+int recompress(unsigned char* srcData, uint32_t srcLength, njt_compress_options* options, unsigned long* jpegSize, unsigned char** dstData, uint32_t dstBufferLength, char* errStr) {
+  if (options->cancelled != NULL && *options->cancelled) {
+    snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Aborted");
+    return -1;
+  }
+
+  if (dstBufferLength > 0) {
+    *jpegSize = dstBufferLength;
+  }
+
+  return njtRecompress(srcData, srcLength, options, dstData, jpegSize, dstBufferLength > 0, errStr);
+}
+
+int recompressParseOptions(Local<Object> options, njt_compress_options* opts, char* errStr) {
+  int retval = 0;
+  Local<Value> qualityObject;
+  Local<Value> optimizeObject;
+  Local<Value> progressiveObject;
+  Local<Value> restartIntervalObject;
+  Local<Value> restartRowsObject;
+
+  memset(opts, 0, sizeof(njt_compress_options));
+  opts->quality = NJT_DEFAULT_QUALITY;
+
+  // Quality, only ever lowered
+  qualityObject = options->Get(New("quality").ToLocalChecked());
+  if (!qualityObject->IsUndefined()) {
+    if (!qualityObject->IsUint32() || qualityObject->Uint32Value() < 1 || qualityObject->Uint32Value() > 100) {
+      _throw("Invalid quality value");
+    }
+    opts->quality = qualityObject->Uint32Value();
+  }
+
+  // Optimized Huffman tables
+  optimizeObject = options->Get(New("optimize").ToLocalChecked());
+  if (!optimizeObject->IsUndefined()) {
+    if (!optimizeObject->IsBoolean()) {
+      _throw("Invalid optimize value");
+    }
+    opts->optimize = optimizeObject->IsTrue();
+  }
+
+  // Progressive output
+  progressiveObject = options->Get(New("progressive").ToLocalChecked());
+  if (!progressiveObject->IsUndefined()) {
+    if (!progressiveObject->IsBoolean()) {
+      _throw("Invalid progressive value");
+    }
+    opts->progressive = progressiveObject->IsTrue();
+  }
+
+  // Restart markers every so many MCUs
+  restartIntervalObject = options->Get(New("restartInterval").ToLocalChecked());
+  if (!restartIntervalObject->IsUndefined()) {
+    if (!restartIntervalObject->IsUint32() || restartIntervalObject->Uint32Value() > 65535) {
+      _throw("Invalid restartInterval value");
+    }
+    opts->restartInterval = restartIntervalObject->Uint32Value();
+  }
+
+  // Restart markers every so many MCU rows
+  restartRowsObject = options->Get(New("restartRows").ToLocalChecked());
+  if (!restartRowsObject->IsUndefined()) {
+    if (!restartRowsObject->IsUint32() || restartRowsObject->Uint32Value() > 65535) {
+      _throw("Invalid restartRows value");
+    }
+    opts->restartRows = restartRowsObject->Uint32Value();
+  }
+
+  bailout:
+  return retval;
+}
+
+class RecompressWorker : public AsyncWorker {
+  public:
+    RecompressWorker(Callback *callback, Local<Object> &srcObject, unsigned char* srcData, uint32_t srcLength, njt_compress_options* options, Local<Object> &dstObject, unsigned char* dstData, uint32_t dstBufferLength, Local<Object> &tokenObject) :
+      AsyncWorker(callback),
+      srcData(srcData),
+      srcLength(srcLength),
+      options(*options),
+      jpegSize(0),
+      dstData(dstData),
+      dstBufferLength(dstBufferLength) {
+        SaveToPersistent("srcObject", srcObject);
+        if (dstBufferLength > 0) {
+          SaveToPersistent("dstObject", dstObject);
+        }
+        if (options->cancelled != NULL) {
+          SaveToPersistent("tokenObject", tokenObject);
+        }
+      }
+
+    ~RecompressWorker() {
+      if (this->dstBufferLength == 0 && this->dstData != NULL) {
+        tjFree(this->dstData);
+      }
+    }
+
+    void Execute () {
+      int err;
+
+      err = recompress(
+          this->srcData,
+          this->srcLength,
+          &this->options,
+          &this->jpegSize,
+          &this->dstData,
+          this->dstBufferLength,
+          this->errStr);
+
+      if(err != 0) {
+        SetErrorMessage(this->errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      Local<Object> obj = New<Object>();
+      Local<Object> dstObject;
+
+      if (this->dstBufferLength > 0) {
+        dstObject = GetFromPersistent("dstObject").As<Object>();
+      }
+      else {
+        dstObject = NewBuffer((char*)this->dstData, this->jpegSize, compressBufferFreeCallback, NULL).ToLocalChecked();
+        this->dstData = NULL;
+      }
+
+      obj->Set(New("data").ToLocalChecked(), dstObject);
+      obj->Set(New("size").ToLocalChecked(), New((uint32_t) this->jpegSize));
+
+      Local<Value> argv[] = {
+        Null(),
+        obj
+      };
+
+      callback->Call(2, argv);
+    }
+
+  private:
+    unsigned char* srcData;
+    uint32_t srcLength;
+    njt_compress_options options;
+
+    unsigned long jpegSize;
+    unsigned char* dstData;
+    uint32_t dstBufferLength;
+    char errStr[NJT_MSG_LENGTH_MAX];
+};
+
+void recompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+  int retval = 0;
+  int cursor = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+
+  // Input
+  Callback *callback = NULL;
+  Local<Object> srcObject;
+  unsigned char* srcData = NULL;
+  uint32_t srcLength = 0;
+  Local<Object> options;
+  Local<Object> tokenObject;
+  njt_compress_options opts;
+  uint32_t priority = PRIORITY_INTERACTIVE;
+
+  // Output
+  Local<Object> dstObject;
+  uint32_t dstBufferLength = 0;
+  unsigned char* dstData = NULL;
+  unsigned long jpegSize = 0;
+
+  // Try to find callback here, so if we want to throw something we can use callback's err
+  if (async) {
+    if (info[info.Length() - 1]->IsFunction()) {
+      callback = new Callback(info[info.Length() - 1].As<Function>());
+    }
+    else {
+      _throw("Missing callback");
+    }
+  }
+
+  if ((async && info.Length() < 2) || (!async && info.Length() < 1)) {
+    _throw("Too few arguments");
+  }
+
+  // Input buffer
+  srcObject = info[cursor++].As<Object>();
+  if (!Buffer::HasInstance(srcObject)) {
+    _throw("Invalid source buffer");
+  }
+
+  srcData = (unsigned char*) Buffer::Data(srcObject);
+  srcLength = Buffer::Length(srcObject);
+
+  // Output buffer, optional
+  if (info.Length() > cursor && Buffer::HasInstance(info[cursor])) {
+    dstObject = info[cursor++].As<Object>();
+    dstData = (unsigned char*) Buffer::Data(dstObject);
+    dstBufferLength = Buffer::Length(dstObject);
+
+    if (dstBufferLength == 0) {
+      _throw("Insufficient output buffer");
+    }
+  }
+
+  // Options, optional as all defaults are fine
+  options = New<Object>();
+  if (info.Length() > cursor && !info[cursor]->IsFunction() && !info[cursor]->IsUndefined()) {
+    options = info[cursor++].As<Object>();
+  }
+
+  if (!options->IsObject()) {
+    _throw("Options must be an object");
+  }
+
+  if (recompressParseOptions(options, &opts, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  if (njtParsePriority(options, &priority, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  if (njtParseCancelToken(options, &tokenObject, &opts.cancelled, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // Do either async or sync recompress
+  if (async) {
+    if (njtPoolFull()) {
+      _throw("Queue is full");
+    }
+    njtQueueWorker(new RecompressWorker(callback, srcObject, srcData, srcLength, &opts, dstObject, dstData, dstBufferLength, tokenObject), priority, opts.cancelled);
+    return;
+  }
+  else {
+    retval = recompress(
+        srcData,
+        srcLength,
+        &opts,
+        &jpegSize,
+        &dstData,
+        dstBufferLength,
+        errStr);
+
+    if(retval != 0) {
+      // recompress will set the errStr
+      goto bailout;
+    }
+
+    Local<Object> obj = New<Object>();
+
+    if (dstBufferLength == 0) {
+      dstObject = NewBuffer((char*)dstData, jpegSize, compressBufferFreeCallback, NULL).ToLocalChecked();
+      dstData = NULL;
+    }
+
+    obj->Set(New("data").ToLocalChecked(), dstObject);
+    obj->Set(New("size").ToLocalChecked(), New((uint32_t) jpegSize));
+    info.GetReturnValue().Set(obj);
+  }
+
+  // If we have error throw error or call callback with error
+  bailout:
+  if (dstBufferLength == 0 && dstData != NULL) {
+    tjFree(dstData);
+  }
+
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+NAN_METHOD(RecompressSync) {
+  recompressParse(info, false);
+}
+
+NAN_METHOD(Recompress) {
+  recompressParse(info, true);
+}
@@ -0,0 +1,415 @@
+#include <string.h>
+
+#include "libjpeg.h"
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// Copies the coefficients that jpeg_read_coefficients() left in the virtual
+// arrays, so that the arrays themselves can be requantized over and over
+// again. Blocks are stored component by component, row by row.
+static JCOEF* saveCoefficients(j_decompress_ptr srcinfo, jvirt_barray_ptr* coefArrays) {
+  jpeg_component_info* compptr;
+  JBLOCKARRAY rows;
+  JCOEF* saved;
+  JCOEF* cursor;
+  size_t blocks = 0;
+  JDIMENSION row;
+  int ci;
+
+  for (ci = 0; ci < srcinfo->num_components; ci++) {
+    compptr = &srcinfo->comp_info[ci];
+    blocks += (size_t) compptr->width_in_blocks * compptr->height_in_blocks;
+  }
+
+  saved = (JCOEF*) malloc(blocks * sizeof(JBLOCK));
+  if (saved == NULL) {
+    return NULL;
+  }
+
+  cursor = saved;
+  for (ci = 0; ci < srcinfo->num_components; ci++) {
+    compptr = &srcinfo->comp_info[ci];
+    for (row = 0; row < compptr->height_in_blocks; row++) {
+      rows = (*srcinfo->mem->access_virt_barray)((j_common_ptr) srcinfo, coefArrays[ci], row, 1, FALSE);
+      memcpy(cursor, rows[0], compptr->width_in_blocks * sizeof(JBLOCK));
+      cursor += compptr->width_in_blocks * DCTSIZE2;
+    }
+  }
+
+  return saved;
+}
+
+// A finer table than the one the coefficients were quantized with would
+// only spend bytes on precision that's already gone.
+static void coarsenTables(j_compress_ptr cinfo, j_decompress_ptr srcinfo) {
+  JQUANT_TBL* table;
+  JQUANT_TBL* original;
+  int ci;
+  int k;
+
+  for (ci = 0; ci < cinfo->num_components; ci++) {
+    table = cinfo->quant_tbl_ptrs[cinfo->comp_info[ci].quant_tbl_no];
+    original = srcinfo->comp_info[ci].quant_table;
+    if (table == NULL || original == NULL) {
+      continue;
+    }
+    for (k = 0; k < DCTSIZE2; k++) {
+      if (table->quantval[k] < original->quantval[k]) {
+        table->quantval[k] = original->quantval[k];
+      }
+    }
+  }
+}
+
+// Rescales the saved coefficients from the source tables to the tables of
+// cinfo, rounding to nearest, and writes them into the virtual arrays.
+// Without saved coefficients the arrays are requantized in place.
+static void requantize(j_compress_ptr cinfo, j_decompress_ptr srcinfo, jvirt_barray_ptr* coefArrays, JCOEF* saved) {
+  jpeg_component_info* compptr;
+  UINT16* from;
+  UINT16* to;
+  JBLOCKARRAY rows;
+  JCOEF* cursor = saved;
+  JCOEF* source;
+  JCOEF* block;
+  JDIMENSION row;
+  JDIMENSION col;
+  long value;
+  long divisor;
+  int ci;
+  int k;
+
+  for (ci = 0; ci < srcinfo->num_components; ci++) {
+    compptr = &srcinfo->comp_info[ci];
+    from = srcinfo->comp_info[ci].quant_table->quantval;
+    to = cinfo->quant_tbl_ptrs[cinfo->comp_info[ci].quant_tbl_no]->quantval;
+
+    for (row = 0; row < compptr->height_in_blocks; row++) {
+      rows = (*cinfo->mem->access_virt_barray)((j_common_ptr) cinfo, coefArrays[ci], row, 1, TRUE);
+      for (col = 0; col < compptr->width_in_blocks; col++) {
+        block = rows[0][col];
+        source = saved != NULL ? cursor : block;
+        for (k = 0; k < DCTSIZE2; k++) {
+          value = (long) source[k] * from[k];
+          divisor = to[k];
+          block[k] = (JCOEF) (value >= 0 ? (value + divisor / 2) / divisor : -((-value + divisor / 2) / divisor));
+        }
+        if (saved != NULL) {
+          cursor += DCTSIZE2;
+        }
+      }
+    }
+  }
+}
+
+// Sets up cinfo to write the coefficients of srcinfo at the given quality,
+// honoring the optimize, progressive and restart options.
+static void setCoefficientOptions(j_compress_ptr cinfo, j_decompress_ptr srcinfo, int quality, njt_compress_options* options) {
+  jpeg_copy_critical_parameters(srcinfo, cinfo);
+  jpeg_set_quality(cinfo, quality, TRUE);
+  coarsenTables(cinfo, srcinfo);
+
+  cinfo->optimize_coding = options->optimize ? TRUE : FALSE;
+
+  if (options->restartRows > 0) {
+    cinfo->restart_in_rows = options->restartRows;
+  }
+  else {
+    cinfo->restart_interval = options->restartInterval;
+  }
+
+  if (options->progressive) {
+    jpeg_simple_progression(cinfo);
+  }
+}
+
+// Writes the saved coefficients as a JPEG of the given quality, honoring
+// the optimize, progressive and restart options. Only quantization and
+// entropy coding happen here. *buffer holds *capacity bytes and is
+// replaced if it turns out to be too small, even if encoding then fails;
+// *length is set to the size of the output.
+static int encodeCoefficients(j_decompress_ptr srcinfo, jvirt_barray_ptr* coefArrays, JCOEF* saved, int quality, njt_compress_options* options, unsigned char** buffer, unsigned long* capacity, unsigned long* length, char* errStr) {
+  struct jpeg_compress_struct cinfo;
+  njt_growing_dest growing;
+  njt_error_mgr jerr;
+  unsigned char* old = *buffer;
+
+  cinfo.err = njtErrorMgr(&jerr);
+
+  if (setjmp(jerr.setjmpBuffer)) {
+    njtFormatError((j_common_ptr) &cinfo, errStr);
+    jpeg_destroy_compress(&cinfo);
+    if (*buffer != old) {
+      free(old);
+      *capacity = growing.size;
+    }
+    return -1;
+  }
+
+  jpeg_create_compress(&cinfo);
+  njtGrowingDest(&cinfo, &growing, buffer, *capacity);
+
+  setCoefficientOptions(&cinfo, srcinfo, quality, options);
+  requantize(&cinfo, srcinfo, coefArrays, saved);
+
+  jpeg_write_coefficients(&cinfo, coefArrays);
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  // The old buffer is still ours if it had to be replaced
+  if (*buffer != old) {
+    free(old);
+    *capacity = growing.size;
+  }
+  *length = growing.size - growing.pub.free_in_buffer;
+
+  return 0;
+}
+
+// Encodes at the highest quality up to options->quality whose output fits
+// in options->targetSize bytes, and sets options->quality to it. If not even
+// quality 1 fits, that's what you get.
+//
+// The image is encoded once at quality 100, which quantizes with all-ones
+// tables and so leaves just the rounded DCT coefficients. Every quality the
+// binary search tries then only requantizes those and entropy codes them
+// again; color conversion, downsampling and the DCT are never repeated.
+// *dstData follows the same rules as for njtCompressScanlines().
+int njtCompressTargetSize(unsigned char* srcData, njt_compress_options* options, unsigned char** dstData, unsigned long* jpegSize, bool fixed, char* errStr) {
+  int retval = 0;
+  int err;
+  tjhandle handle = NULL;
+  J_COLOR_SPACE colorSpace;
+  int bpp;
+  unsigned char* refData = NULL;
+  unsigned long refSize = 0;
+  struct jpeg_decompress_struct srcinfo;
+  njt_error_mgr jerr;
+  jvirt_barray_ptr* coefArrays;
+  JCOEF* volatile saved = NULL;
+  unsigned char* best = NULL;
+  unsigned long bestCapacity = 0;
+  unsigned long bestLength = 0;
+  int bestQuality = 0;
+  unsigned char* trial = NULL;
+  unsigned long trialCapacity = 0;
+  unsigned long trialLength = 0;
+  unsigned char* swapData;
+  unsigned long swapCapacity;
+  int low = 1;
+  int high = options->quality > 0 ? options->quality : 1;
+  int quality = high;
+  unsigned char* out;
+
+  // Destroying a decompressor that was never created is a no-op
+  memset(&srcinfo, 0, sizeof(srcinfo));
+
+  if (njtColorSpace(options->format, &colorSpace, &bpp) != 0) {
+    _throw("Invalid input format");
+  }
+
+  handle = njtAcquireHandle(NJT_HANDLE_COMPRESS);
+  if (handle == NULL) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  err = tjCompress2(handle, srcData, options->width, options->stride * bpp, options->height, options->format, &refData, &refSize, options->jpegSubsamp, 100, options->accurateDct ? TJFLAG_ACCURATEDCT : TJFLAG_FASTDCT);
+
+  if (err != 0) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  njtReleaseHandle(NJT_HANDLE_COMPRESS, handle);
+  handle = NULL;
+
+  srcinfo.err = njtErrorMgr(&jerr);
+
+  if (setjmp(jerr.setjmpBuffer)) {
+    njtFormatError((j_common_ptr) &srcinfo, errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  jpeg_create_decompress(&srcinfo);
+  jpeg_mem_src(&srcinfo, refData, refSize);
+  jpeg_read_header(&srcinfo, TRUE);
+  coefArrays = jpeg_read_coefficients(&srcinfo);
+
+  saved = saveCoefficients(&srcinfo, coefArrays);
+  if (saved == NULL) {
+    _throw("Unable to allocate coefficients");
+  }
+
+  // Lower qualities are hardly ever larger than the reference
+  trial = (unsigned char*) malloc(refSize);
+  if (trial == NULL) {
+    _throw("Unable to allocate output buffer");
+  }
+  trialCapacity = refSize;
+
+  // Most images fit right away at the requested quality
+  while (low <= high) {
+    if (options->cancelled != NULL && *options->cancelled) {
+      _throw("Aborted");
+    }
+
+    if (encodeCoefficients(&srcinfo, coefArrays, saved, quality, options, &trial, &trialCapacity, &trialLength, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+
+    if (trialLength <= options->targetSize || quality == 1) {
+      swapData = best;
+      swapCapacity = bestCapacity;
+      best = trial;
+      bestCapacity = trialCapacity;
+      bestLength = trialLength;
+      bestQuality = quality;
+      trial = swapData;
+      trialCapacity = swapCapacity;
+    }
+
+    if (trialLength <= options->targetSize) {
+      low = quality + 1;
+    }
+    else {
+      high = quality - 1;
+    }
+    quality = low + (high - low) / 2;
+  }
+
+  if (fixed) {
+    if (bestLength > *jpegSize) {
+      _throw("Buffer passed to JPEG library is too small");
+    }
+    out = *dstData;
+  }
+  else if (*dstData != NULL && *jpegSize >= bestLength) {
+    out = *dstData;
+  }
+  else {
+    // Like jpeg_mem_dest(), a buffer that's too small is left for the
+    // caller to deal with
+    out = tjAlloc(bestLength);
+    if (out == NULL) {
+      _throw("Unable to allocate output buffer");
+    }
+  }
+
+  memcpy(out, best, bestLength);
+  *dstData = out;
+  *jpegSize = bestLength;
+  options->quality = bestQuality;
+
+  bailout:
+  njtReleaseHandle(NJT_HANDLE_COMPRESS, handle);
+  jpeg_destroy_decompress(&srcinfo);
+  free(saved);
+  free(best);
+  free(trial);
+  if (refData != NULL) {
+    tjFree(refData);
+  }
+
+  return retval;
+}
+
+// Copies the APPn and COM markers saved from the source, except for the
+// JFIF and Adobe markers that libjpeg writes itself. Must be called right
+// after jpeg_write_coefficients().
+static void copyMarkers(j_compress_ptr cinfo, j_decompress_ptr srcinfo) {
+  jpeg_saved_marker_ptr marker;
+
+  for (marker = srcinfo->marker_list; marker != NULL; marker = marker->next) {
+    if (cinfo->write_JFIF_header && marker->marker == JPEG_APP0 &&
+        marker->data_length >= 5 && memcmp(marker->data, "JFIF", 5) == 0) {
+      continue;
+    }
+    if (cinfo->write_Adobe_marker && marker->marker == JPEG_APP0 + 14 &&
+        marker->data_length >= 5 && memcmp(marker->data, "Adobe", 5) == 0) {
+      continue;
+    }
+    jpeg_write_marker(cinfo, marker->marker, marker->data, marker->data_length);
+  }
+}
+
+// Lowers the quality of a JPEG without decoding it. The coefficients are
+// read as they are, requantized to the tables of options->quality (but
+// never to finer ones than the source had) and written back, optionally
+// with optimized Huffman tables, as progressive or with restart markers.
+// There's no IDCT, upsampling or color conversion, and no forward DCT.
+// Metadata is kept. If fixed is set, *dstData must hold *jpegSize bytes,
+// otherwise a new buffer is allocated, which is left in *dstData for the
+// caller to free even if this fails.
+int njtRecompress(unsigned char* srcData, uint32_t srcLength, njt_compress_options* options, unsigned char** dstData, unsigned long* jpegSize, bool fixed, char* errStr) {
+  struct jpeg_decompress_struct srcinfo;
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_destination_mgr dest;
+  njt_growing_dest growing;
+  njt_error_mgr jerr;
+  njt_progress_mgr progress;
+  jvirt_barray_ptr* coefArrays;
+  int m;
+
+  // Destroying either one before it was created is a no-op
+  memset(&srcinfo, 0, sizeof(srcinfo));
+  memset(&cinfo, 0, sizeof(cinfo));
+
+  srcinfo.err = njtErrorMgr(&jerr);
+  cinfo.err = &jerr.pub;
+
+  if (setjmp(jerr.setjmpBuffer)) {
+    njtFormatError((j_common_ptr) &srcinfo, errStr);
+    if (options->cancelled != NULL && *options->cancelled) {
+      snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Aborted");
+    }
+    jpeg_destroy_compress(&cinfo);
+    jpeg_destroy_decompress(&srcinfo);
+    return -1;
+  }
+
+  jpeg_create_decompress(&srcinfo);
+  jpeg_create_compress(&cinfo);
+
+  if (options->cancelled != NULL) {
+    njtInitProgress(&progress, options->cancelled);
+    srcinfo.progress = &progress.pub;
+    cinfo.progress = &progress.pub;
+  }
+
+  jpeg_save_markers(&srcinfo, JPEG_COM, 0xFFFF);
+  for (m = 0; m < 16; m++) {
+    jpeg_save_markers(&srcinfo, JPEG_APP0 + m, 0xFFFF);
+  }
+
+  jpeg_mem_src(&srcinfo, srcData, srcLength);
+  jpeg_read_header(&srcinfo, TRUE);
+  coefArrays = jpeg_read_coefficients(&srcinfo);
+
+  if (fixed) {
+    njtFixedDest(&cinfo, &dest, *dstData, *jpegSize);
+  }
+  else {
+    // Lowering the quality rarely makes the image any bigger
+    njtGrowingDest(&cinfo, &growing, dstData, srcLength + NJT_SCRATCH_SLACK);
+  }
+
+  setCoefficientOptions(&cinfo, &srcinfo, options->quality, options);
+  requantize(&cinfo, &srcinfo, coefArrays, NULL);
+
+  jpeg_write_coefficients(&cinfo, coefArrays);
+  copyMarkers(&cinfo, &srcinfo);
+  jpeg_finish_compress(&cinfo);
+
+  if (fixed) {
+    *jpegSize = *jpegSize - dest.free_in_buffer;
+  }
+  else {
+    *jpegSize = growing.size - growing.pub.free_in_buffer;
+  }
+
+  jpeg_destroy_compress(&cinfo);
+  jpeg_destroy_decompress(&srcinfo);
+
+  return 0;
+}
@@ -0,0 +1,672 @@
+#include "libjpeg.h"
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// What we need to know about a sequential JPEG to cut it into bands.
+typedef struct {
+  uint32_t width;
+  uint32_t height;
+  uint32_t mcuWidth;
+  uint32_t mcuHeight;
+  uint32_t interval;
+  uint32_t segmentRows;
+  uint32_t segments;
+  uint32_t sofHeightOffset;
+  uint32_t sosOffset;
+  uint32_t headerLength;
+} njt_restart_info;
+
+typedef struct {
+  unsigned char* data;
+  unsigned long length;
+  uint32_t y;
+  uint32_t height;
+  // Rows of context above y when decoding
+  uint32_t skip;
+  int retval;
+  char errStr[NJT_MSG_LENGTH_MAX];
+} njt_restart_band;
+
+typedef struct {
+  njt_restart_band* bands;
+  unsigned char* dstData;
+  uint32_t pitch;
+  int format;
+  int flags;
+  tjscalingfactor factor;
+  volatile int32_t* cancelled;
+} njt_restart_job;
+
+typedef struct {
+  unsigned char* srcData;
+  njt_compress_options* options;
+  int bpp;
+  uint32_t bandHeight;
+  njt_restart_band* bands;
+} njt_restart_encode_job;
+
+// Only single scan Huffman coded images qualify. Everything up to and
+// including the SOS segment is shared by all bands.
+static bool parseHeader(unsigned char* srcData, uint32_t srcLength, njt_restart_info* info) {
+  uint32_t pos = 2;
+  uint32_t segmentLength;
+  uint32_t components = 0;
+  uint32_t hmax = 1;
+  uint32_t vmax = 1;
+  uint32_t i;
+  unsigned char marker;
+  unsigned char* segment;
+
+  memset(info, 0, sizeof(njt_restart_info));
+
+  if (srcLength < 4 || srcData[0] != 0xFF || srcData[1] != 0xD8) {
+    return false;
+  }
+
+  while (pos + 4 <= srcLength) {
+    if (srcData[pos] != 0xFF) {
+      return false;
+    }
+
+    marker = srcData[pos + 1];
+    if (marker == 0xFF) {
+      pos++;
+      continue;
+    }
+
+    segmentLength = (srcData[pos + 2] << 8) | srcData[pos + 3];
+    if (segmentLength < 2 || pos + 2 + segmentLength > srcLength) {
+      return false;
+    }
+    segment = srcData + pos + 4;
+
+    switch (marker) {
+      // Baseline and extended sequential, Huffman coded
+      case 0xC0:
+      case 0xC1:
+        if (segmentLength < 8) {
+          return false;
+        }
+        info->height = (segment[1] << 8) | segment[2];
+        info->width = (segment[3] << 8) | segment[4];
+        components = segment[5];
+        if (components == 0 || segmentLength < 8 + 3 * components) {
+          return false;
+        }
+        for (i = 0; i < components; i++) {
+          if ((uint32_t) (segment[7 + 3 * i] >> 4) > hmax) {
+            hmax = segment[7 + 3 * i] >> 4;
+          }
+          if ((uint32_t) (segment[7 + 3 * i] & 15) > vmax) {
+            vmax = segment[7 + 3 * i] & 15;
+          }
+        }
+        info->sofHeightOffset = pos + 5;
+        break;
+
+      // Progressive, lossless, arithmetic coded and hierarchical
+      case 0xC2:
+      case 0xC3:
+      case 0xC5:
+      case 0xC6:
+      case 0xC7:
+      case 0xC9:
+      case 0xCA:
+      case 0xCB:
+      case 0xCD:
+      case 0xCE:
+      case 0xCF:
+        return false;
+
+      case 0xDD:
+        if (segmentLength < 4) {
+          return false;
+        }
+        info->interval = (segment[0] << 8) | segment[1];
+        break;
+
+      case 0xDA:
+        // The scan must cover every component
+        if (components == 0 || segment[0] != components) {
+          return false;
+        }
+        info->sosOffset = pos;
+        info->headerLength = pos + 2 + segmentLength;
+
+        // Non-interleaved scans use single blocks as MCUs
+        if (components == 1) {
+          info->mcuWidth = 8;
+          info->mcuHeight = 8;
+        }
+        else {
+          info->mcuWidth = 8 * hmax;
+          info->mcuHeight = 8 * vmax;
+        }
+
+        // A zero height would come from a DNL marker after the scan
+        return info->width > 0 && info->height > 0;
+    }
+
+    pos += 2 + segmentLength;
+  }
+
+  return false;
+}
+
+// Finds where each restart interval starts and ends. Ends point at the
+// RSTn (or EOI) marker that follows the interval.
+static bool findSegments(unsigned char* srcData, uint32_t srcLength, njt_restart_info* info, uint32_t* starts, uint32_t* ends, uint32_t count) {
+  uint32_t pos = info->headerLength;
+  uint32_t found = 0;
+  unsigned char marker;
+
+  starts[0] = pos;
+
+  while (pos + 1 < srcLength) {
+    if (srcData[pos] != 0xFF) {
+      pos++;
+      continue;
+    }
+
+    marker = srcData[pos + 1];
+
+    // Stuffed zero or fill byte
+    if (marker == 0x00) {
+      pos += 2;
+      continue;
+    }
+    if (marker == 0xFF) {
+      pos++;
+      continue;
+    }
+
+    if (marker >= 0xD0 && marker <= 0xD7) {
+      if (found + 1 >= count) {
+        return false;
+      }
+      ends[found++] = pos;
+      starts[found] = pos + 2;
+      pos += 2;
+      continue;
+    }
+
+    if (marker == 0xD9) {
+      ends[found++] = pos;
+      return found == count;
+    }
+
+    // Anything else (e.g. DNL) means we'd better not touch it
+    return false;
+  }
+
+  return false;
+}
+
+// Finds the restart intervals of an image whose intervals consist of whole
+// rows of MCUs. Returns false if there are no such intervals.
+static bool findIntervals(unsigned char* srcData, uint32_t srcLength, njt_restart_info* info, uint32_t** starts, uint32_t** ends) {
+  uint32_t mcusPerRow;
+  uint32_t mcuRows;
+
+  *starts = NULL;
+  *ends = NULL;
+
+  if (!parseHeader(srcData, srcLength, info) || info->interval == 0) {
+    return false;
+  }
+
+  mcusPerRow = (info->width + info->mcuWidth - 1) / info->mcuWidth;
+  mcuRows = (info->height + info->mcuHeight - 1) / info->mcuHeight;
+
+  if (info->interval % mcusPerRow != 0) {
+    return false;
+  }
+
+  info->segmentRows = info->interval / mcusPerRow;
+  info->segments = (mcuRows + info->segmentRows - 1) / info->segmentRows;
+  if (info->segments < 2) {
+    return false;
+  }
+
+  *starts = (uint32_t*) malloc(info->segments * sizeof(uint32_t));
+  *ends = (uint32_t*) malloc(info->segments * sizeof(uint32_t));
+
+  if (*starts == NULL || *ends == NULL || !findSegments(srcData, srcLength, info, *starts, *ends, info->segments)) {
+    free(*starts);
+    free(*ends);
+    *starts = NULL;
+    *ends = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+// Makes a JPEG of its own out of intervals first to last, which starts at
+// row band->y of the original image.
+static bool cutBand(unsigned char* srcData, njt_restart_info* info, uint32_t* starts, uint32_t* ends, uint32_t first, uint32_t last, njt_restart_band* band) {
+  uint32_t j;
+  uint32_t offset;
+
+  band->y = first * info->segmentRows * info->mcuHeight;
+  band->height = (last - first + 1) * info->segmentRows * info->mcuHeight;
+  if (band->y + band->height > info->height) {
+    band->height = info->height - band->y;
+  }
+
+  // Shared header, the intervals and EOI
+  band->length = info->headerLength + ends[last] - starts[first] + 2;
+  band->data = (unsigned char*) malloc(band->length);
+  if (band->data == NULL) {
+    return false;
+  }
+
+  memcpy(band->data, srcData, info->headerLength);
+  memcpy(band->data + info->headerLength, srcData + starts[first], ends[last] - starts[first]);
+  band->data[band->length - 2] = 0xFF;
+  band->data[band->length - 1] = 0xD9;
+
+  band->data[info->sofHeightOffset] = band->height >> 8;
+  band->data[info->sofHeightOffset + 1] = band->height & 0xFF;
+
+  // The decoder expects RST0 to come first
+  for (j = first; j < last; j++) {
+    offset = info->headerLength + ends[j] - starts[first];
+    band->data[offset + 1] = 0xD0 + (j - first) % 8;
+  }
+
+  return true;
+}
+
+// Decodes a band straight into its rows of the output. The band may start
+// and end with an extra interval that only provides context for fancy
+// upsampling; those rows are decoded but not stored. This goes through
+// libjpeg directly with the same settings tjDecompress2() would use, since
+// TurboJPEG can only decode whole images.
+static void decodeBand(uint32_t index, void* data) {
+  njt_restart_job* job = (njt_restart_job*) data;
+  njt_restart_band* band = &job->bands[index];
+  struct jpeg_decompress_struct dinfo;
+  njt_error_mgr jerr;
+  njt_progress_mgr progress;
+  J_COLOR_SPACE colorSpace;
+  int bpp;
+  JSAMPARRAY buffer;
+  JSAMPROW row;
+  uint32_t y = TJSCALED(band->y, job->factor);
+  uint32_t skip = TJSCALED(band->skip, job->factor);
+  uint32_t last = skip + TJSCALED(band->height, job->factor);
+
+  if (job->cancelled != NULL && *job->cancelled) {
+    snprintf(band->errStr, NJT_MSG_LENGTH_MAX, "%s", "Aborted");
+    band->retval = -1;
+    return;
+  }
+
+  if (njtColorSpace(job->format, &colorSpace, &bpp) != 0) {
+    snprintf(band->errStr, NJT_MSG_LENGTH_MAX, "%s", "Invalid output format");
+    band->retval = -1;
+    return;
+  }
+
+  dinfo.err = njtErrorMgr(&jerr);
+
+  if (setjmp(jerr.setjmpBuffer)) {
+    njtFormatError((j_common_ptr) &dinfo, band->errStr);
+    if (job->cancelled != NULL && *job->cancelled) {
+      snprintf(band->errStr, NJT_MSG_LENGTH_MAX, "%s", "Aborted");
+    }
+    jpeg_destroy_decompress(&dinfo);
+    band->retval = -1;
+    return;
+  }
+
+  jpeg_create_decompress(&dinfo);
+  jpeg_mem_src(&dinfo, band->data, band->length);
+
+  if (job->cancelled != NULL) {
+    njtInitProgress(&progress, job->cancelled);
+    dinfo.progress = &progress.pub;
+  }
+
+  jpeg_read_header(&dinfo, TRUE);
+
+  dinfo.out_color_space = colorSpace;
+  dinfo.scale_num = job->factor.num;
+  dinfo.scale_denom = job->factor.denom;
+  dinfo.dct_method = (job->flags & TJFLAG_ACCURATEDCT) ? JDCT_ISLOW : JDCT_IFAST;
+  dinfo.do_fancy_upsampling = (job->flags & TJFLAG_FASTUPSAMPLE) ? FALSE : TRUE;
+
+  jpeg_start_decompress(&dinfo);
+
+  buffer = (*dinfo.mem->alloc_sarray)((j_common_ptr) &dinfo, JPOOL_IMAGE, dinfo.output_width * bpp, 1);
+
+  while (dinfo.output_scanline < last) {
+    if (dinfo.output_scanline < skip) {
+      row = buffer[0];
+    }
+    else {
+      row = job->dstData + (y + dinfo.output_scanline - skip) * job->pitch;
+    }
+    jpeg_read_scanlines(&dinfo, &row, 1);
+  }
+
+  // The rest is only there for context
+  jpeg_abort_decompress(&dinfo);
+  jpeg_destroy_decompress(&dinfo);
+
+  band->retval = 0;
+}
+
+// Restart intervals are independently decodable, so if they line up with
+// rows of MCUs, the image can be cut into bands of whole intervals, each of
+// which becomes a JPEG of its own writing to its own rows of the output.
+// The output is identical to that of tjDecompress2() with the same flags.
+// Sets *handled to false if the image doesn't qualify, in which case the
+// caller should decode it normally.
+int njtDecompressRestartBands(unsigned char* srcData, uint32_t srcLength, uint32_t threads, uint32_t priority, tjscalingfactor factor, int format, int flags, volatile int32_t* cancelled, unsigned char* dstData, uint32_t pitch, bool* handled, char* errStr) {
+  int retval = 0;
+  njt_restart_info info;
+  njt_restart_job job;
+  njt_restart_band* bands = NULL;
+  uint32_t* starts = NULL;
+  uint32_t* ends = NULL;
+  uint32_t bandCount = 0;
+  uint32_t segmentsPerBand;
+  uint32_t context;
+  uint32_t first;
+  uint32_t last;
+  uint32_t y;
+  uint32_t i;
+
+  *handled = false;
+
+  if (threads == 0) {
+    threads = njtCpuCount();
+  }
+
+  if (threads < 2 || !findIntervals(srcData, srcLength, &info, &starts, &ends)) {
+    return 0;
+  }
+
+  bandCount = threads < info.segments ? threads : info.segments;
+  segmentsPerBand = (info.segments + bandCount - 1) / bandCount;
+  bandCount = (info.segments + segmentsPerBand - 1) / segmentsPerBand;
+
+  bands = (njt_restart_band*) calloc(bandCount, sizeof(njt_restart_band));
+  if (bands == NULL) {
+    _throw("Unable to allocate bands");
+  }
+
+  // Fancy upsampling of vertically subsampled chroma looks at the rows
+  // next to each one, so bands need an interval of context on either side
+  // to come out exactly like a single-threaded decode
+  context = info.mcuHeight > 8 && !(flags & TJFLAG_FASTUPSAMPLE) ? 1 : 0;
+
+  for (i = 0; i < bandCount; i++) {
+    first = i * segmentsPerBand;
+    last = first + segmentsPerBand - 1;
+    if (last >= info.segments) {
+      last = info.segments - 1;
+    }
+
+    if (!cutBand(srcData, &info, starts, ends, first > context ? first - context : 0, last + context < info.segments ? last + context : info.segments - 1, &bands[i])) {
+      _throw("Unable to allocate bands");
+    }
+
+    // Only the rows of our own intervals are stored
+    y = first * info.segmentRows * info.mcuHeight;
+    bands[i].skip = y - bands[i].y;
+    bands[i].y = y;
+    bands[i].height = (last - first + 1) * info.segmentRows * info.mcuHeight;
+    if (y + bands[i].height > info.height) {
+      bands[i].height = info.height - y;
+    }
+  }
+
+  job.bands = bands;
+  job.dstData = dstData;
+  job.pitch = pitch;
+  job.format = format;
+  job.flags = flags;
+  job.factor = factor;
+  job.cancelled = cancelled;
+
+  njtParallelFor(bandCount, bandCount, priority, decodeBand, &job);
+
+  *handled = true;
+
+  for (i = 0; i < bandCount; i++) {
+    if (bands[i].retval != 0) {
+      snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", bands[i].errStr);
+      retval = -1;
+      break;
+    }
+  }
+
+  bailout:
+  if (bands != NULL) {
+    for (i = 0; i < bandCount; i++) {
+      free(bands[i].data);
+    }
+    free(bands);
+  }
+  free(starts);
+  free(ends);
+
+  return retval;
+}
+
+// Drops the restart intervals above row y, so that decoding a region near
+// the bottom of the image doesn't have to entropy decode everything above
+// it. One extra row of MCUs is kept so that fancy upsampling sees the same
+// context as it would in the full image. Leaves *subData NULL if the image
+// doesn't have suitable restart markers.
+void njtRestartSubimage(unsigned char* srcData, uint32_t srcLength, uint32_t y, unsigned char** subData, unsigned long* subLength, uint32_t* subY) {
+  njt_restart_info info;
+  njt_restart_band band;
+  uint32_t* starts;
+  uint32_t* ends;
+  uint32_t first;
+
+  *subData = NULL;
+  *subLength = 0;
+  *subY = 0;
+
+  if (!findIntervals(srcData, srcLength, &info, &starts, &ends)) {
+    return;
+  }
+
+  if (y >= info.mcuHeight) {
+    first = (y - info.mcuHeight) / (info.segmentRows * info.mcuHeight);
+
+    if (first > 0 && cutBand(srcData, &info, starts, ends, first, info.segments - 1, &band)) {
+      *subData = band.data;
+      *subLength = band.length;
+      *subY = band.y;
+    }
+  }
+
+  free(starts);
+  free(ends);
+}
+
+static void encodeBand(uint32_t index, void* data) {
+  njt_restart_encode_job* job = (njt_restart_encode_job*) data;
+  njt_restart_band* band = &job->bands[index];
+  njt_compress_options options = *job->options;
+
+  band->y = index * job->bandHeight;
+  band->height = options.height - band->y;
+  if (band->height > job->bandHeight) {
+    band->height = job->bandHeight;
+  }
+
+  options.height = band->height;
+  options.optimize = false;
+  options.progressive = false;
+  options.restartInterval = 0;
+  options.restartRows = 0;
+
+  band->retval = njtCompressScanlines(job->srcData + band->y * options.stride * job->bpp, &options, &band->data, &band->length, false, band->errStr);
+}
+
+// The reverse of the above: the image is cut into bands of whole MCU rows,
+// each encoded as a JPEG of its own on a separate thread. With the default
+// Huffman tables every band shares the same tables, so their entropy coded
+// data can simply be joined with RSTn markers in between, given a DRI that
+// makes each band exactly one restart interval. *dstData follows the same
+// rules as for njtCompressScanlines(). Sets *handled to false if the image
+// is too small to split, in which case the caller should encode it normally.
+int njtCompressRestartBands(unsigned char* srcData, njt_compress_options* options, unsigned char** dstData, unsigned long* jpegSize, bool fixed, bool* handled, char* errStr) {
+  int retval = 0;
+  njt_restart_encode_job job;
+  njt_restart_band* bands = NULL;
+  njt_restart_info info;
+  njt_restart_info bandInfo;
+  J_COLOR_SPACE colorSpace;
+  int bpp;
+  uint32_t threads = options->threads;
+  uint32_t mcuWidth;
+  uint32_t mcuHeight;
+  uint32_t mcusPerRow;
+  uint32_t mcuRows;
+  uint32_t bandRows;
+  uint32_t bandCount = 0;
+  uint32_t interval;
+  unsigned long length;
+  unsigned char* out;
+  uint32_t i;
+
+  *handled = false;
+
+  if (threads == 0) {
+    threads = njtCpuCount();
+  }
+
+  if (njtColorSpace(options->format, &colorSpace, &bpp) != 0) {
+    _throw("Invalid input format");
+  }
+
+  // Grayscale input is always encoded as grayscale, see njtSetSubsampling()
+  if (options->format == FORMAT_GRAY || options->jpegSubsamp == SAMP_GRAY) {
+    mcuWidth = 8;
+    mcuHeight = 8;
+  }
+  else {
+    mcuWidth = tjMCUWidth[options->jpegSubsamp];
+    mcuHeight = tjMCUHeight[options->jpegSubsamp];
+  }
+
+  mcusPerRow = (options->width + mcuWidth - 1) / mcuWidth;
+  mcuRows = (options->height + mcuHeight - 1) / mcuHeight;
+
+  if (threads < 2 || mcuRows < 2 || mcusPerRow > 65535) {
+    return 0;
+  }
+
+  // The restart interval can't exceed 65535 MCUs, so very wide images may
+  // need more bands than threads
+  bandRows = (mcuRows + threads - 1) / threads;
+  if (bandRows * mcusPerRow > 65535) {
+    bandRows = 65535 / mcusPerRow;
+  }
+  bandCount = (mcuRows + bandRows - 1) / bandRows;
+  interval = bandRows * mcusPerRow;
+
+  bands = (njt_restart_band*) calloc(bandCount, sizeof(njt_restart_band));
+  if (bands == NULL) {
+    _throw("Unable to allocate bands");
+  }
+
+  job.srcData = srcData;
+  job.options = options;
+  job.bpp = bpp;
+  job.bandHeight = bandRows * mcuHeight;
+  job.bands = bands;
+
+  njtParallelFor(bandCount, threads, options->priority, encodeBand, &job);
+
+  *handled = true;
+
+  for (i = 0; i < bandCount; i++) {
+    if (bands[i].retval != 0) {
+      snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", bands[i].errStr);
+      retval = -1;
+      goto bailout;
+    }
+  }
+
+  if (!parseHeader(bands[0].data, bands[0].length, &info)) {
+    _throw("Unable to join bands");
+  }
+
+  // Header, DRI, scans with RSTn markers in between and EOI
+  length = info.headerLength + 6;
+  for (i = 0; i < bandCount; i++) {
+    if (!parseHeader(bands[i].data, bands[i].length, &bandInfo) || bands[i].length < bandInfo.headerLength + 2) {
+      _throw("Unable to join bands");
+    }
+    bands[i].y = bandInfo.headerLength;
+    length += bands[i].length - bandInfo.headerLength;
+  }
+
+  if (fixed) {
+    if (length > *jpegSize) {
+      _throw("Buffer passed to JPEG library is too small");
+    }
+    out = *dstData;
+  }
+  else if (*dstData != NULL && *jpegSize >= length) {
+    out = *dstData;
+  }
+  else {
+    // Like jpeg_mem_dest(), a buffer that's too small is left for the
+    // caller to deal with
+    out = tjAlloc(length);
+    if (out == NULL) {
+      _throw("Unable to allocate output buffer");
+    }
+  }
+
+  memcpy(out, bands[0].data, info.sosOffset);
+  out[info.sofHeightOffset] = options->height >> 8;
+  out[info.sofHeightOffset + 1] = options->height & 0xFF;
+
+  *jpegSize = info.sosOffset;
+  out[(*jpegSize)++] = 0xFF;
+  out[(*jpegSize)++] = 0xDD;
+  out[(*jpegSize)++] = 0;
+  out[(*jpegSize)++] = 4;
+  out[(*jpegSize)++] = interval >> 8;
+  out[(*jpegSize)++] = interval & 0xFF;
+
+  memcpy(out + *jpegSize, bands[0].data + info.sosOffset, info.headerLength - info.sosOffset);
+  *jpegSize += info.headerLength - info.sosOffset;
+
+  for (i = 0; i < bandCount; i++) {
+    if (i > 0) {
+      out[(*jpegSize)++] = 0xFF;
+      out[(*jpegSize)++] = 0xD0 + (i - 1) % 8;
+    }
+
+    // Everything but the band's own EOI
+    memcpy(out + *jpegSize, bands[i].data + bands[i].y, bands[i].length - bands[i].y - 2);
+    *jpegSize += bands[i].length - bands[i].y - 2;
+  }
+
+  out[(*jpegSize)++] = 0xFF;
+  out[(*jpegSize)++] = 0xD9;
+
+  *dstData = out;
+
+  bailout:
+  if (bands != NULL) {
+    for (i = 0; i < bandCount; i++) {
+      free(bands[i].data);
+    }
+    free(bands);
+  }
+
+  return retval;
+}
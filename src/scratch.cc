@@ -0,0 +1,134 @@
+#include "exports.h"
+using namespace Nan;
+using namespace v8;
+
+// Scratch buffers for tight compression. Instead of reserving the worst
+// case (tjBufSize()) or letting libjpeg-turbo grow a small buffer from
+// scratch every time, each encode borrows a buffer sized from the average
+// compression ratio so far, and only the exact output is copied out.
+static uv_once_t scratchOnce = UV_ONCE_INIT;
+static uv_mutex_t scratchMutex;
+static njt_scratch* scratchPool = NULL;
+static uint32_t scratchPooled = 0;
+static double scratchPooledBytes = 0;
+static double scratchEncodes = 0;
+static double scratchGrown = 0;
+static double scratchResized = 0;
+
+// Running average of compressed bytes per pixel
+static double scratchRatio = 0;
+
+static void initScratch() {
+  uv_mutex_init(&scratchMutex);
+}
+
+njt_scratch* njtAcquireScratch(uint32_t width, uint32_t height, uint32_t jpegSubsamp) {
+  njt_scratch* scratch;
+  unsigned long size;
+  unsigned long maxSize = tjBufSize(width, height, jpegSubsamp);
+  double pixels = (double) width * height;
+
+  uv_once(&scratchOnce, initScratch);
+
+  uv_mutex_lock(&scratchMutex);
+  // Leave some headroom so that slightly larger images don't have to grow
+  // the buffer. Without any statistics a byte per pixel is a good guess.
+  if (scratchRatio > 0) {
+    size = (unsigned long) (pixels * scratchRatio * 1.25) + NJT_SCRATCH_SLACK;
+  }
+  else {
+    size = (unsigned long) pixels + NJT_SCRATCH_SLACK;
+  }
+  scratch = scratchPool;
+  if (scratch != NULL) {
+    scratchPool = scratch->next;
+    scratchPooled--;
+    scratchPooledBytes -= scratch->size;
+  }
+  uv_mutex_unlock(&scratchMutex);
+
+  if (size > maxSize) {
+    size = maxSize;
+  }
+
+  if (scratch == NULL) {
+    scratch = (njt_scratch*) calloc(1, sizeof(njt_scratch));
+    if (scratch == NULL) {
+      return NULL;
+    }
+  }
+
+  if (scratch->size < size) {
+    tjFree(scratch->data);
+    scratch->data = tjAlloc(size);
+    if (scratch->data == NULL) {
+      free(scratch);
+      return NULL;
+    }
+    scratch->size = size;
+
+    uv_mutex_lock(&scratchMutex);
+    scratchResized++;
+    uv_mutex_unlock(&scratchMutex);
+  }
+
+  return scratch;
+}
+
+// data is where libjpeg-turbo left the output, which is a new buffer if it
+// had to grow the scratch buffer. jpegSize is 0 if the encode failed.
+void njtReleaseScratch(njt_scratch* scratch, unsigned char* data, unsigned long jpegSize, uint32_t width, uint32_t height) {
+  bool grown = false;
+  double pixels = (double) width * height;
+
+  if (data != scratch->data) {
+    tjFree(scratch->data);
+    scratch->data = data;
+    scratch->size = jpegSize;
+    grown = true;
+  }
+
+  uv_mutex_lock(&scratchMutex);
+  if (grown) {
+    scratchGrown++;
+  }
+  if (jpegSize > 0 && pixels > 0) {
+    scratchEncodes++;
+    if (scratchRatio > 0) {
+      scratchRatio += (jpegSize / pixels - scratchRatio) / 8;
+    }
+    else {
+      scratchRatio = jpegSize / pixels;
+    }
+  }
+  if (scratch->data != NULL && scratchPooled < NJT_SCRATCH_POOL_LIMIT) {
+    scratch->next = scratchPool;
+    scratchPool = scratch;
+    scratchPooled++;
+    scratchPooledBytes += scratch->size;
+    scratch = NULL;
+  }
+  uv_mutex_unlock(&scratchMutex);
+
+  if (scratch != NULL) {
+    tjFree(scratch->data);
+    free(scratch);
+  }
+}
+
+NAN_METHOD(ScratchStats) {
+  Local<Object> obj = New<Object>();
+
+  uv_once(&scratchOnce, initScratch);
+
+  uv_mutex_lock(&scratchMutex);
+  obj->Set(New("encodes").ToLocalChecked(), New(scratchEncodes));
+  obj->Set(New("grown").ToLocalChecked(), New(scratchGrown));
+  obj->Set(New("resized").ToLocalChecked(), New(scratchResized));
+  obj->Set(New("pooled").ToLocalChecked(), New(scratchPooled));
+  obj->Set(New("pooledBytes").ToLocalChecked(), New(scratchPooledBytes));
+  obj->Set(New("bytesPerPixel").ToLocalChecked(), New(scratchRatio));
+  uv_mutex_unlock(&scratchMutex);
+
+  info.GetReturnValue().Set(obj);
+}
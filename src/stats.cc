@@ -0,0 +1,343 @@
+#include <math.h>
+
+#include "exports.h"
+using namespace Nan;
+using namespace v8;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// Counters are only ever written by the thread that owns them, so relaxed
+// atomics are uncontended and cost about as much as plain adds. They just
+// keep reads from other threads from tearing.
+#ifdef _MSC_VER
+#define njtAtomicAdd(p, v) InterlockedExchangeAdd64((volatile LONGLONG*) (p), (LONGLONG) (v))
+#define njtAtomicLoad(p) ((uint64_t) InterlockedCompareExchange64((volatile LONGLONG*) (p), 0, 0))
+#else
+#define njtAtomicAdd(p, v) __atomic_fetch_add((p), (uint64_t) (v), __ATOMIC_RELAXED)
+#define njtAtomicLoad(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#endif
+
+typedef struct {
+  uint64_t count;
+  uint64_t time;
+  uint64_t buckets[NJT_STATS_BUCKETS];
+} njt_stats_histogram;
+
+typedef struct {
+  uint64_t calls;
+  uint64_t errors[NJT_ERRORS];
+  uint64_t bytesIn;
+  uint64_t bytesOut;
+  uint64_t pixels;
+  njt_stats_histogram stages[NJT_STAGES];
+} njt_stats_op;
+
+// Every thread that records something gets a slot of its own. Slots are
+// linked together so that stats() can add them up. When a thread exits, its
+// counts are added to statsRetired and the slot is freed.
+typedef struct njt_stats_slot {
+  njt_stats_op ops[NJT_OPS];
+  struct njt_stats_slot* next;
+} njt_stats_slot;
+
+static void retireSlot(njt_stats_slot* slot);
+
+// The slot of the current thread, which is handed back on thread exit.
+class njt_stats_thread {
+  public:
+    njt_stats_slot* slot;
+
+    ~njt_stats_thread() {
+      if (this->slot != NULL) {
+        retireSlot(this->slot);
+        this->slot = NULL;
+      }
+    }
+};
+
+static uv_once_t statsOnce = UV_ONCE_INIT;
+static thread_local njt_stats_thread statsThread;
+static uv_mutex_t statsMutex;
+static njt_stats_slot* statsSlots = NULL;
+static njt_stats_op statsRetired[NJT_OPS];
+static uint32_t statsThreads = 0;
+static volatile bool statsEnabled = false;
+
+static const char* stageNames[NJT_STAGES] = {
+  "queue",
+  "header",
+  "codec",
+  "buffer",
+  "callback",
+  "total",
+};
+
+static const char* errorNames[NJT_ERRORS] = {
+  "aborted",
+  "header",
+  "codec",
+  "other",
+};
+
+static void initStats() {
+  uv_mutex_init(&statsMutex);
+}
+
+// The mutex is only taken the first time a thread records something.
+static njt_stats_slot* threadSlot() {
+  njt_stats_slot* slot = statsThread.slot;
+
+  if (slot != NULL) {
+    return slot;
+  }
+
+  uv_once(&statsOnce, initStats);
+
+  slot = (njt_stats_slot*) calloc(1, sizeof(njt_stats_slot));
+  if (slot == NULL) {
+    return NULL;
+  }
+  statsThread.slot = slot;
+
+  uv_mutex_lock(&statsMutex);
+  slot->next = statsSlots;
+  statsSlots = slot;
+  statsThreads++;
+  uv_mutex_unlock(&statsMutex);
+
+  return slot;
+}
+
+static void addCounter(uint64_t* total, uint64_t* counter) {
+  *total += njtAtomicLoad(counter);
+}
+
+static void addOp(njt_stats_op* total, njt_stats_op* op) {
+  int i;
+  int bucket;
+
+  addCounter(&total->calls, &op->calls);
+  addCounter(&total->bytesIn, &op->bytesIn);
+  addCounter(&total->bytesOut, &op->bytesOut);
+  addCounter(&total->pixels, &op->pixels);
+  for (i = 0; i < NJT_ERRORS; i++) {
+    addCounter(&total->errors[i], &op->errors[i]);
+  }
+  for (i = 0; i < NJT_STAGES; i++) {
+    addCounter(&total->stages[i].count, &op->stages[i].count);
+    addCounter(&total->stages[i].time, &op->stages[i].time);
+    for (bucket = 0; bucket < NJT_STATS_BUCKETS; bucket++) {
+      addCounter(&total->stages[i].buckets[bucket], &op->stages[i].buckets[bucket]);
+    }
+  }
+}
+
+// Called on the owning thread as it exits, so nothing else writes to the
+// slot anymore, and stats() can't be reading it while we hold the mutex.
+static void retireSlot(njt_stats_slot* slot) {
+  njt_stats_slot** prev;
+  int op;
+
+  uv_mutex_lock(&statsMutex);
+  for (prev = &statsSlots; *prev != NULL; prev = &(*prev)->next) {
+    if (*prev == slot) {
+      *prev = slot->next;
+      break;
+    }
+  }
+  for (op = 0; op < NJT_OPS; op++) {
+    addOp(&statsRetired[op], &slot->ops[op]);
+  }
+  uv_mutex_unlock(&statsMutex);
+
+  free(slot);
+}
+
+// Returns 0 while stats are disabled, which makes the matching
+// njtStatsStage() call a no-op even if stats are enabled in between.
+uint64_t njtStatsNow() {
+  return statsEnabled ? uv_hrtime() : 0;
+}
+
+void njtStatsStage(int op, int stage, uint64_t startedAt) {
+  njt_stats_slot* slot;
+  njt_stats_histogram* histogram;
+  uint64_t elapsed;
+  uint64_t micros;
+  int bucket = 0;
+
+  if (startedAt == 0 || !statsEnabled) {
+    return;
+  }
+
+  elapsed = uv_hrtime() - startedAt;
+
+  slot = threadSlot();
+  if (slot == NULL) {
+    return;
+  }
+
+  // Bucket 0 is under a microsecond, and each one after that covers twice
+  // the time of the previous one
+  for (micros = elapsed / 1000; micros > 0 && bucket < NJT_STATS_BUCKETS - 1; micros >>= 1) {
+    bucket++;
+  }
+
+  histogram = &slot->ops[op].stages[stage];
+  njtAtomicAdd(&histogram->count, 1);
+  njtAtomicAdd(&histogram->time, elapsed);
+  njtAtomicAdd(&histogram->buckets[bucket], 1);
+}
+
+void njtStatsCall(int op, uint64_t bytesIn, uint64_t bytesOut, uint64_t pixels) {
+  njt_stats_slot* slot;
+
+  if (!statsEnabled || (slot = threadSlot()) == NULL) {
+    return;
+  }
+
+  njtAtomicAdd(&slot->ops[op].calls, 1);
+  njtAtomicAdd(&slot->ops[op].bytesIn, bytesIn);
+  njtAtomicAdd(&slot->ops[op].bytesOut, bytesOut);
+  njtAtomicAdd(&slot->ops[op].pixels, pixels);
+}
+
+void njtStatsError(int op, int kind) {
+  njt_stats_slot* slot;
+
+  if (!statsEnabled || (slot = threadSlot()) == NULL) {
+    return;
+  }
+
+  njtAtomicAdd(&slot->ops[op].calls, 1);
+  njtAtomicAdd(&slot->ops[op].errors[kind], 1);
+}
+
+// Upper bound of a bucket in milliseconds. The last one has none, so its
+// lower bound will have to do.
+static double bucketLimit(int bucket) {
+  if (bucket == NJT_STATS_BUCKETS - 1) {
+    bucket--;
+  }
+  return (double) ((uint64_t) 1 << bucket) / 1e3;
+}
+
+static double histogramPercentile(njt_stats_histogram* histogram, double p) {
+  uint64_t seen = 0;
+  int bucket;
+
+  if (histogram->count == 0) {
+    return 0;
+  }
+
+  for (bucket = 0; bucket < NJT_STATS_BUCKETS; bucket++) {
+    seen += histogram->buckets[bucket];
+    if (seen >= p * histogram->count) {
+      break;
+    }
+  }
+
+  return bucketLimit(bucket < NJT_STATS_BUCKETS ? bucket : NJT_STATS_BUCKETS - 1);
+}
+
+static Local<Object> histogramStats(njt_stats_histogram* histogram) {
+  Local<Object> obj = New<Object>();
+  Local<Array> buckets = New<Array>(NJT_STATS_BUCKETS);
+  int bucket;
+
+  for (bucket = 0; bucket < NJT_STATS_BUCKETS; bucket++) {
+    buckets->Set(bucket, New((double) histogram->buckets[bucket]));
+  }
+
+  obj->Set(New("count").ToLocalChecked(), New((double) histogram->count));
+  obj->Set(New("time").ToLocalChecked(), New(histogram->time / 1e6));
+  obj->Set(New("mean").ToLocalChecked(), New(histogram->count > 0 ? histogram->time / 1e6 / histogram->count : 0));
+  obj->Set(New("p50").ToLocalChecked(), New(histogramPercentile(histogram, 0.5)));
+  obj->Set(New("p90").ToLocalChecked(), New(histogramPercentile(histogram, 0.9)));
+  obj->Set(New("p99").ToLocalChecked(), New(histogramPercentile(histogram, 0.99)));
+  obj->Set(New("histogram").ToLocalChecked(), buckets);
+
+  return obj;
+}
+
+static Local<Object> opStats(njt_stats_op* op) {
+  Local<Object> obj = New<Object>();
+  Local<Object> errors = New<Object>();
+  Local<Object> stages = New<Object>();
+  int i;
+
+  for (i = 0; i < NJT_ERRORS; i++) {
+    errors->Set(New(errorNames[i]).ToLocalChecked(), New((double) op->errors[i]));
+  }
+
+  for (i = 0; i < NJT_STAGES; i++) {
+    stages->Set(New(stageNames[i]).ToLocalChecked(), histogramStats(&op->stages[i]));
+  }
+
+  obj->Set(New("calls").ToLocalChecked(), New((double) op->calls));
+  obj->Set(New("errors").ToLocalChecked(), errors);
+  obj->Set(New("bytesIn").ToLocalChecked(), New((double) op->bytesIn));
+  obj->Set(New("bytesOut").ToLocalChecked(), New((double) op->bytesOut));
+  obj->Set(New("megapixels").ToLocalChecked(), New(op->pixels / 1e6));
+  obj->Set(New("stages").ToLocalChecked(), stages);
+
+  return obj;
+}
+
+NAN_METHOD(Stats) {
+  Local<Object> obj = New<Object>();
+  Local<Array> limits = New<Array>(NJT_STATS_BUCKETS);
+  njt_stats_op totals[NJT_OPS];
+  njt_stats_slot* slot;
+  uint32_t threads;
+  int op;
+  int bucket;
+
+  uv_once(&statsOnce, initStats);
+
+  // Writers never take the mutex, so this only keeps slots from coming and
+  // going while walking the list
+  uv_mutex_lock(&statsMutex);
+  memcpy(totals, statsRetired, sizeof(totals));
+  for (slot = statsSlots; slot != NULL; slot = slot->next) {
+    for (op = 0; op < NJT_OPS; op++) {
+      addOp(&totals[op], &slot->ops[op]);
+    }
+  }
+  threads = statsThreads;
+  uv_mutex_unlock(&statsMutex);
+
+  for (bucket = 0; bucket < NJT_STATS_BUCKETS - 1; bucket++) {
+    limits->Set(bucket, New(bucketLimit(bucket)));
+  }
+  limits->Set(NJT_STATS_BUCKETS - 1, New(INFINITY));
+
+  obj->Set(New("enabled").ToLocalChecked(), New<Boolean>(statsEnabled));
+  obj->Set(New("threads").ToLocalChecked(), New(threads));
+  obj->Set(New("buckets").ToLocalChecked(), limits);
+  obj->Set(New("compress").ToLocalChecked(), opStats(&totals[NJT_OP_COMPRESS]));
+  obj->Set(New("decompress").ToLocalChecked(), opStats(&totals[NJT_OP_DECOMPRESS]));
+
+  info.GetReturnValue().Set(obj);
+}
+
+NAN_METHOD(EnableStats) {
+  int retval = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+  bool enabled = true;
+
+  if (info.Length() > 0 && !info[0]->IsUndefined()) {
+    if (!info[0]->IsBoolean()) {
+      _throw("Invalid enabled value");
+    }
+    enabled = info[0]->IsTrue();
+  }
+
+  statsEnabled = enabled;
+
+  bailout:
+  if (retval != 0) {
+    ThrowError(TypeError(errStr));
+    return;
+  }
+}
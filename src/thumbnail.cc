@@ -0,0 +1,727 @@
+#include "libjpeg.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// Resampling weights are fixed point with this many fractional bits.
+#define NJT_RESAMPLE_BITS 14
+#define NJT_RESAMPLE_ONE (1 << NJT_RESAMPLE_BITS)
+
+enum {
+  SCRATCH_DECODED = 0,
+  SCRATCH_RESIZED,
+  SCRATCH_KINDS,
+};
+
+typedef struct {
+  uint32_t maxWidth;
+  uint32_t maxHeight;
+  int quality;
+  int width;
+  int height;
+  unsigned char* data;
+  unsigned long size;
+} njt_thumbnail;
+
+typedef struct {
+  uint32_t jpegSubsamp;
+  int quality;
+  bool accurateDct;
+  volatile int32_t* cancelled;
+} njt_thumbnail_options;
+
+// Which source pixels (and how much of each) make up every output pixel.
+typedef struct {
+  uint32_t* first;
+  uint32_t* count;
+  int32_t* weights;
+  uint32_t stride;
+} njt_resample_weights;
+
+// Decoded and resized images are kept per thread, so that a thread turning
+// out thumbnail after thumbnail doesn't have to allocate for each of them.
+typedef struct {
+  unsigned char* data[SCRATCH_KINDS];
+  size_t size[SCRATCH_KINDS];
+} njt_thumbnail_scratch;
+
+static uv_once_t scratchOnce = UV_ONCE_INIT;
+static uv_key_t scratchKey;
+
+static void initThumbnailScratch() {
+  uv_key_create(&scratchKey);
+}
+
+static unsigned char* threadScratch(int kind, size_t size) {
+  njt_thumbnail_scratch* scratch;
+
+  uv_once(&scratchOnce, initThumbnailScratch);
+  scratch = (njt_thumbnail_scratch*) uv_key_get(&scratchKey);
+
+  if (scratch == NULL) {
+    scratch = (njt_thumbnail_scratch*) calloc(1, sizeof(njt_thumbnail_scratch));
+    if (scratch == NULL) {
+      return NULL;
+    }
+    uv_key_set(&scratchKey, scratch);
+  }
+
+  if (scratch->size[kind] < size) {
+    free(scratch->data[kind]);
+    scratch->data[kind] = (unsigned char*) malloc(size);
+    scratch->size[kind] = scratch->data[kind] != NULL ? size : 0;
+  }
+
+  return scratch->data[kind];
+}
+
+// One huge image shouldn't pin that much memory on every thread forever.
+static void trimThreadScratch() {
+  njt_thumbnail_scratch* scratch;
+  int kind;
+
+  uv_once(&scratchOnce, initThumbnailScratch);
+  scratch = (njt_thumbnail_scratch*) uv_key_get(&scratchKey);
+  if (scratch == NULL) {
+    return;
+  }
+
+  for (kind = 0; kind < SCRATCH_KINDS; kind++) {
+    if (scratch->size[kind] > NJT_THUMBNAIL_SCRATCH_LIMIT) {
+      free(scratch->data[kind]);
+      scratch->data[kind] = NULL;
+      scratch->size[kind] = 0;
+    }
+  }
+}
+
+static void freeWeights(njt_resample_weights* w) {
+  free(w->first);
+  free(w->count);
+  free(w->weights);
+}
+
+// Box filter with exact coverage, i.e. every output pixel is the average of
+// the source area it covers. Only meant for shrinking.
+static bool computeWeights(uint32_t srcSize, uint32_t dstSize, njt_resample_weights* w) {
+  double ratio = (double) srcSize / dstSize;
+  double start;
+  double end;
+  double cover;
+  int32_t total;
+  uint32_t largest;
+  uint32_t i;
+  uint32_t j;
+  uint32_t last;
+  int32_t* weights;
+
+  w->stride = (uint32_t) ratio + 2;
+  w->first = (uint32_t*) malloc(dstSize * sizeof(uint32_t));
+  w->count = (uint32_t*) malloc(dstSize * sizeof(uint32_t));
+  w->weights = (int32_t*) malloc(dstSize * w->stride * sizeof(int32_t));
+
+  if (w->first == NULL || w->count == NULL || w->weights == NULL) {
+    freeWeights(w);
+    return false;
+  }
+
+  for (i = 0; i < dstSize; i++) {
+    start = i * ratio;
+    end = (i + 1) * ratio;
+    if (end > srcSize) {
+      end = srcSize;
+    }
+
+    w->first[i] = (uint32_t) start;
+    last = (uint32_t) end;
+    if (last >= srcSize || last == end) {
+      last--;
+    }
+    w->count[i] = last - w->first[i] + 1;
+
+    weights = w->weights + i * w->stride;
+    total = 0;
+    largest = 0;
+    for (j = 0; j < w->count[i]; j++) {
+      cover = (end < w->first[i] + j + 1 ? end : w->first[i] + j + 1) - (start > w->first[i] + j ? start : w->first[i] + j);
+      weights[j] = (int32_t) (cover / ratio * NJT_RESAMPLE_ONE + 0.5);
+      total += weights[j];
+      if (weights[j] > weights[largest]) {
+        largest = j;
+      }
+    }
+
+    // Rounding must not brighten or darken the image
+    weights[largest] += NJT_RESAMPLE_ONE - total;
+  }
+
+  return true;
+}
+
+// Shrinks src to dst, one output row at a time: the source rows covered by
+// the row are blended first, which is a straight run over contiguous memory
+// that compilers vectorize well, and only the single blended row is then
+// shrunk horizontally.
+static int resample(unsigned char* srcData, int srcWidth, int srcHeight, unsigned char* dstData, int dstWidth, int dstHeight, int bpp, char* errStr) {
+  int retval = 0;
+  njt_resample_weights xw;
+  njt_resample_weights yw;
+  int32_t* acc = NULL;
+  unsigned char* row = NULL;
+  uint32_t rowSize = srcWidth * bpp;
+  uint32_t x;
+  uint32_t y;
+  uint32_t i;
+  uint32_t k;
+  int c;
+  int32_t weight;
+  int32_t sum;
+  int32_t* weights;
+  unsigned char* src;
+  unsigned char* dst;
+
+  memset(&xw, 0, sizeof(xw));
+  memset(&yw, 0, sizeof(yw));
+
+  if (!computeWeights(srcWidth, dstWidth, &xw) || !computeWeights(srcHeight, dstHeight, &yw)) {
+    _throw("Unable to allocate resampling weights");
+  }
+
+  acc = (int32_t*) malloc(rowSize * sizeof(int32_t));
+  row = (unsigned char*) malloc(rowSize);
+  if (acc == NULL || row == NULL) {
+    _throw("Unable to allocate resampling buffers");
+  }
+
+  for (y = 0; y < (uint32_t) dstHeight; y++) {
+    for (i = 0; i < rowSize; i++) {
+      acc[i] = NJT_RESAMPLE_ONE / 2;
+    }
+
+    for (k = 0; k < yw.count[y]; k++) {
+      weight = yw.weights[y * yw.stride + k];
+      src = srcData + (yw.first[y] + k) * rowSize;
+      for (i = 0; i < rowSize; i++) {
+        acc[i] += weight * src[i];
+      }
+    }
+
+    for (i = 0; i < rowSize; i++) {
+      row[i] = acc[i] >> NJT_RESAMPLE_BITS;
+    }
+
+    dst = dstData + y * dstWidth * bpp;
+    for (x = 0; x < (uint32_t) dstWidth; x++) {
+      weights = xw.weights + x * xw.stride;
+      src = row + xw.first[x] * bpp;
+      for (c = 0; c < bpp; c++) {
+        sum = NJT_RESAMPLE_ONE / 2;
+        for (k = 0; k < xw.count[x]; k++) {
+          sum += weights[k] * src[k * bpp + c];
+        }
+        dst[x * bpp + c] = sum >> NJT_RESAMPLE_BITS;
+      }
+    }
+  }
+
+  bailout:
+  freeWeights(&xw);
+  freeWeights(&yw);
+  free(acc);
+  free(row);
+
+  return retval;
+}
+
+// Fits the image in the thumbnail's box without changing the aspect ratio.
+// Thumbnails are never larger than the image itself.
+static void fitThumbnail(njt_thumbnail* thumb, int width, int height) {
+  double scale = 1;
+
+  if (thumb->maxWidth > 0 && thumb->maxWidth < scale * width) {
+    scale = (double) thumb->maxWidth / width;
+  }
+  if (thumb->maxHeight > 0 && thumb->maxHeight < scale * height) {
+    scale = (double) thumb->maxHeight / height;
+  }
+
+  thumb->width = (int) (width * scale + 0.5);
+  thumb->height = (int) (height * scale + 0.5);
+
+  if (thumb->width < 1) {
+    thumb->width = 1;
+  }
+  if (thumb->height < 1) {
+    thumb->height = 1;
+  }
+}
+
+// Decodes the image once, at the smallest DCT scaling factor that is still
+// at least as large as the largest thumbnail, then shrinks and encodes each
+// thumbnail from that.
+int thumbnail(unsigned char* srcData, uint32_t srcLength, njt_thumbnail* thumbs, int count, njt_thumbnail_options* options, char* errStr) {
+  int retval = 0;
+  int err;
+  tjhandle handle = NULL;
+  njt_compress_options compressOptions;
+  tjscalingfactor* factors;
+  tjscalingfactor factor;
+  int factorCount = 0;
+  int width;
+  int height;
+  int jpegSubsamp;
+  int jpegColorspace;
+  int format;
+  int bpp;
+  int largestWidth = 0;
+  int largestHeight = 0;
+  int flags = options->accurateDct ? TJFLAG_ACCURATEDCT : TJFLAG_FASTDCT;
+  unsigned char* decoded;
+  unsigned char* resized;
+  int i;
+
+  if (options->cancelled != NULL && *options->cancelled) {
+    _throw("Aborted");
+  }
+
+  handle = njtAcquireHandle(NJT_HANDLE_DECOMPRESS);
+  if (handle == NULL) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  err = tjDecompressHeader3(handle, srcData, srcLength, &width, &height, &jpegSubsamp, &jpegColorspace);
+
+  if (err != 0) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  // Grayscale images make grayscale thumbnails
+  if (jpegSubsamp == TJSAMP_GRAY) {
+    format = FORMAT_GRAY;
+    bpp = 1;
+  }
+  else {
+    format = FORMAT_RGB;
+    bpp = 3;
+  }
+
+  for (i = 0; i < count; i++) {
+    fitThumbnail(&thumbs[i], width, height);
+    if (thumbs[i].width > largestWidth) {
+      largestWidth = thumbs[i].width;
+    }
+    if (thumbs[i].height > largestHeight) {
+      largestHeight = thumbs[i].height;
+    }
+  }
+
+  factors = tjGetScalingFactors(&factorCount);
+  if (factors == NULL || factorCount == 0) {
+    _throw(njtGetErrorStr(NULL));
+  }
+
+  factor.num = 1;
+  factor.denom = 1;
+  for (i = 0; i < factorCount; i++) {
+    if (factors[i].num > factors[i].denom || factors[i].num * factor.denom >= factor.num * factors[i].denom) {
+      continue;
+    }
+    if (TJSCALED(width, factors[i]) >= largestWidth && TJSCALED(height, factors[i]) >= largestHeight) {
+      factor = factors[i];
+    }
+  }
+
+  width = TJSCALED(width, factor);
+  height = TJSCALED(height, factor);
+
+  decoded = threadScratch(SCRATCH_DECODED, (size_t) width * height * bpp);
+  resized = threadScratch(SCRATCH_RESIZED, (size_t) largestWidth * largestHeight * bpp);
+  if (decoded == NULL || resized == NULL) {
+    _throw("Unable to allocate thumbnail buffers");
+  }
+
+  // Lets us bail out between MCU rows
+  if (options->cancelled != NULL) {
+    if (njtDecompressScanlines(srcData, srcLength, factor, format, flags, options->cancelled, decoded, width * bpp, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+  }
+  else {
+    err = tjDecompress2(handle, srcData, srcLength, decoded, width, width * bpp, height, format, flags);
+
+    if (err != 0) {
+      _throw(njtGetErrorStr(handle));
+    }
+  }
+
+  memset(&compressOptions, 0, sizeof(compressOptions));
+  compressOptions.format = format;
+  compressOptions.jpegSubsamp = bpp == 1 ? SAMP_GRAY : options->jpegSubsamp;
+  compressOptions.accurateDct = options->accurateDct;
+  compressOptions.tight = true;
+  compressOptions.threads = 1;
+  compressOptions.cancelled = options->cancelled;
+
+  for (i = 0; i < count; i++) {
+    compressOptions.width = thumbs[i].width;
+    compressOptions.stride = thumbs[i].width;
+    compressOptions.height = thumbs[i].height;
+    compressOptions.quality = thumbs[i].quality > 0 ? thumbs[i].quality : options->quality;
+
+    if (thumbs[i].width == width && thumbs[i].height == height) {
+      err = compress(decoded, &compressOptions, &thumbs[i].size, &thumbs[i].data, 0, errStr);
+    }
+    else {
+      err = resample(decoded, width, height, resized, thumbs[i].width, thumbs[i].height, bpp, errStr);
+      if (err == 0) {
+        err = compress(resized, &compressOptions, &thumbs[i].size, &thumbs[i].data, 0, errStr);
+      }
+    }
+
+    if (err != 0) {
+      retval = -1;
+      goto bailout;
+    }
+  }
+
+  bailout:
+  njtReleaseHandle(NJT_HANDLE_DECOMPRESS, handle);
+
+  trimThreadScratch();
+
+  if (retval != 0) {
+    if (options->cancelled != NULL && *options->cancelled) {
+      snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Aborted");
+    }
+    for (i = 0; i < count; i++) {
+      if (thumbs[i].data != NULL) {
+        tjFree(thumbs[i].data);
+        thumbs[i].data = NULL;
+      }
+    }
+  }
+
+  return retval;
+}
+
+static int parseSize(Local<Object> size, njt_thumbnail* thumb, char* errStr) {
+  int retval = 0;
+  Local<Value> widthObject;
+  Local<Value> heightObject;
+  Local<Value> qualityObject;
+
+  widthObject = size->Get(New("width").ToLocalChecked());
+  if (!widthObject->IsUndefined()) {
+    if (!widthObject->IsUint32()) {
+      _throw("Invalid width value");
+    }
+    thumb->maxWidth = widthObject->Uint32Value();
+  }
+
+  heightObject = size->Get(New("height").ToLocalChecked());
+  if (!heightObject->IsUndefined()) {
+    if (!heightObject->IsUint32()) {
+      _throw("Invalid height value");
+    }
+    thumb->maxHeight = heightObject->Uint32Value();
+  }
+
+  if (thumb->maxWidth == 0 && thumb->maxHeight == 0) {
+    _throw("Missing width or height");
+  }
+
+  qualityObject = size->Get(New("quality").ToLocalChecked());
+  if (!qualityObject->IsUndefined()) {
+    if (!qualityObject->IsUint32() || qualityObject->Uint32Value() > 100) {
+      _throw("Invalid quality value");
+    }
+    thumb->quality = qualityObject->Uint32Value();
+  }
+
+  bailout:
+  return retval;
+}
+
+int thumbnailParseOptions(Local<Object> options, njt_thumbnail_options* opts, char* errStr) {
+  int retval = 0;
+  Local<Value> sampObject;
+  Local<Value> qualityObject;
+  Local<Value> accurateDctObject;
+
+  opts->jpegSubsamp = NJT_DEFAULT_SUBSAMPLING;
+  opts->quality = NJT_DEFAULT_QUALITY;
+  opts->accurateDct = false;
+  opts->cancelled = NULL;
+
+  // Subsampling
+  sampObject = options->Get(New("subsampling").ToLocalChecked());
+  if (!sampObject->IsUndefined()) {
+    if (!sampObject->IsUint32()) {
+      _throw("Invalid subsampling method");
+    }
+    opts->jpegSubsamp = sampObject->Uint32Value();
+  }
+
+  switch (opts->jpegSubsamp) {
+    case SAMP_444:
+    case SAMP_422:
+    case SAMP_420:
+    case SAMP_GRAY:
+    case SAMP_440:
+      break;
+    default:
+      _throw("Invalid subsampling method");
+  }
+
+  // Quality
+  qualityObject = options->Get(New("quality").ToLocalChecked());
+  if (!qualityObject->IsUndefined()) {
+    if (!qualityObject->IsUint32() || qualityObject->Uint32Value() > 100) {
+      _throw("Invalid quality value");
+    }
+    opts->quality = qualityObject->Uint32Value();
+  }
+
+  // Accurate DCT, for both decoding and encoding
+  accurateDctObject = options->Get(New("accurateDct").ToLocalChecked());
+  if (!accurateDctObject->IsUndefined()) {
+    if (!accurateDctObject->IsBoolean()) {
+      _throw("Invalid accurateDct value");
+    }
+    opts->accurateDct = accurateDctObject->IsTrue();
+  }
+
+  bailout:
+  return retval;
+}
+
+static Local<Value> thumbnailResult(njt_thumbnail* thumbs, int count, bool multiple) {
+  Local<Array> results = New<Array>(count);
+  int i;
+
+  for (i = 0; i < count; i++) {
+    Local<Object> obj = New<Object>();
+
+    obj->Set(New("data").ToLocalChecked(), NewBuffer((char*)thumbs[i].data, thumbs[i].size, compressBufferFreeCallback, NULL).ToLocalChecked());
+    obj->Set(New("width").ToLocalChecked(), New(thumbs[i].width));
+    obj->Set(New("height").ToLocalChecked(), New(thumbs[i].height));
+    thumbs[i].data = NULL;
+
+    if (!multiple) {
+      return obj;
+    }
+
+    results->Set(i, obj);
+  }
+
+  return results;
+}
+
+class ThumbnailWorker : public AsyncWorker {
+  public:
+    ThumbnailWorker(Callback *callback, Local<Object> &srcObject, unsigned char* srcData, uint32_t srcLength, njt_thumbnail* thumbs, int count, bool multiple, njt_thumbnail_options* options, Local<Object> &tokenObject) :
+      AsyncWorker(callback),
+      srcData(srcData),
+      srcLength(srcLength),
+      thumbs(thumbs),
+      count(count),
+      multiple(multiple),
+      options(*options) {
+        SaveToPersistent("srcObject", srcObject);
+        if (!tokenObject.IsEmpty()) {
+          SaveToPersistent("tokenObject", tokenObject);
+        }
+      }
+
+    ~ThumbnailWorker() {
+      int i;
+
+      for (i = 0; i < this->count; i++) {
+        if (this->thumbs[i].data != NULL) {
+          tjFree(this->thumbs[i].data);
+        }
+      }
+
+      free(this->thumbs);
+    }
+
+    void Execute () {
+      int err;
+
+      err = thumbnail(
+          this->srcData,
+          this->srcLength,
+          this->thumbs,
+          this->count,
+          &this->options,
+          this->errStr);
+
+      if(err != 0) {
+        SetErrorMessage(this->errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      Local<Value> argv[] = {
+        Null(),
+        thumbnailResult(this->thumbs, this->count, this->multiple)
+      };
+
+      callback->Call(2, argv);
+    }
+
+  private:
+    unsigned char* srcData;
+    uint32_t srcLength;
+    njt_thumbnail* thumbs;
+    int count;
+    bool multiple;
+    njt_thumbnail_options options;
+    char errStr[NJT_MSG_LENGTH_MAX];
+};
+
+void thumbnailParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+  int retval = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+
+  // Input
+  Callback *callback = NULL;
+  Local<Object> srcObject;
+  unsigned char* srcData = NULL;
+  uint32_t srcLength = 0;
+  Local<Object> options;
+  Local<Value> sizesObject;
+  Local<Array> sizesArray;
+  Local<Object> tokenObject;
+  njt_thumbnail_options opts;
+  uint32_t priority = PRIORITY_INTERACTIVE;
+  int count = 1;
+  bool multiple = false;
+  int i;
+
+  // Output
+  njt_thumbnail* thumbs = NULL;
+
+  // Try to find callback here, so if we want to throw something we can use callback's err
+  if (async) {
+    if (info[info.Length() - 1]->IsFunction()) {
+      callback = new Callback(info[info.Length() - 1].As<Function>());
+    }
+    else {
+      _throw("Missing callback");
+    }
+  }
+
+  if ((async && info.Length() < 3) || (!async && info.Length() < 2)) {
+    _throw("Too few arguments");
+  }
+
+  // Input buffer
+  srcObject = info[0].As<Object>();
+  if (!Buffer::HasInstance(srcObject)) {
+    _throw("Invalid source buffer");
+  }
+
+  srcData = (unsigned char*) Buffer::Data(srcObject);
+  srcLength = Buffer::Length(srcObject);
+
+  // Options
+  options = info[1].As<Object>();
+  if (!options->IsObject()) {
+    _throw("Options must be an object");
+  }
+
+  if (thumbnailParseOptions(options, &opts, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // Multiple thumbnails from a single decode
+  sizesObject = options->Get(New("sizes").ToLocalChecked());
+  if (!sizesObject->IsUndefined()) {
+    if (!sizesObject->IsArray() || sizesObject.As<Array>()->Length() == 0) {
+      _throw("Invalid sizes value");
+    }
+    sizesArray = sizesObject.As<Array>();
+    count = sizesArray->Length();
+    multiple = true;
+  }
+
+  thumbs = (njt_thumbnail*) calloc(count, sizeof(njt_thumbnail));
+  if (thumbs == NULL) {
+    _throw("Unable to allocate thumbnails");
+  }
+
+  for (i = 0; i < count; i++) {
+    if (multiple && !sizesArray->Get(i)->IsObject()) {
+      _throw("Invalid sizes value");
+    }
+    if (parseSize(multiple ? sizesArray->Get(i).As<Object>() : options, &thumbs[i], errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+  }
+
+  if (njtParseCancelToken(options, &tokenObject, &opts.cancelled, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  if (njtParsePriority(options, &priority, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // Do either async or sync thumbnail
+  if (async) {
+    if (njtPoolFull()) {
+      _throw("Queue is full");
+    }
+    njtQueueWorker(new ThumbnailWorker(callback, srcObject, srcData, srcLength, thumbs, count, multiple, &opts, tokenObject), priority, opts.cancelled);
+    return;
+  }
+  else {
+    retval = thumbnail(
+        srcData,
+        srcLength,
+        thumbs,
+        count,
+        &opts,
+        errStr);
+
+    if(retval != 0) {
+      // thumbnail will set the errStr
+      goto bailout;
+    }
+
+    info.GetReturnValue().Set(thumbnailResult(thumbs, count, multiple));
+  }
+
+  // If we have error throw error or call callback with error
+  bailout:
+  free(thumbs);
+
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+NAN_METHOD(ThumbnailSync) {
+  thumbnailParse(info, false);
+}
+
+NAN_METHOD(Thumbnail) {
+  thumbnailParse(info, true);
+}
@@ -0,0 +1,78 @@
+#include "exports.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+static void transferFreeCallback(char *data, void *hint) {
+  free(data);
+}
+
+int njtParseTransfer(Local<Object> options, bool* transfer, char* errStr) {
+  int retval = 0;
+  Local<Value> transferObject;
+
+  *transfer = false;
+
+  transferObject = options->Get(New("transfer").ToLocalChecked());
+  if (!transferObject->IsUndefined()) {
+    if (!transferObject->IsBoolean()) {
+      _throw("Invalid transfer value");
+    }
+    *transfer = transferObject->IsTrue();
+  }
+
+  bailout:
+  return retval;
+}
+
+// Only a view covering the whole of a non-external ArrayBuffer can be taken
+// over, otherwise we'd pull the memory from under other views (e.g. small
+// Buffers sharing Node's pool) or from whoever owns it.
+bool njtCanTransfer(Local<Object> object) {
+  Local<ArrayBufferView> view;
+  Local<ArrayBuffer> buffer;
+
+  if (!object->IsArrayBufferView()) {
+    return false;
+  }
+
+  view = object.As<ArrayBufferView>();
+  buffer = view->Buffer();
+
+  return !buffer->IsExternal() &&
+    buffer->IsNeuterable() &&
+    view->ByteOffset() == 0 &&
+    view->ByteLength() == buffer->ByteLength() &&
+    view->ByteLength() > 0;
+}
+
+// Detaches the memory from JS, which makes the Buffer (and any other view of
+// it) empty until the memory is handed back with njtReturnTransfer().
+void njtTransferBuffer(Local<Object> object, njt_transfer* transfer) {
+  Local<ArrayBuffer> buffer = object.As<ArrayBufferView>()->Buffer();
+  ArrayBuffer::Contents contents = buffer->Externalize();
+
+  buffer->Neuter();
+  transfer->data = (unsigned char*) contents.Data();
+  transfer->length = contents.ByteLength();
+}
+
+// Node's ArrayBuffer allocator uses malloc(), so the memory can be given to
+// a new Buffer that frees it the same way.
+Local<Object> njtReturnTransfer(njt_transfer* transfer) {
+  Local<Object> bufferObject = NewBuffer((char*) transfer->data, transfer->length, transferFreeCallback, NULL).ToLocalChecked();
+
+  transfer->data = NULL;
+  transfer->length = 0;
+
+  return bufferObject;
+}
+
+// For jobs that failed before the memory could be handed back.
+void njtFreeTransfer(njt_transfer* transfer) {
+  free(transfer->data);
+  transfer->data = NULL;
+  transfer->length = 0;
+}
@@ -0,0 +1,448 @@
+#include "exports.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+int transform(unsigned char* srcData, uint32_t srcLength, tjtransform* transforms, int count, unsigned char** dstData, unsigned long* dstSizes, uint32_t dstBufferLength, char* errStr) {
+  int retval = 0;
+  int err;
+  tjhandle handle = NULL;
+  int flags = 0;
+  int width;
+  int height;
+  int jpegSubsamp;
+  int jpegColorspace;
+  int i;
+
+  handle = njtAcquireHandle(NJT_HANDLE_TRANSFORM);
+  if (handle == NULL) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  // Check the preallocated buffer against the transformed size
+  if (dstBufferLength > 0) {
+    err = tjDecompressHeader3(handle, srcData, srcLength, &width, &height, &jpegSubsamp, &jpegColorspace);
+
+    if (err != 0) {
+      _throw(njtGetErrorStr(handle));
+    }
+
+    if (transforms[0].options & TJXOPT_CROP) {
+      if (transforms[0].r.w > 0) {
+        width = transforms[0].r.w;
+      }
+      if (transforms[0].r.h > 0) {
+        height = transforms[0].r.h;
+      }
+    }
+
+    if (transforms[0].options & TJXOPT_GRAY) {
+      jpegSubsamp = SAMP_GRAY;
+    }
+
+    if (tjBufSize(width, height, jpegSubsamp) > dstBufferLength || tjBufSize(height, width, jpegSubsamp) > dstBufferLength) {
+      _throw("Pontentially insufficient output buffer");
+    }
+
+    flags |= TJFLAG_NOREALLOC;
+  }
+
+  err = tjTransform(handle, srcData, srcLength, count, dstData, dstSizes, transforms, flags);
+
+  if (err != 0) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  bailout:
+  njtReleaseHandle(NJT_HANDLE_TRANSFORM, handle);
+
+  // Output buffers are only ours to free if we allocated them
+  if (retval != 0 && dstBufferLength == 0) {
+    for (i = 0; i < count; i++) {
+      if (dstData[i] != NULL) {
+        tjFree(dstData[i]);
+        dstData[i] = NULL;
+      }
+    }
+  }
+
+  return retval;
+}
+
+static int parseFlag(Local<Object> options, const char* name, int flag, int* transformOptions, char* errStr) {
+  int retval = 0;
+  Local<Value> flagObject;
+
+  flagObject = options->Get(New(name).ToLocalChecked());
+  if (!flagObject->IsUndefined()) {
+    if (!flagObject->IsBoolean()) {
+      snprintf(errStr, NJT_MSG_LENGTH_MAX, "Invalid %s value", name);
+      return -1;
+    }
+    if (flagObject->BooleanValue()) {
+      *transformOptions |= flag;
+    }
+  }
+
+  return retval;
+}
+
+static int parseRegionValue(Local<Object> crop, const char* name, int* value, char* errStr) {
+  Local<Value> valueObject;
+
+  valueObject = crop->Get(New(name).ToLocalChecked());
+  if (!valueObject->IsUndefined()) {
+    if (!valueObject->IsUint32()) {
+      snprintf(errStr, NJT_MSG_LENGTH_MAX, "Invalid crop %s value", name);
+      return -1;
+    }
+    *value = valueObject->Uint32Value();
+  }
+
+  return 0;
+}
+
+int transformParseOptions(Local<Object> options, tjtransform* xform, char* errStr) {
+  int retval = 0;
+  Local<Value> operationObject;
+  Local<Value> cropObject;
+  Local<Object> crop;
+
+  memset(xform, 0, sizeof(tjtransform));
+
+  if (!options->IsObject()) {
+    _throw("Transform must be an object");
+  }
+
+  // Operation
+  operationObject = options->Get(New("operation").ToLocalChecked());
+  if (!operationObject->IsUndefined()) {
+    if (!operationObject->IsUint32()) {
+      _throw("Invalid operation");
+    }
+    xform->op = operationObject->Uint32Value();
+  }
+
+  switch (xform->op) {
+    case TRANSFORM_NONE:
+    case TRANSFORM_HFLIP:
+    case TRANSFORM_VFLIP:
+    case TRANSFORM_TRANSPOSE:
+    case TRANSFORM_TRANSVERSE:
+    case TRANSFORM_ROT90:
+    case TRANSFORM_ROT180:
+    case TRANSFORM_ROT270:
+      break;
+    default:
+      _throw("Invalid operation");
+  }
+
+  // Crop
+  cropObject = options->Get(New("crop").ToLocalChecked());
+  if (!cropObject->IsUndefined()) {
+    if (!cropObject->IsObject()) {
+      _throw("Invalid crop value");
+    }
+    crop = cropObject.As<Object>();
+    if (parseRegionValue(crop, "x", &xform->r.x, errStr) != 0 ||
+        parseRegionValue(crop, "y", &xform->r.y, errStr) != 0 ||
+        parseRegionValue(crop, "width", &xform->r.w, errStr) != 0 ||
+        parseRegionValue(crop, "height", &xform->r.h, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+    xform->options |= TJXOPT_CROP;
+  }
+
+  // Flags
+  if (parseFlag(options, "gray", TJXOPT_GRAY, &xform->options, errStr) != 0 ||
+      parseFlag(options, "perfect", TJXOPT_PERFECT, &xform->options, errStr) != 0 ||
+      parseFlag(options, "trim", TJXOPT_TRIM, &xform->options, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  bailout:
+  return retval;
+}
+
+static Local<Value> transformResult(unsigned char** dstData, unsigned long* dstSizes, int count, bool multiple, Local<Object> dstObject) {
+  Local<Array> results = New<Array>(count);
+  int i;
+
+  for (i = 0; i < count; i++) {
+    Local<Object> obj = New<Object>();
+
+    if (!dstObject.IsEmpty()) {
+      obj->Set(New("data").ToLocalChecked(), dstObject);
+    }
+    else {
+      obj->Set(New("data").ToLocalChecked(), NewBuffer((char*)dstData[i], dstSizes[i], compressBufferFreeCallback, NULL).ToLocalChecked());
+      dstData[i] = NULL;
+    }
+    obj->Set(New("size").ToLocalChecked(), New((uint32_t) dstSizes[i]));
+
+    if (!multiple) {
+      return obj;
+    }
+
+    results->Set(i, obj);
+  }
+
+  return results;
+}
+
+class TransformWorker : public AsyncWorker {
+  public:
+    TransformWorker(Callback *callback, Local<Object> &srcObject, unsigned char* srcData, uint32_t srcLength, tjtransform* transforms, int count, bool multiple, Local<Object> &dstObject, unsigned char** dstData, unsigned long* dstSizes, uint32_t dstBufferLength, Local<Object> &tokenObject, volatile int32_t* cancelled) :
+      AsyncWorker(callback),
+      srcData(srcData),
+      srcLength(srcLength),
+      transforms(transforms),
+      count(count),
+      multiple(multiple),
+      dstData(dstData),
+      dstSizes(dstSizes),
+      dstBufferLength(dstBufferLength),
+      cancelled(cancelled) {
+        SaveToPersistent("srcObject", srcObject);
+        if (dstBufferLength > 0) {
+          SaveToPersistent("dstObject", dstObject);
+        }
+        if (cancelled != NULL) {
+          SaveToPersistent("tokenObject", tokenObject);
+        }
+      }
+
+    ~TransformWorker() {
+      int i;
+
+      if (this->dstBufferLength == 0) {
+        for (i = 0; i < this->count; i++) {
+          if (this->dstData[i] != NULL) {
+            tjFree(this->dstData[i]);
+          }
+        }
+      }
+
+      free(this->transforms);
+      free(this->dstData);
+      free(this->dstSizes);
+    }
+
+    void Execute () {
+      int err;
+
+      // Cancelled while it was still waiting to run
+      if (this->cancelled != NULL && *this->cancelled) {
+        SetErrorMessage("Aborted");
+        return;
+      }
+
+      err = transform(
+          this->srcData,
+          this->srcLength,
+          this->transforms,
+          this->count,
+          this->dstData,
+          this->dstSizes,
+          this->dstBufferLength,
+          this->errStr);
+
+      if(err != 0) {
+        SetErrorMessage(this->errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      Local<Object> dstObject;
+
+      if (this->dstBufferLength > 0) {
+        dstObject = GetFromPersistent("dstObject").As<Object>();
+      }
+
+      Local<Value> argv[] = {
+        Null(),
+        transformResult(this->dstData, this->dstSizes, this->count, this->multiple, dstObject)
+      };
+
+      callback->Call(2, argv);
+    }
+
+  private:
+    unsigned char* srcData;
+    uint32_t srcLength;
+    tjtransform* transforms;
+    int count;
+    bool multiple;
+    unsigned char** dstData;
+    unsigned long* dstSizes;
+    uint32_t dstBufferLength;
+    volatile int32_t* cancelled;
+    char errStr[NJT_MSG_LENGTH_MAX];
+};
+
+void transformParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+  int retval = 0;
+  int cursor = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+
+  // Input
+  Callback *callback = NULL;
+  Local<Object> srcObject;
+  unsigned char* srcData = NULL;
+  uint32_t srcLength = 0;
+  Local<Object> options;
+  Local<Value> transformsObject;
+  Local<Array> transformsArray;
+  tjtransform* transforms = NULL;
+  int count = 1;
+  bool multiple = false;
+  uint32_t priority = PRIORITY_INTERACTIVE;
+  Local<Object> tokenObject;
+  volatile int32_t* cancelled = NULL;
+  int i;
+
+  // Output
+  Local<Object> dstObject;
+  uint32_t dstBufferLength = 0;
+  unsigned char** dstData = NULL;
+  unsigned long* dstSizes = NULL;
+
+  // Try to find callback here, so if we want to throw something we can use callback's err
+  if (async) {
+    if (info[info.Length() - 1]->IsFunction()) {
+      callback = new Callback(info[info.Length() - 1].As<Function>());
+    }
+    else {
+      _throw("Missing callback");
+    }
+  }
+
+  if ((async && info.Length() < 3) || (!async && info.Length() < 2)) {
+    _throw("Too few arguments");
+  }
+
+  // Input buffer
+  srcObject = info[cursor++].As<Object>();
+  if (!Buffer::HasInstance(srcObject)) {
+    _throw("Invalid source buffer");
+  }
+
+  srcData = (unsigned char*) Buffer::Data(srcObject);
+  srcLength = Buffer::Length(srcObject);
+
+  // Options
+  options = info[cursor++].As<Object>();
+
+  // Check if options we just got is actually the destination buffer
+  // If it is, pull new object from info and set that as options
+  if (Buffer::HasInstance(options) && info.Length() > cursor) {
+    dstObject = options;
+    options = info[cursor++].As<Object>();
+    dstBufferLength = Buffer::Length(dstObject);
+  }
+
+  if (!options->IsObject()) {
+    _throw("Options must be an object");
+  }
+
+  // Multiple outputs from a single input
+  transformsObject = options->Get(New("transforms").ToLocalChecked());
+  if (!transformsObject->IsUndefined()) {
+    if (!transformsObject->IsArray() || transformsObject.As<Array>()->Length() == 0) {
+      _throw("Invalid transforms value");
+    }
+    if (dstBufferLength > 0) {
+      _throw("Preallocated output buffer cannot be used with multiple transforms");
+    }
+    transformsArray = transformsObject.As<Array>();
+    count = transformsArray->Length();
+    multiple = true;
+  }
+
+  transforms = (tjtransform*) calloc(count, sizeof(tjtransform));
+  dstData = (unsigned char**) calloc(count, sizeof(unsigned char*));
+  dstSizes = (unsigned long*) calloc(count, sizeof(unsigned long));
+  if (transforms == NULL || dstData == NULL || dstSizes == NULL) {
+    _throw("Unable to allocate transforms");
+  }
+
+  for (i = 0; i < count; i++) {
+    if (transformParseOptions(multiple ? transformsArray->Get(i).As<Object>() : options, &transforms[i], errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+  }
+
+  if (dstBufferLength > 0) {
+    dstData[0] = (unsigned char*) Buffer::Data(dstObject);
+    dstSizes[0] = dstBufferLength;
+  }
+
+  if (njtParsePriority(options, &priority, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  if (njtParseCancelToken(options, &tokenObject, &cancelled, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // Do either async or sync transform
+  if (async) {
+    if (njtPoolFull()) {
+      _throw("Queue is full");
+    }
+    njtQueueWorker(new TransformWorker(callback, srcObject, srcData, srcLength, transforms, count, multiple, dstObject, dstData, dstSizes, dstBufferLength, tokenObject, cancelled), priority, cancelled);
+    return;
+  }
+  else {
+    retval = transform(
+        srcData,
+        srcLength,
+        transforms,
+        count,
+        dstData,
+        dstSizes,
+        dstBufferLength,
+        errStr);
+
+    if(retval != 0) {
+      // transform will set the errStr
+      goto bailout;
+    }
+
+    info.GetReturnValue().Set(transformResult(dstData, dstSizes, count, multiple, dstObject));
+  }
+
+  // If we have error throw error or call callback with error
+  bailout:
+  free(transforms);
+  free(dstData);
+  free(dstSizes);
+
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+NAN_METHOD(TransformSync) {
+  transformParse(info, false);
+}
+
+NAN_METHOD(Transform) {
+  transformParse(info, true);
+}
@@ -0,0 +1,778 @@
+#include <limits.h>
+
+#include "exports.h"
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+#define NJT_MAX_PLANES 3
+
+static int planeCount(int jpegSubsamp) {
+  return jpegSubsamp == SAMP_GRAY ? 1 : 3;
+}
+
+// Fills in default strides and rejects ones that are shorter than a plane row,
+// since TurboJPEG would happily write past the end of the plane otherwise.
+// Sizes are worked out in 64 bits so that huge strides can't wrap around.
+static int checkStrides(int width, int height, int jpegSubsamp, int* strides, uint32_t* planeLengths, char* errStr) {
+  int retval = 0;
+  int i;
+  int planeWidth;
+  int planeHeight;
+  uint64_t planeLength;
+
+  for (i = 0; i < planeCount(jpegSubsamp); i++) {
+    planeWidth = tjPlaneWidth(i, width, jpegSubsamp);
+    planeHeight = tjPlaneHeight(i, height, jpegSubsamp);
+
+    if (planeWidth < 0 || planeHeight < 0) {
+      _throw("Invalid plane dimensions");
+    }
+
+    if (strides[i] == 0) {
+      strides[i] = planeWidth;
+    }
+    else if (strides[i] < planeWidth) {
+      _throw("Invalid stride value");
+    }
+
+    planeLength = (uint64_t) strides[i] * planeHeight;
+    if (planeLength > UINT32_MAX) {
+      _throw("Plane too large");
+    }
+    planeLengths[i] = (uint32_t) planeLength;
+  }
+
+  bailout:
+  return retval;
+}
+
+// Makes sure that every plane is large enough for the given strides. The last
+// row only needs to be as wide as the plane, not the whole stride.
+static int checkPlanes(int width, int height, int jpegSubsamp, int* strides, uint32_t* lengths, char* errStr) {
+  int retval = 0;
+  int i;
+  uint32_t planeLengths[NJT_MAX_PLANES];
+
+  if (checkStrides(width, height, jpegSubsamp, strides, planeLengths, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  for (i = 0; i < planeCount(jpegSubsamp); i++) {
+    if ((uint64_t) lengths[i] < (uint64_t) planeLengths[i] - strides[i] + tjPlaneWidth(i, width, jpegSubsamp)) {
+      _throw("Insufficient plane buffer");
+    }
+  }
+
+  bailout:
+  return retval;
+}
+
+int compressYUV(unsigned char** srcPlanes, int* strides, uint32_t* srcLengths, uint32_t width, uint32_t height, uint32_t jpegSubsamp, int quality, unsigned long* jpegSize, unsigned char** dstData, uint32_t dstBufferLength, char* errStr) {
+  int retval = 0;
+  int err;
+
+  tjhandle handle = NULL;
+  int flags = TJFLAG_FASTDCT;
+  uint32_t dstLength = 0;
+
+  switch (jpegSubsamp) {
+    case SAMP_444:
+    case SAMP_422:
+    case SAMP_420:
+    case SAMP_GRAY:
+    case SAMP_440:
+      break;
+    default:
+      _throw("Invalid subsampling method");
+  }
+
+  if (checkPlanes(width, height, jpegSubsamp, strides, srcLengths, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // Set up buffers if required
+  dstLength = tjBufSize(width, height, jpegSubsamp);
+  if (dstBufferLength > 0) {
+    if (dstLength > dstBufferLength) {
+      _throw("Pontentially insufficient output buffer");
+    }
+    flags |= TJFLAG_NOREALLOC;
+  }
+
+  handle = njtAcquireHandle(NJT_HANDLE_COMPRESS);
+  if (handle == NULL) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  err = tjCompressFromYUVPlanes(handle, (const unsigned char**) srcPlanes, width, strides, height, jpegSubsamp, dstData, jpegSize, quality, flags);
+
+  if (err != 0) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  bailout:
+  njtReleaseHandle(NJT_HANDLE_COMPRESS, handle);
+
+  // The output buffer is only ours to free if we allocated it
+  if (retval != 0 && dstBufferLength == 0 && *dstData != NULL) {
+    tjFree(*dstData);
+    *dstData = NULL;
+  }
+
+  return retval;
+}
+
+// If dstLengths is NULL the planes are allocated here and must be freed by
+// the caller, otherwise the given planes are checked and used as is.
+int decompressYUV(unsigned char* srcData, uint32_t srcLength, int* width, int* height, int* jpegSubsamp, unsigned char** dstPlanes, int* strides, uint32_t* dstLengths, uint32_t* planeLengths, char* errStr) {
+  int retval = 0;
+  int err;
+  tjhandle handle = NULL;
+  int jpegColorspace;
+  int i;
+
+  handle = njtAcquireHandle(NJT_HANDLE_DECOMPRESS);
+  if (handle == NULL) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  err = tjDecompressHeader3(handle, srcData, srcLength, width, height, jpegSubsamp, &jpegColorspace);
+
+  if (err != 0) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  // Strides must be checked before anything is allocated for them
+  if (checkStrides(*width, *height, *jpegSubsamp, strides, planeLengths, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  if (dstLengths != NULL) {
+    if (checkPlanes(*width, *height, *jpegSubsamp, strides, dstLengths, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+  }
+  else {
+    for (i = 0; i < planeCount(*jpegSubsamp); i++) {
+      dstPlanes[i] = (unsigned char*) malloc(planeLengths[i]);
+      if (dstPlanes[i] == NULL) {
+        _throw("Unable to allocate plane");
+      }
+    }
+  }
+
+  err = tjDecompressToYUVPlanes(handle, srcData, srcLength, dstPlanes, *width, strides, *height, TJFLAG_FASTDCT);
+
+  if (err != 0) {
+    _throw(njtGetErrorStr(handle));
+  }
+
+  bailout:
+  njtReleaseHandle(NJT_HANDLE_DECOMPRESS, handle);
+
+  // Planes are only ours to free if we allocated them
+  if (retval != 0 && dstLengths == NULL) {
+    for (i = 0; i < NJT_MAX_PLANES; i++) {
+      free(dstPlanes[i]);
+      dstPlanes[i] = NULL;
+    }
+  }
+
+  return retval;
+}
+
+// Reads an Array of plane Buffers.
+static int parsePlanes(Local<Value> planesObject, unsigned char** planes, uint32_t* lengths, char* errStr) {
+  int retval = 0;
+  Local<Array> planesArray;
+  Local<Value> planeObject;
+  uint32_t i;
+
+  if (!planesObject->IsArray()) {
+    _throw("Planes must be an array");
+  }
+  planesArray = planesObject.As<Array>();
+
+  if (planesArray->Length() != 1 && planesArray->Length() != NJT_MAX_PLANES) {
+    _throw("Invalid number of planes");
+  }
+
+  for (i = 0; i < planesArray->Length(); i++) {
+    planeObject = planesArray->Get(i);
+    if (!Buffer::HasInstance(planeObject)) {
+      _throw("Invalid plane buffer");
+    }
+    planes[i] = (unsigned char*) Buffer::Data(planeObject);
+    lengths[i] = Buffer::Length(planeObject);
+  }
+
+  bailout:
+  return retval;
+}
+
+static int parseStrides(Local<Object> options, int* strides, char* errStr) {
+  int retval = 0;
+  Local<Value> stridesObject;
+  Local<Array> stridesArray;
+  Local<Value> strideObject;
+  uint32_t i;
+
+  stridesObject = options->Get(New("strides").ToLocalChecked());
+  if (stridesObject->IsUndefined()) {
+    return 0;
+  }
+  if (!stridesObject->IsArray()) {
+    _throw("Invalid strides value");
+  }
+  stridesArray = stridesObject.As<Array>();
+
+  for (i = 0; i < stridesArray->Length() && i < NJT_MAX_PLANES; i++) {
+    strideObject = stridesArray->Get(i);
+    if (!strideObject->IsUint32() || strideObject->Uint32Value() > INT_MAX) {
+      _throw("Invalid stride value");
+    }
+    strides[i] = strideObject->Uint32Value();
+  }
+
+  bailout:
+  return retval;
+}
+
+static Local<Array> newStrideArray(int* strides, int count) {
+  Local<Array> array = New<Array>(count);
+  int i;
+
+  for (i = 0; i < count; i++) {
+    array->Set(i, New(strides[i]));
+  }
+
+  return array;
+}
+
+class CompressYUVWorker : public AsyncWorker {
+  public:
+    CompressYUVWorker(Callback *callback, Local<Object> &planesObject, unsigned char** srcPlanes, int* strides, uint32_t* srcLengths, uint32_t width, uint32_t height, uint32_t jpegSubsamp, int quality, Local<Object> &dstObject, unsigned char* dstData, uint32_t dstBufferLength, Local<Object> &tokenObject, volatile int32_t* cancelled) :
+      AsyncWorker(callback),
+      width(width),
+      height(height),
+      jpegSubsamp(jpegSubsamp),
+      quality(quality),
+      jpegSize(0),
+      dstData(dstData),
+      dstBufferLength(dstBufferLength),
+      cancelled(cancelled) {
+        memcpy(this->srcPlanes, srcPlanes, sizeof(this->srcPlanes));
+        memcpy(this->strides, strides, sizeof(this->strides));
+        memcpy(this->srcLengths, srcLengths, sizeof(this->srcLengths));
+        SaveToPersistent("planesObject", planesObject);
+        if (dstBufferLength > 0) {
+          SaveToPersistent("dstObject", dstObject);
+        }
+        if (cancelled != NULL) {
+          SaveToPersistent("tokenObject", tokenObject);
+        }
+      }
+
+    ~CompressYUVWorker() {}
+
+    void Execute () {
+      int err;
+
+      // Cancelled while it was still waiting to run
+      if (this->cancelled != NULL && *this->cancelled) {
+        SetErrorMessage("Aborted");
+        return;
+      }
+
+      err = compressYUV(
+          this->srcPlanes,
+          this->strides,
+          this->srcLengths,
+          this->width,
+          this->height,
+          this->jpegSubsamp,
+          this->quality,
+          &this->jpegSize,
+          &this->dstData,
+          this->dstBufferLength,
+          this->errStr);
+
+      if(err != 0) {
+        SetErrorMessage(this->errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      Local<Object> obj = New<Object>();
+      Local<Object> dstObject;
+
+      if (this->dstBufferLength > 0) {
+        dstObject = GetFromPersistent("dstObject").As<Object>();
+      }
+      else {
+        dstObject = NewBuffer((char*)this->dstData, this->jpegSize, compressBufferFreeCallback, NULL).ToLocalChecked();
+      }
+
+      obj->Set(New("data").ToLocalChecked(), dstObject);
+      obj->Set(New("size").ToLocalChecked(), New((uint32_t) this->jpegSize));
+
+      Local<Value> argv[] = {
+        Null(),
+        obj
+      };
+
+      callback->Call(2, argv);
+    }
+
+  private:
+    unsigned char* srcPlanes[NJT_MAX_PLANES];
+    int strides[NJT_MAX_PLANES];
+    uint32_t srcLengths[NJT_MAX_PLANES];
+    uint32_t width;
+    uint32_t height;
+    uint32_t jpegSubsamp;
+    int quality;
+    unsigned long jpegSize;
+    unsigned char* dstData;
+    uint32_t dstBufferLength;
+    volatile int32_t* cancelled;
+    char errStr[NJT_MSG_LENGTH_MAX];
+};
+
+void compressYUVParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+  int retval = 0;
+  int cursor = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+
+  // Input
+  Callback *callback = NULL;
+  Local<Object> planesObject;
+  unsigned char* srcPlanes[NJT_MAX_PLANES] = {NULL, NULL, NULL};
+  uint32_t srcLengths[NJT_MAX_PLANES] = {0, 0, 0};
+  int strides[NJT_MAX_PLANES] = {0, 0, 0};
+  Local<Object> dstObject;
+  uint32_t dstBufferLength = 0;
+  unsigned char* dstData = NULL;
+  Local<Object> options;
+  Local<Value> sampObject;
+  uint32_t jpegSubsamp = NJT_DEFAULT_SUBSAMPLING;
+  Local<Value> widthObject;
+  uint32_t width = 0;
+  Local<Value> heightObject;
+  uint32_t height = 0;
+  Local<Value> qualityObject;
+  int quality = NJT_DEFAULT_QUALITY;
+  uint32_t priority = PRIORITY_INTERACTIVE;
+  Local<Object> tokenObject;
+  volatile int32_t* cancelled = NULL;
+
+  // Output
+  unsigned long jpegSize = 0;
+
+  // Try to find callback here, so if we want to throw something we can use callback's err
+  if (async) {
+    if (info[info.Length() - 1]->IsFunction()) {
+      callback = new Callback(info[info.Length() - 1].As<Function>());
+    }
+    else {
+      _throw("Missing callback");
+    }
+  }
+
+  if ((async && info.Length() < 3) || (!async && info.Length() < 2)) {
+    _throw("Too few arguments");
+  }
+
+  // Input planes
+  planesObject = info[cursor++].As<Object>();
+  if (parsePlanes(planesObject, srcPlanes, srcLengths, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // Options
+  options = info[cursor++].As<Object>();
+
+  // Check if options we just got is actually the destination buffer
+  // If it is, pull new object from info and set that as options
+  if (Buffer::HasInstance(options) && info.Length() > cursor) {
+    dstObject = options;
+    options = info[cursor++].As<Object>();
+    dstBufferLength = Buffer::Length(dstObject);
+    dstData = (unsigned char*) Buffer::Data(dstObject);
+  }
+
+  if (!options->IsObject()) {
+    _throw("Options must be an object");
+  }
+
+  // Subsampling
+  sampObject = options->Get(New("subsampling").ToLocalChecked());
+  if (!sampObject->IsUndefined()) {
+    if (!sampObject->IsUint32()) {
+      _throw("Invalid subsampling method");
+    }
+    jpegSubsamp = sampObject->Uint32Value();
+  }
+
+  if (planesObject.As<Array>()->Length() != (uint32_t) planeCount(jpegSubsamp)) {
+    _throw("Invalid number of planes");
+  }
+
+  // Width
+  widthObject = options->Get(New("width").ToLocalChecked());
+  if (widthObject->IsUndefined()) {
+    _throw("Missing width");
+  }
+  if (!widthObject->IsUint32()) {
+    _throw("Invalid width value");
+  }
+  width = widthObject->Uint32Value();
+
+  // Height
+  heightObject = options->Get(New("height").ToLocalChecked());
+  if (heightObject->IsUndefined()) {
+    _throw("Missing height");
+  }
+  if (!heightObject->IsUint32()) {
+    _throw("Invalid height value");
+  }
+  height = heightObject->Uint32Value();
+
+  // Strides
+  if (parseStrides(options, strides, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // Quality
+  qualityObject = options->Get(New("quality").ToLocalChecked());
+  if (!qualityObject->IsUndefined()) {
+    if (!qualityObject->IsUint32() || qualityObject->Uint32Value() > 100) {
+      _throw("Invalid quality value");
+    }
+    quality = qualityObject->Uint32Value();
+  }
+
+  if (njtParsePriority(options, &priority, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  if (njtParseCancelToken(options, &tokenObject, &cancelled, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // Do either async or sync compress
+  if (async) {
+    if (njtPoolFull()) {
+      _throw("Queue is full");
+    }
+    njtQueueWorker(new CompressYUVWorker(callback, planesObject, srcPlanes, strides, srcLengths, width, height, jpegSubsamp, quality, dstObject, dstData, dstBufferLength, tokenObject, cancelled), priority, cancelled);
+    return;
+  }
+  else {
+    retval = compressYUV(
+        srcPlanes,
+        strides,
+        srcLengths,
+        width,
+        height,
+        jpegSubsamp,
+        quality,
+        &jpegSize,
+        &dstData,
+        dstBufferLength,
+        errStr);
+
+    if(retval != 0) {
+      // compressYUV will set the errStr
+      goto bailout;
+    }
+    Local<Object> obj = New<Object>();
+    if (dstBufferLength == 0) {
+      dstObject = NewBuffer((char*)dstData, jpegSize, compressBufferFreeCallback, NULL).ToLocalChecked();
+    }
+
+    obj->Set(New("data").ToLocalChecked(), dstObject);
+    obj->Set(New("size").ToLocalChecked(), New((uint32_t) jpegSize));
+    info.GetReturnValue().Set(obj);
+    return;
+  }
+
+  // If we have error throw error or call callback with error
+  bailout:
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+// Builds the result object, handing over any planes we allocated ourselves.
+static Local<Object> decompressYUVResult(Local<Array> dstArray, unsigned char** dstPlanes, int* strides, uint32_t* planeLengths, int width, int height, int jpegSubsamp) {
+  Local<Object> obj = New<Object>();
+  int i;
+
+  if (dstArray.IsEmpty()) {
+    dstArray = New<Array>(planeCount(jpegSubsamp));
+    for (i = 0; i < planeCount(jpegSubsamp); i++) {
+      dstArray->Set(i, NewBuffer((char*)dstPlanes[i], planeLengths[i], decompressBufferFreeCallback, NULL).ToLocalChecked());
+      dstPlanes[i] = NULL;
+    }
+  }
+
+  obj->Set(New("planes").ToLocalChecked(), dstArray);
+  obj->Set(New("strides").ToLocalChecked(), newStrideArray(strides, planeCount(jpegSubsamp)));
+  obj->Set(New("width").ToLocalChecked(), New(width));
+  obj->Set(New("height").ToLocalChecked(), New(height));
+  obj->Set(New("subsampling").ToLocalChecked(), New(jpegSubsamp));
+
+  return obj;
+}
+
+class DecompressYUVWorker : public AsyncWorker {
+  public:
+    DecompressYUVWorker(Callback *callback, Local<Object> &srcObject, unsigned char* srcData, uint32_t srcLength, Local<Object> &dstObject, unsigned char** dstPlanes, int* strides, uint32_t* dstLengths, Local<Object> &tokenObject, volatile int32_t* cancelled) :
+      AsyncWorker(callback),
+      srcData(srcData),
+      srcLength(srcLength),
+      preallocated(!dstObject.IsEmpty()),
+      width(0),
+      height(0),
+      jpegSubsamp(0),
+      cancelled(cancelled) {
+        memcpy(this->dstPlanes, dstPlanes, sizeof(this->dstPlanes));
+        memcpy(this->strides, strides, sizeof(this->strides));
+        memcpy(this->dstLengths, dstLengths, sizeof(this->dstLengths));
+        SaveToPersistent("srcObject", srcObject);
+        if (this->preallocated) {
+          SaveToPersistent("dstObject", dstObject);
+        }
+        if (cancelled != NULL) {
+          SaveToPersistent("tokenObject", tokenObject);
+        }
+      }
+
+    ~DecompressYUVWorker() {
+      int i;
+
+      if (!this->preallocated) {
+        for (i = 0; i < NJT_MAX_PLANES; i++) {
+          free(this->dstPlanes[i]);
+        }
+      }
+    }
+
+    void Execute () {
+      int err;
+
+      // Cancelled while it was still waiting to run
+      if (this->cancelled != NULL && *this->cancelled) {
+        SetErrorMessage("Aborted");
+        return;
+      }
+
+      err = decompressYUV(
+          this->srcData,
+          this->srcLength,
+          &this->width,
+          &this->height,
+          &this->jpegSubsamp,
+          this->dstPlanes,
+          this->strides,
+          this->preallocated ? this->dstLengths : NULL,
+          this->planeLengths,
+          this->errStr);
+
+      if(err != 0) {
+        SetErrorMessage(this->errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      Local<Array> dstArray;
+
+      if (this->preallocated) {
+        dstArray = GetFromPersistent("dstObject").As<Array>();
+      }
+
+      Local<Value> argv[] = {
+        Null(),
+        decompressYUVResult(dstArray, this->dstPlanes, this->strides, this->planeLengths, this->width, this->height, this->jpegSubsamp)
+      };
+
+      callback->Call(2, argv);
+    }
+
+  private:
+    unsigned char* srcData;
+    uint32_t srcLength;
+    bool preallocated;
+    unsigned char* dstPlanes[NJT_MAX_PLANES];
+    int strides[NJT_MAX_PLANES];
+    uint32_t dstLengths[NJT_MAX_PLANES];
+    uint32_t planeLengths[NJT_MAX_PLANES];
+    int width;
+    int height;
+    int jpegSubsamp;
+    volatile int32_t* cancelled;
+    char errStr[NJT_MSG_LENGTH_MAX];
+};
+
+void decompressYUVParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+  int retval = 0;
+  int cursor = 0;
+  char errStr[NJT_MSG_LENGTH_MAX];
+
+  // Input
+  Callback *callback = NULL;
+  Local<Object> srcObject;
+  unsigned char* srcData = NULL;
+  uint32_t srcLength = 0;
+  Local<Object> options;
+  uint32_t priority = PRIORITY_INTERACTIVE;
+  Local<Object> tokenObject;
+  volatile int32_t* cancelled = NULL;
+
+  // Output
+  Local<Object> dstObject;
+  unsigned char* dstPlanes[NJT_MAX_PLANES] = {NULL, NULL, NULL};
+  uint32_t dstLengths[NJT_MAX_PLANES] = {0, 0, 0};
+  uint32_t planeLengths[NJT_MAX_PLANES] = {0, 0, 0};
+  int strides[NJT_MAX_PLANES] = {0, 0, 0};
+  int width;
+  int height;
+  int jpegSubsamp;
+
+  // Try to find callback here, so if we want to throw something we can use callback's err
+  if (async) {
+    if (info[info.Length() - 1]->IsFunction()) {
+      callback = new Callback(info[info.Length() - 1].As<Function>());
+    }
+    else {
+      _throw("Missing callback");
+    }
+  }
+
+  if ((async && info.Length() < 2) || (!async && info.Length() < 1)) {
+    _throw("Too few arguments");
+  }
+
+  // Input buffer
+  srcObject = info[cursor++].As<Object>();
+  if (!Buffer::HasInstance(srcObject)) {
+    _throw("Invalid source buffer");
+  }
+
+  srcData = (unsigned char*) Buffer::Data(srcObject);
+  srcLength = Buffer::Length(srcObject);
+
+  // Options
+  options = info[cursor++].As<Object>();
+
+  // Check if options we just got is actually the destination planes
+  // If it is, pull new object from info and set that as options
+  if (options->IsArray()) {
+    dstObject = options;
+    options = info[cursor++].As<Object>();
+    if (parsePlanes(dstObject, dstPlanes, dstLengths, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+  }
+
+  // Options are optional
+  if (options->IsObject()) {
+    if (parseStrides(options, strides, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+
+    if (njtParsePriority(options, &priority, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+
+    if (njtParseCancelToken(options, &tokenObject, &cancelled, errStr) != 0) {
+      retval = -1;
+      goto bailout;
+    }
+  }
+
+  // Do either async or sync decompress
+  if (async) {
+    if (njtPoolFull()) {
+      _throw("Queue is full");
+    }
+    njtQueueWorker(new DecompressYUVWorker(callback, srcObject, srcData, srcLength, dstObject, dstPlanes, strides, dstLengths, tokenObject, cancelled), priority, cancelled);
+    return;
+  }
+  else {
+    retval = decompressYUV(
+        srcData,
+        srcLength,
+        &width,
+        &height,
+        &jpegSubsamp,
+        dstPlanes,
+        strides,
+        dstObject.IsEmpty() ? NULL : dstLengths,
+        planeLengths,
+        errStr);
+
+    if(retval != 0) {
+      // decompressYUV will set the errStr
+      goto bailout;
+    }
+
+    info.GetReturnValue().Set(decompressYUVResult(dstObject.As<Array>(), dstPlanes, strides, planeLengths, width, height, jpegSubsamp));
+    return;
+  }
+
+  // If we have error throw error or call callback with error
+  bailout:
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+NAN_METHOD(CompressYUVSync) {
+  compressYUVParse(info, false);
+}
+
+NAN_METHOD(CompressYUV) {
+  compressYUVParse(info, true);
+}
+
+NAN_METHOD(DecompressYUVSync) {
+  decompressYUVParse(info, false);
+}
+
+NAN_METHOD(DecompressYUV) {
+  decompressYUVParse(info, true);
+}
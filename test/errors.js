@@ -0,0 +1,93 @@
+// Hundreds of concurrent async calls, some failing and some not, must each
+// get their own result. In particular a failing call must never report the
+// error message of some other call running at the same time, even with a
+// libjpeg-turbo older than 2.0, whose TurboJPEG API shares one error buffer
+// between all threads. Runs once on the libuv thread pool and once on the
+// native pool.
+
+var assert = require('assert')
+
+var jpg = require('..')
+
+var CALLS = 800
+
+var width = 64
+var height = 48
+var raw = Buffer.alloc(width * height * 3)
+for (var i = 0; i < raw.length; ++i) {
+  raw[i] = (i * 7) & 255
+}
+
+var image = jpg.compressSync(raw, {
+  format: jpg.FORMAT_RGB,
+  width: width,
+  height: height,
+})
+
+function hex(value) {
+  return '0x' + ('0' + value.toString(16)).slice(-2)
+}
+
+// Each call returns a Promise that resolves once its outcome has been
+// checked. Errors from libjpeg mention the first bytes of the input, so
+// every garbage buffer fails with a message of its own.
+function call(i) {
+  var garbage
+
+  switch (i % 5) {
+    case 0:
+      return jpg.decompress(image, {format: jpg.FORMAT_RGB}).then(function(out) {
+        assert.strictEqual(out.width, width)
+        assert.strictEqual(out.height, height)
+        assert.strictEqual(out.data.length, width * height * 3)
+      })
+    case 1:
+      garbage = Buffer.alloc(256, i & 255)
+      garbage[0] = (i >> 3) & 127
+      garbage[1] = i & 255
+      return jpg.decompress(garbage).then(function() {
+        assert.fail('garbage ' + i + ' decompressed')
+      }, function(err) {
+        assert.strictEqual(err.message,
+          'Not a JPEG file: starts with ' + hex(garbage[0]) + ' ' + hex(garbage[1]))
+      })
+    case 2:
+      return jpg.decompress(image, Buffer.alloc(16), {format: jpg.FORMAT_RGB}).then(function() {
+        assert.fail('call ' + i + ' fit in a tiny buffer')
+      }, function(err) {
+        assert.strictEqual(err.message, 'Insufficient output buffer')
+      })
+    case 3:
+      return jpg.decompress(image, {
+        format: jpg.FORMAT_RGB,
+        region: {x: 0, y: 0, width: width + 1, height: height},
+      }).then(function() {
+        assert.fail('call ' + i + ' decoded outside the image')
+      }, function(err) {
+        assert.strictEqual(err.message, 'Region out of bounds')
+      })
+    default:
+      return jpg.compress(raw, {
+        format: jpg.FORMAT_RGB,
+        width: width,
+        height: height,
+      }).then(function(out) {
+        assert(out.size > 0)
+      })
+  }
+}
+
+function run() {
+  var calls = []
+
+  for (var i = 0; i < CALLS; ++i) {
+    calls.push(call(i))
+  }
+
+  return Promise.all(calls)
+}
+
+module.exports = run().then(function() {
+  jpg.configurePool({threads: 8})
+  return run()
+})
@@ -0,0 +1,21 @@
+// Runs every check in this directory. Each one throws (or exits with a
+// non-zero code) on failure.
+//
+//   npm test
+
+var fs = require('fs')
+var path = require('path')
+
+fs.readdirSync(__dirname).filter(function(file) {
+  return file !== 'index.js' && path.extname(file) === '.js'
+}).sort().reduce(function(previous, file) {
+  return previous.then(function() {
+    console.error('# %s', file)
+    return require('./' + file)
+  })
+}, Promise.resolve()).then(function() {
+  console.error('# ok')
+}, function(err) {
+  console.error(err.stack || err)
+  process.exit(1)
+})
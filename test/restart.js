@@ -0,0 +1,69 @@
+// Decoding an image with restart markers in parallel bands must give
+// exactly the same pixels as decoding it on a single thread, including at
+// the band edges where fancy upsampling needs context from the neighboring
+// band.
+
+var assert = require('assert')
+
+var jpg = require('..')
+
+var SAMPLINGS = ['SAMP_444', 'SAMP_422', 'SAMP_420', 'SAMP_440', 'SAMP_GRAY']
+var SCALES = [1, 0.5, 0.375, 0.125]
+
+function image(width, height) {
+  var raw = Buffer.alloc(width * height * 3)
+  var seed = 7
+
+  for (var y = 0; y < height; ++y) {
+    for (var x = 0; x < width; ++x) {
+      for (var c = 0; c < 3; ++c) {
+        seed = (seed * 1103515245 + 12345) >>> 0
+        raw[(y * width + x) * 3 + c] =
+          (x * (c + 1) + y * (3 - c) * 2 + (seed >>> 27) +
+            (((x / 13 | 0) + (y / 7 | 0)) & 1 ? 90 : 0)) & 255
+      }
+    }
+  }
+
+  return raw
+}
+
+var width = 203
+var height = 189
+var raw = image(width, height)
+
+SAMPLINGS.forEach(function(sampling) {
+  [1, 2, 3].forEach(function(restartRows) {
+    var data = jpg.compressSync(raw, {
+      format: jpg.FORMAT_RGB,
+      width: width,
+      height: height,
+      subsampling: jpg[sampling],
+      restartRows: restartRows,
+    })
+
+    SCALES.forEach(function(scale) {
+      [false, true].forEach(function(fastUpsample) {
+        var options = {
+          format: jpg.FORMAT_RGBA,
+          scale: scale,
+          fastUpsample: fastUpsample,
+          threads: 1,
+        }
+        var expected = jpg.decompressSync(data, options)
+
+        ;[0, 2, 3, 5, 8].forEach(function(threads) {
+          options.threads = threads
+          var actual = jpg.decompressSync(data, options)
+
+          assert.strictEqual(actual.width, expected.width)
+          assert.strictEqual(actual.height, expected.height)
+          assert.ok(actual.data.equals(expected.data),
+            sampling + ' restartRows ' + restartRows + ' scale ' + scale +
+            (fastUpsample ? ' fastUpsample' : '') + ' threads ' + threads +
+            ' differs from a single-threaded decode')
+        })
+      })
+    })
+  })
+})